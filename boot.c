@@ -147,7 +147,7 @@ eyrie_boot(uintptr_t dummy, // $a0 contains the return value from the SBI
 
   //TODO: This should be set by walking the userspace vm and finding
   //highest used addr. Instead we start partway through the anon space
-  set_program_break(EYRIE_ANON_REGION_START + (1024 * 1024 * 1024));
+  init_program_break(EYRIE_ANON_REGION_START + (1024 * 1024 * 1024));
 
   #ifdef USE_PAGING
   init_paging(user_paddr, free_paddr);
@@ -7,6 +7,8 @@
 
 #include "paging.h"
 #include "compiler.h"
+#include "merk_integrity.h"
+#include "merk_pool.h"
 #ifdef USE_SHA3_ROCC
 #include "sha3.h"
 #include "encoding.h"
@@ -15,107 +17,61 @@
 #include "sha256.h"
 #endif
 
-#ifndef MERK_SILENT
-#define MERK_LOG printf
-#else
-#define MERK_LOG(...)
-#endif
-
 const uintptr_t unavailable = 0;
 
-_Static_assert(sizeof(bpt_merkle_node_t) == 320, "bpt_merkle_node_t is not 320 bytes!");
-
-#define BPT_MERK_NODES_PER_PAGE (RISCV_PAGE_SIZE / sizeof(bpt_merkle_node_t))
+// no legitimate tree of degree 3 or more is this deep, so walks stop here
+// rather than follow a loop planted in the untrusted nodes
+#define BPT_MAX_DEPTH 32
 
-typedef struct bpt_merkle_page_freelist {
-  uint64_t free[BPT_MERK_NODES_PER_PAGE / 12];
-  uint16_t free_count;
-  bool in_freelist;
-  struct bpt_merkle_page_freelist* next;
-} bpt_merkle_page_freelist_t;
+_Static_assert(
+    sizeof(bpt_merkle_node_t) == BPT_NODE_BYTES(BPT_DEGREE),
+    "bpt_merkle_node_t does not match BPT_NODE_BYTES(BPT_DEGREE)!");
+_Static_assert(
+    BPT_DEGREE >= 3 && BPT_DEGREE < INT8_MAX, "BPT_DEGREE is out of range!");
 
+// Layouts for the degrees we build with
+_Static_assert(BPT_NODE_BYTES(5) == 512, "degree 5 node is not 512 bytes!");
+_Static_assert(BPT_NODE_BYTES(8) == 704, "degree 8 node is not 704 bytes!");
+_Static_assert(BPT_NODE_BYTES(16) == 1280, "degree 16 node is not 1280 bytes!");
+_Static_assert(BPT_NODE_BYTES(32) == 2432, "degree 32 node is not 2432 bytes!");
 _Static_assert(
-    sizeof(bpt_merkle_page_freelist_t) <= sizeof(bpt_merkle_node_t),
-    "bpt_merkle_page_freelist does not fit in one bpt_merkle_node_t!");
+    BPT_NODE_BYTES(BPT_PAGE_DEGREE) <= RISCV_PAGE_SIZE &&
+        BPT_NODE_BYTES(BPT_PAGE_DEGREE + 1) > RISCV_PAGE_SIZE,
+    "BPT_PAGE_DEGREE is not the largest page-sized degree!");
 
-static bpt_merkle_page_freelist_t*
-bpt_merk_alloc_page(void) {
-  void* page                        = (void*)paging_alloc_backing_page();
-  bpt_merkle_page_freelist_t* free_list = (bpt_merkle_page_freelist_t*)page;
-  memset(free_list, 0, sizeof(*free_list));
+// Nodes too big to share a page with the pool's header get a page each
+static merk_pool_t bpt_merk_pool = MERK_POOL_INIT(bpt_merkle_node_t);
 
-  for (size_t i = 0; i < BPT_MERK_NODES_PER_PAGE; i += 12) {
-    size_t this_page_nodes = BPT_MERK_NODES_PER_PAGE - i;
-    free_list->free[i / 12] =
-        (this_page_nodes < 12) * (1ull << this_page_nodes) - 1;
-  }
-  free_list->free[0] &= ~(uint64_t)1;
-  free_list->free_count = BPT_MERK_NODES_PER_PAGE - 1;
-
-  return free_list;
+static inline bpt_merkle_node_t*
+bpt_merk_alloc_node(void) {
+  return (bpt_merkle_node_t*)merk_pool_alloc(&bpt_merk_pool);
 }
 
-
-static bpt_merkle_page_freelist_t* bpt_merk_free_list = NULL;
-
-static bpt_merkle_node_t*
-bpt_merk_reserve_node_in_page(bpt_merkle_page_freelist_t* free_list) {
-  if (!free_list->free_count) return NULL;
-
-  for (size_t i = 0; i < BPT_MERK_NODES_PER_PAGE / 12; i++) {
-    if (free_list->free[i]) {
-      size_t free_idx = __builtin_ctzll(free_list->free[i]);
-      free_list->free[i] &= ~(1ull << free_idx);
-      free_list->free_count--;
-
-      bpt_merkle_node_t* page = (bpt_merkle_node_t*)free_list;
-      assert(free_idx != 0);
-
-      return page + free_idx;
-    }
-  }
-  return NULL;
+// Place a new node in the page of a sibling it is split from or built next to
+static inline bpt_merkle_node_t*
+bpt_merk_alloc_node_near(const bpt_merkle_node_t* hint) {
+  return (bpt_merkle_node_t*)merk_pool_alloc_near(&bpt_merk_pool, hint);
 }
 
 
-static bpt_merkle_node_t*
-bpt_merk_alloc_node(void) {
-  while (bpt_merk_free_list && bpt_merk_free_list->free_count == 0) {
-    // Clear out the unfree lists
-    bpt_merk_free_list->in_freelist = false;
-    bpt_merk_free_list              = bpt_merk_free_list->next;
-  }
-
-  if (!bpt_merk_free_list) {
-    bpt_merk_free_list              = bpt_merk_alloc_page();
-    bpt_merk_free_list->in_freelist = true;
-  }
-
-  bpt_merkle_node_t* out = bpt_merk_reserve_node_in_page(bpt_merk_free_list);
-  memset(out, 0, sizeof(*out));
-  return out;
-}
+/* Slot tree: entry 1 is the node hash, entries 2..BPT_ITREE_SIZE-1 are
+ * stored in node->itree, and entry BPT_ITREE_SIZE + k is the hash of slot k
+ * (a leaf's data or a child's hash). Subtrees that only cover unused slots
+ * are all zeros, so a freshly zeroed node is already consistent. */
+#define BPT_ITREE_SIZE BPT_ITREE_LEAVES(BPT_DEGREE)
 
+static const uint8_t bpt_merk_empty_hash[32] = {0};
 
 static void
-bpt_merk_calculate_node_hash(bpt_merkle_node_t* node, uint8_t calculated_hash[32]){
+bpt_merk_hash_pair(
+    const uint8_t left[32], const uint8_t right[32], uint8_t out[32]) {
   #if defined (USE_SHA3_ROCC)
-  uint8_t data_to_be_hashed[32 * BPT_DEGREE] __aligned(8);
-  int data_size = 0;
-
-  if(node->is_leaf){
-    memcpy(data_to_be_hashed, node->data, 32 * node->valid_num);
-    data_size += 32 * node->valid_num;
-  }
-  else{
-    for(int i = 0;i < BPT_DEGREE; ++i){
-      if(node->children[i]){
-        memcpy(data_to_be_hashed+data_size, node->children[i]->hash, 32);
-        data_size += 32;
-      }
-    }
-  }
+  uint8_t data_to_be_hashed[64] __aligned(8);
+  uint8_t calculated_hash[32] __aligned(8);
+  int data_size = 64;
 
+  memcpy(data_to_be_hashed, left, 32);
+  memcpy(data_to_be_hashed + 32, right, 32);
 
   asm volatile("fence");
 
@@ -125,43 +81,155 @@ bpt_merk_calculate_node_hash(bpt_merkle_node_t* node, uint8_t calculated_hash[32
 
   asm volatile("fence" ::: "memory");
 
+  memcpy(out, calculated_hash, 32);
+
   #else // software sha256
 
   SHA256_CTX hasher;
   sha256_init(&hasher);
+  sha256_update(&hasher, left, 32);
+  sha256_update(&hasher, right, 32);
+  sha256_final(&hasher, out);
+  #endif
+}
 
-  if(node->is_leaf){
-    for(int i = 0;i < node->valid_num;++i)
-      sha256_update(&hasher, node->data[i], 32);
+static const uint8_t*
+bpt_merk_slot_hash(bpt_merkle_node_t* node, int slot){
+  if(slot >= node->valid_num){
+    return bpt_merk_empty_hash;
   }
-  else{
-    for(int i = 0;i < node->valid_num;++i)
-      sha256_update(&hasher, node->children[i]->hash, 32);
-  }
-  sha256_final(&hasher, calculated_hash);
-  #endif
+  return node->is_leaf ? node->data[slot] : node->children[slot]->hash;
 }
 
+static uint8_t*
+bpt_merk_itree_entry(bpt_merkle_node_t* node, int idx){
+  return idx == 1 ? node->hash : node->itree[idx - 2];
+}
 
-static bool
-bpt_merk_verify_single_node(bpt_merkle_node_t* node){
-  uint8_t calculated_hash[32] __aligned(8);
-  bpt_merk_calculate_node_hash(node, calculated_hash);
-  int result = memcmp(node->hash, calculated_hash, 32);
-  if(result != 0){
-    printf("error, branch node hash compare failed at %d\n", result);
+static void
+bpt_merk_mark_dirty(bpt_merkle_node_t* node, int lo, int hi){
+  if(hi > BPT_ITREE_SIZE){
+    hi = BPT_ITREE_SIZE;
   }
-  return result == 0;
+  if(lo >= hi){
+    return;
+  }
+  if(node->dirty_lo >= node->dirty_hi){
+    node->dirty_lo = lo;
+    node->dirty_hi = hi;
+    return;
+  }
+  if(lo < node->dirty_lo) node->dirty_lo = lo;
+  if(hi > node->dirty_hi) node->dirty_hi = hi;
 }
 
 
+// Rehash the slot tree entries above the dirty slots, bottom-up
 static void
 bpt_merk_hash_single_node(
     bpt_merkle_node_t* node) {
+  int lo = node->dirty_lo + BPT_ITREE_SIZE;
+  int hi = node->dirty_hi - 1 + BPT_ITREE_SIZE;
+  int level_slots = 1;
+
+  if(node->dirty_lo >= node->dirty_hi){
+    return;
+  }
+
+  while(lo > 1){
+    lo >>= 1;
+    hi >>= 1;
+    level_slots <<= 1;
+    for(int idx = lo;idx <= hi;++idx){
+      uint8_t* out = bpt_merk_itree_entry(node, idx);
+      int first_slot = idx * level_slots - BPT_ITREE_SIZE;
+      const uint8_t *left, *right;
+
+      if(first_slot >= node->valid_num){
+        memset(out, 0, 32);
+        continue;
+      }
+      if(level_slots == 2){
+        left  = bpt_merk_slot_hash(node, first_slot);
+        right = bpt_merk_slot_hash(node, first_slot + 1);
+      }
+      else{
+        left  = bpt_merk_itree_entry(node, 2 * idx);
+        right = bpt_merk_itree_entry(node, 2 * idx + 1);
+      }
+      bpt_merk_hash_pair(left, right, out);
+    }
+  }
+  node->dirty_lo = node->dirty_hi = 0;
+}
 
+
+// Check that slot_hash sits at slot in node by hashing the path from that
+// slot up to the node hash
+static bool
+bpt_merk_verify_slot(
+    bpt_merkle_node_t* node, int slot, const uint8_t slot_hash[32]){
   uint8_t calculated_hash[32] __aligned(8);
-  bpt_merk_calculate_node_hash(node, calculated_hash);
-  memcpy(node->hash, calculated_hash, 32);
+  int idx = slot + BPT_ITREE_SIZE;
+
+  memcpy(calculated_hash, slot_hash, 32);
+  for(;idx > 1;idx >>= 1){
+    int sibling = idx ^ 1;
+    const uint8_t* sibling_hash = sibling >= BPT_ITREE_SIZE ?
+        bpt_merk_slot_hash(node, sibling - BPT_ITREE_SIZE) :
+        bpt_merk_itree_entry(node, sibling);
+    if(idx & 1){
+      bpt_merk_hash_pair(sibling_hash, calculated_hash, calculated_hash);
+    }
+    else{
+      bpt_merk_hash_pair(calculated_hash, sibling_hash, calculated_hash);
+    }
+  }
+
+  return memcmp(node->hash, calculated_hash, 32) == 0;
+}
+
+#if BPT_PIVOT_GROUPS(BPT_DEGREE) > 1
+#define BPT_PIVOT_SCAN BPT_PIVOT_GROUP
+#else
+#define BPT_PIVOT_SCAN (BPT_DEGREE + 1)
+#endif
+
+// Number of pivots in node that are <= key. As pivots are sorted, this is
+// where key goes in a leaf, and one past the child to descend into in a
+// branch. The scans have a fixed trip count and compile to compares and
+// adds, so there is no branch to mispredict on the key.
+static int
+bpt_merk_pivot_rank(const bpt_merkle_node_t* node, uintptr_t key){
+  const uintptr_t* pivots = node->addr_pivot;
+  int n = node->valid_num;
+  int base = 0, rank = 0;
+#if BPT_PIVOT_GROUPS(BPT_DEGREE) > 1
+  int groups = (n + BPT_PIVOT_GROUP - 1) / BPT_PIVOT_GROUP;
+  int g = 0;
+  for(int k = 1;k < BPT_PIVOT_GROUPS(BPT_DEGREE);++k){
+    g += (k < groups) & (node->pivot_index[k] <= key);
+  }
+  base = g * BPT_PIVOT_GROUP;
+  pivots += base;
+  n -= base;
+#endif
+  for(int k = 0;k < BPT_PIVOT_SCAN;++k){
+    rank += (k < n) & (pivots[k] <= key);
+  }
+  return base + rank;
+}
+
+// Refresh pivot_index after the pivots of node changed
+static void
+bpt_merk_sync_pivot_index(bpt_merkle_node_t* node){
+#if BPT_PIVOT_GROUPS(BPT_DEGREE) > 1
+  for(int g = 0;g < BPT_PIVOT_GROUPS(BPT_DEGREE);++g){
+    node->pivot_index[g] = node->addr_pivot[g * BPT_PIVOT_GROUP];
+  }
+#else
+  (void)node;
+#endif
 }
 
 // When inserting key, i is the position of node in parent, j is the position for the key to insert
@@ -180,6 +248,7 @@ insert_element(bool is_key, bpt_merkle_node_t* parent, bpt_merkle_node_t* node,
       parent->addr_pivot[i] = node->addr_pivot[0];
     }
     node->valid_num += 1;
+    bpt_merk_mark_dirty(node, j, node->valid_num);
   }
   else{
     for(k = parent->valid_num-1;k >= i;--k){
@@ -189,15 +258,36 @@ insert_element(bool is_key, bpt_merkle_node_t* parent, bpt_merkle_node_t* node,
     parent->addr_pivot[i] = node->addr_pivot[0];
     parent->children[i] = node;
     parent->valid_num += 1;
+    bpt_merk_mark_dirty(parent, i, parent->valid_num);
+  }
+  if(is_key){
+    bpt_merk_sync_pivot_index(node);
+  }
+  if(parent){
+    bpt_merk_sync_pivot_index(parent);
   }
   return node;
 }
 
+// Nodes taken before an insert for every split it may make, so that it
+// either has all of them or changes nothing
+typedef struct {
+  bpt_merkle_node_t* nodes[BPT_MAX_DEPTH + 1];
+  int taken;
+  int count;
+} bpt_merk_spare_t;
+
 static bpt_merkle_node_t*
-split_node(bpt_merkle_node_t* parent, bpt_merkle_node_t* node, int i){
+bpt_merk_take_spare(bpt_merk_spare_t* spare){
+  assert(spare->taken < spare->count);
+  return spare->nodes[spare->taken++];
+}
+
+static bpt_merkle_node_t*
+split_node(bpt_merkle_node_t* parent, bpt_merkle_node_t* node, int i, bpt_merk_spare_t* spare){
   int j, k, limit;
   bpt_merkle_node_t* new_node;
-  new_node = bpt_merk_alloc_node();
+  new_node = bpt_merk_take_spare(spare);
   new_node->is_leaf = node->is_leaf;
   k = 0;
   j = node->valid_num / 2;
@@ -217,6 +307,10 @@ split_node(bpt_merkle_node_t* parent, bpt_merkle_node_t* node, int i){
     ++j;
     ++k;
   }
+  bpt_merk_mark_dirty(node, node->valid_num, limit);
+  bpt_merk_mark_dirty(new_node, 0, k);
+  bpt_merk_sync_pivot_index(node);
+  bpt_merk_sync_pivot_index(new_node);
 
   if(parent){
     insert_element(0, parent, new_node, unavailable, NULL, i + 1, unavailable);
@@ -225,7 +319,7 @@ split_node(bpt_merkle_node_t* parent, bpt_merkle_node_t* node, int i){
   // the root's addr must not be changed, so we have to copy node to new node and
   // still make node to be root
   else{
-    parent = bpt_merk_alloc_node();
+    parent = bpt_merk_take_spare(spare);
     memcpy(parent, node, sizeof(bpt_merkle_node_t));
     memset(node, 0, sizeof(bpt_merkle_node_t));
     insert_element(0, node, parent, unavailable, NULL, 0, unavailable);
@@ -251,6 +345,7 @@ remove_element(int is_key, bpt_merkle_node_t* parent, bpt_merkle_node_t* node, i
     }
     node->addr_pivot[node->valid_num-1] = unavailable;
     parent->addr_pivot[i] = node->addr_pivot[0];
+    bpt_merk_mark_dirty(node, j, node->valid_num);
     node->valid_num -= 1;
   }
   else{
@@ -261,8 +356,13 @@ remove_element(int is_key, bpt_merkle_node_t* parent, bpt_merkle_node_t* node, i
     }
     parent->children[parent->valid_num-1] = NULL;
     parent->addr_pivot[parent->valid_num-1] = unavailable;
+    bpt_merk_mark_dirty(parent, i, parent->valid_num);
     parent->valid_num -= 1;
   }
+  if(is_key){
+    bpt_merk_sync_pivot_index(node);
+  }
+  bpt_merk_sync_pivot_index(parent);
   return node;
 }
 
@@ -317,6 +417,7 @@ move_element(bpt_merkle_node_t* src, bpt_merkle_node_t* dst, bpt_merkle_node_t*
     }
     parent->addr_pivot[i] = src->addr_pivot[0];
   }
+  bpt_merk_sync_pivot_index(parent);
   return parent;
 }
 
@@ -341,25 +442,79 @@ find_sibling(bpt_merkle_node_t* parent, int i){
 }
 
 
+// Take the nodes for inserting key. A node on its path is split when it is
+// full, every node below it on the path is split too, and no sibling has
+// room for an element; that is one node each, and one more for the root,
+// which is copied into a new node when it is split. Each is taken near the
+// node it would be split from, like the split would. Returns -1, with
+// nothing taken, if there is no memory for them.
+static int
+bpt_merk_reserve_splits(bpt_merkle_node_t* root, uintptr_t key, bpt_merk_spare_t* spare){
+  bpt_merkle_node_t* path[BPT_MAX_DEPTH];
+  int pos[BPT_MAX_DEPTH];
+  bpt_merkle_node_t* node = root;
+  int depth = 0, full, j = 0;
+
+  spare->taken = spare->count = 0;
+  for(;;){
+    if(depth == BPT_MAX_DEPTH){
+      merk_report(MERK_TOO_DEEP, key);
+      return -1;
+    }
+    pos[depth] = j ? j - 1 : 0;
+    path[depth++] = node;
+    j = bpt_merk_pivot_rank(node, key);
+    if(node->is_leaf){
+      break;
+    }
+    node = node->children[j ? j - 1 : 0];
+  }
+  // the key is set in place
+  if(j != 0 && node->addr_pivot[j-1] == key){
+    return 0;
+  }
+
+  for(full = depth;full > 0 && path[full-1]->valid_num >= BPT_DEGREE;--full){
+    if(full > 1 && find_sibling(path[full-2], pos[full-1])){
+      break;
+    }
+    // node is the root when there is no parent, and the root is not a pool node
+    bpt_merkle_node_t* taken = bpt_merk_alloc_node_near(full > 1 ? path[full-1] : NULL);
+    if(taken && full == 1){
+      spare->nodes[spare->count++] = taken;
+      taken = bpt_merk_alloc_node();
+    }
+    if(!taken){
+      while(spare->count){
+        merk_pool_free(&bpt_merk_pool, spare->nodes[--spare->count]);
+      }
+      merk_report(MERK_NO_MEMORY, key);
+      return -1;
+    }
+    spare->nodes[spare->count++] = taken;
+  }
+  return 0;
+}
+
+
 static bpt_merkle_node_t*
-recursive_insert(bpt_merkle_node_t* node, uintptr_t key, const uint8_t hash[32], int i, bpt_merkle_node_t* parent){
+recursive_insert(bpt_merkle_node_t* node, uintptr_t key, const uint8_t hash[32], int i, bpt_merkle_node_t* parent, bpt_merk_spare_t* spare){
   int j, limit;
   bpt_merkle_node_t* sibling;
 
   // search the branch
+  j = bpt_merk_pivot_rank(node, key);
 
-  for(j = 0;j < node->valid_num && key >= node->addr_pivot[j];++j){
+  if(node->is_leaf){
     // if the key exists
-    if(key == node->addr_pivot[j]){
-      if(node->is_leaf){
-        memcpy(node->data[j], hash, 32);
-        bpt_merk_hash_single_node(node);
-        return node;
-      }
+    if(j != 0 && node->addr_pivot[j-1] == key){
+      memcpy(node->data[j-1], hash, 32);
+      bpt_merk_mark_dirty(node, j - 1, j);
+      bpt_merk_hash_single_node(node);
+      return node;
     }
   }
-
-  if(j != 0 && !node->is_leaf){
+  else if(j != 0){
     --j;
   }
 
@@ -369,7 +524,10 @@ recursive_insert(bpt_merkle_node_t* node, uintptr_t key, const uint8_t hash[32],
   }
   // branch node
   else{
-    node->children[j] = recursive_insert(node->children[j], key, hash, j, node);
+    node->children[j] = recursive_insert(node->children[j], key, hash, j, node, spare);
+    // the child's hash changed, and an overflow may have moved an element
+    // into either of its siblings
+    bpt_merk_mark_dirty(node, j > 0 ? j - 1 : 0, j + 2);
   }
 
   // adjust nodes
@@ -378,7 +536,7 @@ recursive_insert(bpt_merkle_node_t* node, uintptr_t key, const uint8_t hash[32],
     // root
     if(parent == NULL){
       // split the node
-      node = split_node(parent, node, i);
+      node = split_node(parent, node, i, spare);
     }
     else{
       sibling = find_sibling(parent, i);
@@ -386,7 +544,7 @@ recursive_insert(bpt_merkle_node_t* node, uintptr_t key, const uint8_t hash[32],
         move_element(node, sibling, parent, i, 1);
       }
       else{
-        sibling = split_node(parent, node, i);
+        sibling = split_node(parent, node, i, spare);
       }
       bpt_merk_hash_single_node(sibling);
       bpt_merk_hash_single_node(node);
@@ -397,46 +555,358 @@ recursive_insert(bpt_merkle_node_t* node, uintptr_t key, const uint8_t hash[32],
   }
   if(parent){
     parent->addr_pivot[i] = node->addr_pivot[0];
+    bpt_merk_sync_pivot_index(parent);
   }
   return node;
 }
 
 
-void
+int
 bpt_merk_insert(bpt_merkle_node_t* root, uintptr_t key, const uint8_t hash[32]){
-  recursive_insert(root, key, hash, 0, NULL);
+  bpt_merk_spare_t spare;
+
+  if(bpt_merk_reserve_splits(root, key, &spare)){
+    return -1;
+  }
+  recursive_insert(root, key, hash, 0, NULL, &spare);
+
+  // a sibling with room took an element instead of a split
+  while(spare.taken < spare.count){
+    merk_pool_free(&bpt_merk_pool, spare.nodes[spare.taken++]);
+  }
+  return 0;
 }
 
 
 bool
 bpt_merk_verify(bpt_merkle_node_t* root, uintptr_t key, const uint8_t hash[32]){
   bpt_merkle_node_t* curr_node = root;
-  while(!curr_node->is_leaf){
-    assert(bpt_merk_verify_single_node(curr_node));
-    int idx;
-    for(idx = 0;idx < curr_node->valid_num;++idx){
-      if(key >= curr_node->addr_pivot[idx] && (idx == curr_node->valid_num-1 || key < curr_node->addr_pivot[idx+1])){
-        break;
+  for(int depth = 0;!curr_node->is_leaf;++depth){
+    if(depth == BPT_MAX_DEPTH){
+      merk_report(MERK_TOO_DEEP, key);
+      return false;
+    }
+    // keys below the first pivot descend into the first child and then
+    // fail the leaf lookup
+    int idx = bpt_merk_pivot_rank(curr_node, key);
+    idx -= idx != 0;
+    bpt_merkle_node_t* child = curr_node->children[idx];
+    if(!bpt_merk_verify_slot(curr_node, idx, child->hash)){
+      merk_report(MERK_TAMPERED, key);
+      return false;
+    }
+    curr_node = child;
+  }
+  int idx = bpt_merk_pivot_rank(curr_node, key) - 1;
+  if(idx < 0 || curr_node->addr_pivot[idx] != key){
+    merk_report(MERK_NOT_FOUND, key);
+    return false;
+  }
+  if(!bpt_merk_verify_slot(curr_node, idx, hash)){
+    merk_report(MERK_HASH_MISMATCH, key);
+    return false;
+  }
+  return true;
+}
+
+
+// Check every slot of node against its hash at once, by rebuilding the slot
+// tree from the slot hashes
+static bool
+bpt_merk_verify_all_slots(bpt_merkle_node_t* node){
+  static uint8_t level[BPT_ITREE_SIZE / 2][32];
+  int used = node->valid_num;
+
+  for(int span = 2, width = BPT_ITREE_SIZE / 2;width >= 1;span <<= 1, width >>= 1){
+    for(int k = 0;k < width;++k){
+      if(k * span >= used){
+        memset(level[k], 0, 32);
+      }
+      else if(span == 2){
+        bpt_merk_hash_pair(bpt_merk_slot_hash(node, 2 * k),
+            bpt_merk_slot_hash(node, 2 * k + 1), level[k]);
+      }
+      else{
+        bpt_merk_hash_pair(level[2 * k], level[2 * k + 1], level[k]);
       }
     }
-    curr_node = curr_node->children[idx];
   }
-  assert(bpt_merk_verify_single_node(curr_node));
-  int idx;
-  for(idx = 0;idx < curr_node->valid_num;++idx){
-    if(curr_node->addr_pivot[idx] == key){
-      break;
+
+  return memcmp(node->hash, level[0], 32) == 0;
+}
+
+// Check slots [first, last] of node, one path each or all together,
+// whichever hashes less
+static bool
+bpt_merk_verify_slots(bpt_merkle_node_t* node, int first, int last){
+  int path = __builtin_ctz(BPT_ITREE_SIZE);
+  if((last - first + 1) * path >= BPT_ITREE_SIZE - 1){
+    return bpt_merk_verify_all_slots(node);
+  }
+  for(int k = first;k <= last;++k){
+    if(!bpt_merk_verify_slot(node, k, bpt_merk_slot_hash(node, k))){
+      return false;
+    }
+  }
+  return true;
+}
+
+
+/* Range operations take the run one chunk at a time, so that which of its
+ * keys were found fits in a fixed bitmap. Each chunk is one walk from the
+ * root that visits every node holding part of it once. */
+#define BPT_RANGE_CHUNK 256
+
+typedef struct bpt_merk_range {
+  // first and last key of the chunk
+  uintptr_t lo, hi;
+  const uint8_t (*hashes)[32];
+  size_t found_count;
+  uint64_t found[BPT_RANGE_CHUNK / 64];
+} bpt_merk_range_t;
+
+// Index in the chunk of key, or -1 if it is not one of them
+static long
+bpt_merk_range_index(bpt_merk_range_t* range, uintptr_t key){
+  if(key < range->lo || key > range->hi || (key - range->lo) & (RISCV_PAGE_SIZE - 1)){
+    return -1;
+  }
+  long idx = (key - range->lo) >> RISCV_PAGE_BITS;
+  if(!(range->found[idx / 64] & (1ull << (idx % 64)))){
+    range->found[idx / 64] |= 1ull << (idx % 64);
+    range->found_count++;
+  }
+  return idx;
+}
+
+// The slots of node that can hold keys of the chunk: the children of a
+// branch whose key ranges meet it, or the entries of a leaf inside it. last
+// is below first if there are none.
+static void
+bpt_merk_range_slots(const bpt_merkle_node_t* node, const bpt_merk_range_t* range, int* first, int* last){
+  if(node->is_leaf){
+    *first = range->lo ? bpt_merk_pivot_rank(node, range->lo - 1) : 0;
+    *last = bpt_merk_pivot_rank(node, range->hi) - 1;
+  }
+  else{
+    int rank = bpt_merk_pivot_rank(node, range->lo);
+    *first = rank - (rank != 0);
+    rank = bpt_merk_pivot_rank(node, range->hi);
+    *last = rank - (rank != 0);
+  }
+}
+
+static bool
+bpt_merk_verify_range_node(bpt_merkle_node_t* node, bpt_merk_range_t* range, int depth){
+  int first, last;
+  bpt_merk_range_slots(node, range, &first, &last);
+  if(first > last){
+    return true;
+  }
+  if(depth == BPT_MAX_DEPTH){
+    merk_report(MERK_TOO_DEEP, range->lo);
+    return false;
+  }
+  if(!bpt_merk_verify_slots(node, first, last)){
+    merk_report(MERK_TAMPERED, range->lo);
+    return false;
+  }
+  for(int k = first;k <= last;++k){
+    if(!node->is_leaf){
+      if(!bpt_merk_verify_range_node(node->children[k], range, depth + 1)){
+        return false;
+      }
+      continue;
+    }
+    long idx = bpt_merk_range_index(range, node->addr_pivot[k]);
+    if(idx >= 0 && memcmp(node->data[k], range->hashes[idx], 32) != 0){
+      merk_report(MERK_HASH_MISMATCH, node->addr_pivot[k]);
+      return false;
     }
   }
-  if(idx == curr_node->valid_num){
-    printf("error, addr 0x%lx not found in the B+ Merkle Tree\n", key);
+  return true;
+}
+
+// Returns whether anything under node changed, in which case node has been
+// rehashed; clears *ok if the tree is deeper than BPT_MAX_DEPTH
+static bool
+bpt_merk_update_range_node(
+    bpt_merkle_node_t* node, bpt_merk_range_t* range, int depth, bool* ok){
+  int first, last;
+  bool changed = false;
+  bpt_merk_range_slots(node, range, &first, &last);
+  if(first <= last && depth == BPT_MAX_DEPTH){
+    merk_report(MERK_TOO_DEEP, range->lo);
+    *ok = false;
     return false;
   }
-  int result = memcmp(hash, curr_node->data[idx], 32);
-  if(result != 0){
-    printf("error, leaf node hash compare failed at %d\n", result);
+  for(int k = first;k <= last && *ok;++k){
+    if(!node->is_leaf){
+      if(!bpt_merk_update_range_node(node->children[k], range, depth + 1, ok)){
+        continue;
+      }
+    }
+    else{
+      long idx = bpt_merk_range_index(range, node->addr_pivot[k]);
+      if(idx < 0){
+        continue;
+      }
+      memcpy(node->data[k], range->hashes[idx], 32);
+    }
+    bpt_merk_mark_dirty(node, k, k + 1);
+    changed = true;
+  }
+  if(changed){
+    bpt_merk_hash_single_node(node);
+  }
+  return changed;
+}
+
+static void
+bpt_merk_range_init(bpt_merk_range_t* range, uintptr_t first_key, size_t n, const uint8_t (*hashes)[32]){
+  memset(range, 0, sizeof(*range));
+  range->lo = first_key;
+  range->hi = first_key + (n - 1) * RISCV_PAGE_SIZE;
+  range->hashes = hashes;
+}
+
+bool
+bpt_merk_verify_range(
+    bpt_merkle_node_t* root, uintptr_t first_key, size_t n,
+    const uint8_t (*hashes)[32]){
+  for(size_t done = 0;done < n;done += BPT_RANGE_CHUNK){
+    bpt_merk_range_t range;
+    size_t chunk = n - done < BPT_RANGE_CHUNK ? n - done : BPT_RANGE_CHUNK;
+    bpt_merk_range_init(&range, first_key + done * RISCV_PAGE_SIZE, chunk, hashes + done);
+
+    if(!bpt_merk_verify_range_node(root, &range, 0)){
+      return false;
+    }
+    if(range.found_count != chunk){
+      merk_report(MERK_NOT_FOUND, range.lo);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool
+bpt_merk_update_range(
+    bpt_merkle_node_t* root, uintptr_t first_key, size_t n,
+    const uint8_t (*hashes)[32]){
+  for(size_t done = 0;done < n;done += BPT_RANGE_CHUNK){
+    bpt_merk_range_t range;
+    size_t chunk = n - done < BPT_RANGE_CHUNK ? n - done : BPT_RANGE_CHUNK;
+    bpt_merk_range_init(&range, first_key + done * RISCV_PAGE_SIZE, chunk, hashes + done);
+
+    bool ok = true;
+    bpt_merk_update_range_node(root, &range, 0, &ok);
+    if(!ok){
+      return false;
+    }
+
+    // keys that are not in the tree yet go in one at a time
+    for(size_t k = 0;k < chunk && range.found_count < chunk;++k){
+      if(!(range.found[k / 64] & (1ull << (k % 64)))){
+        if(bpt_merk_insert(root, range.lo + k * RISCV_PAGE_SIZE, range.hashes[k])){
+          return false;
+        }
+      }
+    }
+  }
+  return true;
+}
+
+
+// Give back a subtree built by bpt_merk_bulk_fill that nothing points to
+static void
+bpt_merk_bulk_free(bpt_merkle_node_t* node){
+  if(!node->is_leaf){
+    for(int k = 0;k < node->valid_num;++k){
+      bpt_merk_bulk_free(node->children[k]);
+    }
+  }
+  merk_pool_free(&bpt_merk_pool, node);
+}
+
+
+// Fill node with the sorted run keys[0..n), where cap is the number of
+// entries a subtree of this height holds. Children get an even share of the
+// run, so every branch below the root has at least two children, and each
+// node is hashed once after its children. Returns -1, with node's children
+// given back and node left as it was, if there is no memory for one.
+static int
+bpt_merk_bulk_fill(
+    bpt_merkle_node_t* node, const uintptr_t* keys,
+    const uint8_t (*hashes)[32], size_t n, size_t cap){
+  if(cap == BPT_DEGREE){
+    node->is_leaf = true;
+    for(size_t k = 0;k < n;++k){
+      node->addr_pivot[k] = keys[k];
+      memcpy(node->data[k], hashes[k], 32);
+    }
+  }
+  else{
+    size_t child_cap = cap / BPT_DEGREE;
+    size_t children = (n + child_cap - 1) / child_cap;
+    size_t off = 0;
+    for(size_t k = 0;k < children;++k){
+      size_t share = n / children + (k < n % children);
+      bpt_merkle_node_t* child =
+          bpt_merk_alloc_node_near(k ? node->children[k - 1] : NULL);
+      if(!child){
+        merk_report(MERK_NO_MEMORY, keys[off]);
+      }
+      else if(bpt_merk_bulk_fill(child, keys + off, hashes + off, share, child_cap)){
+        merk_pool_free(&bpt_merk_pool, child);
+        child = NULL;
+      }
+      if(!child){
+        while(k--){
+          bpt_merk_bulk_free(node->children[k]);
+          node->children[k] = NULL;
+          node->addr_pivot[k] = unavailable;
+        }
+        return -1;
+      }
+      node->children[k] = child;
+      node->addr_pivot[k] = keys[off];
+      off += share;
+    }
+    node->is_leaf = false;
+    n = children;
+  }
+  node->valid_num = n;
+  bpt_merk_sync_pivot_index(node);
+  bpt_merk_mark_dirty(node, 0, n);
+  bpt_merk_hash_single_node(node);
+  return 0;
+}
+
+
+bool
+bpt_merk_bulk_build(
+    bpt_merkle_node_t* root, const uintptr_t* keys,
+    const uint8_t (*hashes)[32], size_t n){
+  if(!root->is_leaf || root->valid_num != 0){
+    return false;
+  }
+  for(size_t k = 1;k < n;++k){
+    if(keys[k-1] >= keys[k]){
+      return false;
+    }
+  }
+  if(!n){
+    return true;
+  }
+
+  // the lowest tree that holds n entries, so the root gets two or more
+  // children unless everything fits in it
+  size_t cap = BPT_DEGREE;
+  while(cap < n){
+    cap *= BPT_DEGREE;
   }
-  return result == 0;
+  return bpt_merk_bulk_fill(root, keys, hashes, n, cap) == 0;
 }
 
 
@@ -6,8 +6,50 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/* Largest degree whose node still fits in a single 4 KiB backing page.
+ * Build with -DBPT_PAGE_NODES to use it; this keeps the tree at 3-4 levels
+ * for a million backing pages. */
+#define BPT_PAGE_DEGREE 48
+
+#ifndef BPT_DEGREE
+#ifdef BPT_PAGE_NODES
+#define BPT_DEGREE BPT_PAGE_DEGREE
+#else
 #define BPT_DEGREE 5
+#endif
+#endif
+
+/* A node's hash is the root of a small binary Merkle tree over its slots,
+ * so that changing one slot only rehashes log2(slots) pairs. This is the
+ * number of leaves of that tree: the degree rounded up to a power of two. */
+#define BPT_ITREE_LEAVES(d) \
+  ((d) <= 4 ? 4 : (d) <= 8 ? 8 : (d) <= 16 ? 16 : (d) <= 32 ? 32 : \
+   (d) <= 64 ? 64 : 128)
 
+#define BPT_CACHE_LINE 64
+#define BPT_ROUND_LINE(n) \
+  (((n) + BPT_CACHE_LINE - 1) / BPT_CACHE_LINE * BPT_CACHE_LINE)
+
+/* Pivots are searched one cache line at a time. When a node has more than
+ * one line of pivots, the first line holds the first pivot of every group,
+ * and each group starts on its own line, so a search reads two lines. */
+#define BPT_PIVOT_GROUP (BPT_CACHE_LINE / 8)
+#define BPT_PIVOT_GROUPS(d) (((d) + BPT_PIVOT_GROUP) / BPT_PIVOT_GROUP)
+#define BPT_NODE_SEARCH_BYTES(d)                              \
+  (BPT_PIVOT_GROUPS(d) > 1                                    \
+       ? BPT_ROUND_LINE(8 + 8 * BPT_PIVOT_GROUPS(d)) +        \
+             BPT_PIVOT_GROUPS(d) * BPT_CACHE_LINE             \
+       : 8 + 8 * ((d) + 1))
+
+/* Node layout for degree d: the search part (flags and pivots), the node
+ * hash, d+1 payload slots (the extra slot holds an overflowing entry until
+ * the node is split) and the interior of the slot tree, padded to whole
+ * cache lines. The slot tree root is the node hash, so only entries 2.. are
+ * stored. */
+#define BPT_NODE_BYTES(d)                                 \
+  BPT_ROUND_LINE(                                         \
+      BPT_NODE_SEARCH_BYTES(d) + 32 + ((d) + 1) * 32 +    \
+      (BPT_ITREE_LEAVES(d) - 2) * 32)
 
 typedef union bpt_merkle_node bpt_merkle_node_t;
 
@@ -16,23 +58,59 @@ union bpt_merkle_node {
     // uintptr_t ptr;
     bool is_leaf;
     int8_t valid_num;
-    uint8_t hash[32];
+    // slots [dirty_lo, dirty_hi) changed since the node was last hashed
+    int8_t dirty_lo, dirty_hi;
+#if BPT_PIVOT_GROUPS(BPT_DEGREE) > 1
+    // pivot_index[g] == addr_pivot[g * BPT_PIVOT_GROUP]
+    uintptr_t pivot_index[BPT_PIVOT_GROUPS(BPT_DEGREE)];
+    uintptr_t addr_pivot[BPT_PIVOT_GROUPS(BPT_DEGREE) * BPT_PIVOT_GROUP]
+        __attribute__((aligned(BPT_CACHE_LINE)));
+#else
     uintptr_t addr_pivot[BPT_DEGREE+1];
+#endif
+    uint8_t hash[32];
     union{
       bpt_merkle_node_t* children[BPT_DEGREE+1];
-      uint8_t  data[BPT_DEGREE][32];
+      uint8_t  data[BPT_DEGREE+1][32];
     };
+    uint8_t itree[BPT_ITREE_LEAVES(BPT_DEGREE) - 2][32];
   };
   struct {
-    uint64_t raw_words[40];
+    uint64_t raw_words[BPT_NODE_BYTES(BPT_DEGREE) / 8];
   };
 };
 
-void
+/* Returns 0 on success, or -1, with the tree unchanged and the failure
+ * passed to merk_report, if there is no memory for the nodes it needs */
+int
 bpt_merk_insert(bpt_merkle_node_t* root, uintptr_t key, const uint8_t hash[32]);
+/* Verify failures are passed to merk_report (merk_integrity.h) before it
+ * returns */
 bool
 bpt_merk_verify(
     bpt_merkle_node_t* root, uintptr_t key, const uint8_t hash[32]);
+/* Build the tree in an empty root from n (key, hash) pairs sorted by strictly
+ * increasing key, hashing every node once. Returns false if root is not
+ * empty, the keys are not sorted, or there is no memory for the nodes, in
+ * which case root is left empty. */
+bool
+bpt_merk_bulk_build(
+    bpt_merkle_node_t* root, const uintptr_t* keys,
+    const uint8_t (*hashes)[32], size_t n);
+/* Range operations on the n backing pages first_key, first_key +
+ * RISCV_PAGE_SIZE, ..., with hashes[i] for the i-th, walking each node on
+ * their paths once. bpt_merk_verify_range fails if any of the keys is
+ * missing or differs. bpt_merk_update_range sets the keys that are present
+ * in place and inserts the rest, and fails if an insert does or the tree
+ * is deeper than BPT_MAX_DEPTH. */
+bool
+bpt_merk_verify_range(
+    bpt_merkle_node_t* root, uintptr_t first_key, size_t n,
+    const uint8_t (*hashes)[32]);
+bool
+bpt_merk_update_range(
+    bpt_merkle_node_t* root, uintptr_t first_key, size_t n,
+    const uint8_t (*hashes)[32]);
 void
 bpt_merk_travel(bpt_merkle_node_t* root);
 
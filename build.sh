@@ -15,10 +15,14 @@ PLUGINS[strace_debug]="-DINTERNAL_STRACE "
 PLUGINS[paging]="-DUSE_PAGING -DUSE_FREEMEM "
 PLUGINS[page_crypto]="-DPAGE_CRYPTO "
 PLUGINS[page_hash]="-DUSE_PAGE_HASH "
+PLUGINS[page_hash_lazy]="-DUSE_PAGE_HASH -DUSE_PAGE_HASH_LAZY "
+PLUGINS[page_hash_compact]="-DUSE_PAGE_HASH -DMERK_COMPACT "
 PLUGINS[debug]="-DDEBUG "
 PLUGINS[hpme]="-DUSE_HPME "
 PLUGINS[sha3_rocc]="-DUSE_SHA3_ROCC "
 PLUGINS[page_hash_bpt]="-DUSE_PAGE_HASH_BPT "
+PLUGINS[page_hash_bpt_wide]="-DUSE_PAGE_HASH_BPT -DBPT_PAGE_NODES "
+PLUGINS[page_hash_smt]="-DUSE_PAGE_HASH_SMT "
 #PLUGINS[dynamic_resizing]="-DDYN_ALLOCATION "
 
 OPTIONS_FLAGS=
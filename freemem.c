@@ -6,108 +6,676 @@
 #include "paging.h"
 
 /* This file implements a simple page allocator (SPA)
- * which stores the pages based on a linked list.
- * Each of the element of linked list is stored in the header of each free page.
+ * as a buddy allocator over freemem.
+ *
+ * Free memory is kept in blocks of 2^order pages, for orders 0 to
+ * SPA_MAX_ORDER, each aligned to its size in physical memory. There is
+ * one free list per order. Like before, the lists use the free pages
+ * themselves to store their pointers: each free block holds the next and
+ * previous free block of its order, which can be dereferenced by the
+ * NEXT_PAGE() and PREV_PAGE() macros. The lists are LIFO, so the block
+ * freed last, which is the most likely to still be cached, is the first
+ * to be reused. A block is taken by splitting the
+ * smallest one that is big enough, and a freed block is merged with its
+ * buddy (the other half of the block of the next order) while that is free.
+ *
+ * Finding the buddy needs one byte per frame, kept in the first pages of
+ * freemem, which says whether the frame starts a free block and of which
+ * order. Pages outside freemem (e.g., those of the loaded image) can be
+ * freed as well, but they are not tracked and never merge. Next to the
+ * frame states is a 16-bit count per frame, which the allocator leaves
+ * alone: it belongs to whoever holds the page (e.g., the number of used
+ * entries of a page table).
+ *
+ * Freemem is handed out lazily: everything above spa_frontier has never
+ * been used, and is neither linked into a free list nor has its frame
+ * bytes set up. Blocks are carved off the frontier only when the free
+ * lists run dry, so boot does not touch freemem at all, and the free lists
+ * only hold memory that has been returned.
+ *
+ * Next to the (dirty) free lists there is a small pool of pages that have
+ * already been zeroed, refilled a few pages at a time while the enclave
+ * is idle, so that spa_get_zero() usually doesn't have to clear a page.
+ * Pages in the pool count as free, and go back to the free lists when
+ * memory runs out.
+ *
+ * Single pages that are freed and soon needed again for the same purpose
+ * can skip the buddy lists altogether through the per-purpose hot caches
+ * (spa_put_hot() / spa_get_zero_hot()). User data pages are reused warm and
+ * cleared in cache; page-table pages are only cached when they are empty,
+ * so they are reused without clearing at all. Cached pages count as free
+ * too, and are given back with the zero pool.
+ *
+ * On top of the pages, small runtime objects come from object caches
+ * (struct spa_cache), either a cache of its own for a kind of object or
+ * one of the per-size caches behind spa_alloc(). Each slab is one page
+ * that starts with a header: the cache it belongs to, the slab list links
+ * and one free list index per object, so the free list doesn't overwrite
+ * constructed objects. Slabs with free objects are on the cache's partial
+ * list; full ones are on no list and are found from their objects by
+ * masking. An emptied slab is kept as the cache's spare, so a cache
+ * hovering at a slab boundary doesn't bounce pages; spares count as free
+ * and are given back with the other caches. */
 
- * SPA does not use any additional data structure (e.g., linked list).
- * Instead, it uses the pages themselves to store the linked list pointer.
- * Thus, each of the free pages contains the pointer to the next free page
- * which can be dereferenced by NEXT_PAGE() macro.
- * spa_free_pages will only hold the head and the tail pages so that
- * SPA can allocate/free a page in constant time. */
+#define SPA_FRAME_FREE 0x80
+#define SPA_FRAME_ORDER 0x0f
 
-static struct pg_list spa_free_pages;
+static struct pg_list spa_free_lists[SPA_MAX_ORDER + 1];
+static unsigned int spa_free_count;
 
-/* get a free page from the simple page allocator */
-uintptr_t
-__spa_get(bool zero)
+static uint8_t* spa_frames;
+static uint16_t* spa_counts;
+static uintptr_t spa_base, spa_frontier, spa_end;
+
+#define SPA_ZERO_POOL_MAX 64
+#define SPA_ZERO_REFILL_BATCH 4
+
+/* only linked through NEXT_PAGE(), which is cleared on the way out */
+static struct pg_list spa_zero_pages;
+
+#define SPA_HOT_MAX 32
+
+/* a bounded LIFO of recently freed pages; once full, pushing spills the
+ * oldest (coldest) page to the buddy lists */
+struct spa_hot_cache
+{
+  uintptr_t pages[SPA_HOT_MAX];
+  unsigned int next;
+  unsigned int count;
+};
+
+static struct spa_hot_cache spa_hot[SPA_HOT_KINDS];
+
+#define SPA_SLAB_END 0xffff
+
+struct spa_slab
+{
+  struct spa_cache* cache;
+  struct spa_slab* prev;
+  struct spa_slab* next;
+  uint16_t in_use;
+  uint16_t free;
+  uint16_t next_free[];
+};
+
+#define SPA_SLAB(obj) \
+  ((struct spa_slab*)((uintptr_t)(obj) & ~(uintptr_t)(RISCV_PAGE_SIZE - 1)))
+
+#define SPA_SIZE_CACHE(bytes) { .name = "size-" #bytes, .size = (bytes) }
+
+static struct spa_cache spa_size_caches[] = {
+  SPA_SIZE_CACHE(16), SPA_SIZE_CACHE(32), SPA_SIZE_CACHE(64),
+  SPA_SIZE_CACHE(128), SPA_SIZE_CACHE(256), SPA_SIZE_CACHE(512),
+  SPA_SIZE_CACHE(1024),
+};
+
+#define SPA_SIZE_CACHES (sizeof(spa_size_caches) / sizeof(spa_size_caches[0]))
+
+/* every cache that has been used, so their spares can be given back */
+static struct spa_cache* spa_caches;
+
+static inline uint8_t*
+spa_frame(uintptr_t page)
+{
+  if (page < spa_base || page >= spa_frontier)
+    return NULL;
+  return &spa_frames[(page - spa_base) >> RISCV_PAGE_BITS];
+}
+
+uint16_t*
+spa_page_count(uintptr_t page)
+{
+  if (page < spa_base || page >= spa_frontier)
+    return NULL;
+  return &spa_counts[(page - spa_base) >> RISCV_PAGE_BITS];
+}
+
+static inline uintptr_t
+spa_buddy(uintptr_t block, unsigned int order)
+{
+  return __va(__pa(block) ^ ((uintptr_t)RISCV_PAGE_SIZE << order));
+}
+
+static void
+spa_list_push(uintptr_t block, unsigned int order)
+{
+  struct pg_list* list = &spa_free_lists[order];
+  uint8_t* frame = spa_frame(block);
+
+  NEXT_PAGE(block) = list->head;
+  PREV_PAGE(block) = 0;
+  if (!LIST_EMPTY(*list)) {
+    PREV_PAGE(list->head) = block;
+  } else {
+    list->tail = block;
+  }
+  list->head = block;
+  list->count++;
+
+  if (frame)
+    *frame = SPA_FRAME_FREE | order;
+  spa_free_count += 1 << order;
+}
+
+static void
+spa_list_remove(uintptr_t block, unsigned int order)
+{
+  struct pg_list* list = &spa_free_lists[order];
+  uintptr_t next = NEXT_PAGE(block), prev = PREV_PAGE(block);
+  uint8_t* frame = spa_frame(block);
+
+  if (prev) {
+    NEXT_PAGE(prev) = next;
+  } else {
+    list->head = next;
+  }
+  if (next) {
+    PREV_PAGE(next) = prev;
+  } else {
+    list->tail = prev;
+  }
+  list->count--;
+
+  if (frame)
+    *frame = 0;
+  spa_free_count -= 1 << order;
+}
+
+static void spa_put_range(uintptr_t start, uintptr_t end);
+
+/* take a block of the given order from the never used part of freemem */
+static uintptr_t
+spa_take_frontier(unsigned int order)
+{
+  uintptr_t size = (uintptr_t)RISCV_PAGE_SIZE << order;
+  uintptr_t skipped = spa_frontier;
+  uintptr_t block = __va(ROUND_UP(__pa(spa_frontier), RISCV_PAGE_BITS + order));
+
+  if (block < spa_frontier || block + size > spa_end)
+    return 0;
+
+  memset(&spa_frames[(spa_frontier - spa_base) >> RISCV_PAGE_BITS], 0,
+         (block + size - spa_frontier) >> RISCV_PAGE_BITS);
+  spa_frontier = block + size;
+
+  /* the pages skipped to align the block are free from now on */
+  spa_put_range(skipped, block);
+  return block;
+}
+
+/* take a free block of the given order, splitting a bigger one if needed */
+static uintptr_t
+spa_take(unsigned int order)
+{
+  unsigned int k = order;
+  uintptr_t block;
+
+  while (k <= SPA_MAX_ORDER && LIST_EMPTY(spa_free_lists[k]))
+    k++;
+  if (k > SPA_MAX_ORDER)
+    return spa_take_frontier(order);
+
+  block = spa_free_lists[k].head;
+  spa_list_remove(block, k);
+
+  /* give back the upper halves */
+  while (k > order) {
+    k--;
+    spa_list_push(block + ((uintptr_t)RISCV_PAGE_SIZE << k), k);
+  }
+  return block;
+}
+
+static uintptr_t
+spa_zero_pop(void)
 {
-  uintptr_t free_page;
+  uintptr_t page = spa_zero_pages.head;
+
+  spa_zero_pages.head = NEXT_PAGE(page);
+  spa_zero_pages.count--;
+  NEXT_PAGE(page) = 0;
+  return page;
+}
+
+static uintptr_t
+spa_hot_pop(struct spa_hot_cache* cache)
+{
+  cache->next = (cache->next + SPA_HOT_MAX - 1) % SPA_HOT_MAX;
+  cache->count--;
+  return cache->pages[cache->next];
+}
+
+/* give the zeroed and hot pages back to the free lists */
+static void
+spa_drain_caches(void)
+{
+  struct spa_cache* cache;
+  int kind;
+
+  while (!LIST_EMPTY(spa_zero_pages))
+    spa_put(spa_zero_pop());
+
+  for (kind = 0; kind < SPA_HOT_KINDS; kind++) {
+    while (spa_hot[kind].count)
+      spa_put(spa_hot_pop(&spa_hot[kind]));
+  }
+
+  for (cache = spa_caches; cache; cache = cache->next_cache) {
+    if (cache->spare) {
+      spa_put((uintptr_t)cache->spare);
+      cache->spare = NULL;
+      cache->slabs--;
+    }
+  }
+}
+
+static unsigned int
+spa_cached_count(void)
+{
+  unsigned int count = spa_zero_pages.count;
+  struct spa_cache* cache;
+  int kind;
+
+  for (kind = 0; kind < SPA_HOT_KINDS; kind++)
+    count += spa_hot[kind].count;
+  for (cache = spa_caches; cache; cache = cache->next_cache)
+    count += cache->spare != NULL;
+  return count;
+}
+
+/* zero a few free pages for later spa_get_zero() calls; meant for idle
+ * time, so it never evicts */
+void
+spa_zero_refill(void)
+{
+  int i;
+
+  for (i = 0; i < SPA_ZERO_REFILL_BATCH &&
+              spa_zero_pages.count < SPA_ZERO_POOL_MAX; i++) {
+    uintptr_t page = spa_take(0);
+    if (!page)
+      break;
+
+    memset((void*)page, 0, RISCV_PAGE_SIZE);
+    NEXT_PAGE(page) = spa_zero_pages.head;
+    spa_zero_pages.head = page;
+    spa_zero_pages.count++;
+  }
+}
+
+/* Eviction frees one page at a time, so for bigger blocks keep at it until
+ * enough neighbours are free, but not forever */
+#define SPA_EVICT_TRIES(order) BIT((order) + 1)
+
+/* get a free block from the simple page allocator */
+static uintptr_t
+__spa_get(unsigned int order, bool zero, bool evict)
+{
+  uintptr_t free_block;
+
+  assert(order <= SPA_MAX_ORDER);
+
+  if (zero && order == 0 && !LIST_EMPTY(spa_zero_pages))
+    return spa_zero_pop();
+
+  free_block = spa_take(order);
+  if (!free_block && spa_cached_count()) {
+    spa_drain_caches();
+    free_block = spa_take(order);
+  }
 
-  if (LIST_EMPTY(spa_free_pages)) {
-    /* try evict a page */
 #ifdef USE_PAGING
+  /* try evict pages */
+  for (int tries = 0; evict && !free_block && tries < SPA_EVICT_TRIES(order); tries++) {
     uintptr_t new_pa = paging_evict_and_free_one(0);
-    if(new_pa)
-    {
-      spa_put(__va(new_pa));
-    }
-    else
+    if (!new_pa)
+      break;
+    spa_put(__va(new_pa));
+    free_block = spa_take(order);
+  }
 #endif
-    {
+
+  if (!free_block) {
+    if (evict)
       warn("eyrie simple page allocator cannot evict and free pages");
-      return 0;
+    return 0;
+  }
+
+  assert(free_block > EYRIE_LOAD_START && free_block < (freemem_va_start + freemem_size));
+
+  if (zero)
+    memset((void*)free_block, 0, (size_t)RISCV_PAGE_SIZE << order);
+
+  return free_block;
+}
+
+uintptr_t spa_get() { return __spa_get(0, false, true); }
+uintptr_t spa_get_zero() { return __spa_get(0, true, true); }
+uintptr_t spa_get_order(unsigned int order) { return __spa_get(order, false, true); }
+uintptr_t spa_try_get_order(unsigned int order) { return __spa_get(order, false, false); }
+
+/* put a block to the simple page allocator */
+void
+spa_put_order(uintptr_t block, unsigned int order)
+{
+  uint8_t* frame;
+
+  assert(order <= SPA_MAX_ORDER);
+  assert(IS_ALIGNED(__pa(block), RISCV_PAGE_BITS + order));
+  assert(block >= EYRIE_LOAD_START &&
+         block + ((uintptr_t)RISCV_PAGE_SIZE << order) <= (freemem_va_start + freemem_size));
+
+  /* never used pages can't be returned */
+  assert(block < spa_base || block >= spa_end || block < spa_frontier);
+
+  frame = spa_frame(block);
+  assert(!frame || !(*frame & SPA_FRAME_FREE));
+
+  /* merge with the buddy while it is a free block of the same order */
+  while (frame && order < SPA_MAX_ORDER) {
+    uintptr_t buddy = spa_buddy(block, order);
+    uint8_t* buddy_frame = spa_frame(buddy);
+
+    if (!buddy_frame || *buddy_frame != (SPA_FRAME_FREE | order))
+      break;
+
+    spa_list_remove(buddy, order);
+    if (buddy < block) {
+      block = buddy;
+      frame = buddy_frame;
     }
+    order++;
   }
 
-  free_page = spa_free_pages.head;
-  assert(free_page);
+  spa_list_push(block, order);
+}
 
-  /* update list head */
-  uintptr_t next = NEXT_PAGE(spa_free_pages.head);
-  spa_free_pages.head = next;
-  spa_free_pages.count--;
+void
+spa_put(uintptr_t page_addr)
+{
+  spa_put_order(page_addr, 0);
+}
 
-  assert(free_page > EYRIE_LOAD_START && free_page < (freemem_va_start + freemem_size));
+/* keep a page for the next spa_get_zero_hot() of the same kind */
+void
+spa_put_hot(uintptr_t page, enum spa_hot_kind kind)
+{
+  struct spa_hot_cache* cache = &spa_hot[kind];
+  uint8_t* frame = spa_frame(page);
 
-  if (zero)
-    memset((void*)free_page, 0, RISCV_PAGE_SIZE);
+  assert(kind < SPA_HOT_KINDS);
+  assert(IS_ALIGNED(page, RISCV_PAGE_BITS));
+  assert(page >= EYRIE_LOAD_START && page < (freemem_va_start + freemem_size));
+  assert(!frame || !(*frame & SPA_FRAME_FREE));
+
+  if (cache->count == SPA_HOT_MAX) {
+    spa_put(cache->pages[cache->next]);
+    cache->count--;
+  }
+  cache->pages[cache->next] = page;
+  cache->next = (cache->next + 1) % SPA_HOT_MAX;
+  cache->count++;
+}
+
+uintptr_t
+spa_get_zero_hot(enum spa_hot_kind kind)
+{
+  struct spa_hot_cache* cache = &spa_hot[kind];
+  uintptr_t page;
+
+  assert(kind < SPA_HOT_KINDS);
+
+  if (!cache->count)
+    return spa_get_zero();
+
+  page = spa_hot_pop(cache);
+  if (kind != SPA_HOT_PAGE_TABLE)
+    memset((void*)page, 0, RISCV_PAGE_SIZE);
+  return page;
+}
 
-  return free_page;
+static void
+spa_cache_setup(struct spa_cache* cache)
+{
+  size_t align = sizeof(uintptr_t);
+  unsigned int n;
+
+  assert(cache->size && cache->size <= SPA_SLAB_MAX_SIZE);
+  cache->size = (cache->size + align - 1) & ~(align - 1);
+
+  /* objects are aligned to their size, up to a cache line */
+  align = cache->size & -cache->size;
+  if (align > 64)
+    align = 64;
+
+  n = (RISCV_PAGE_SIZE - sizeof(struct spa_slab)) /
+      (cache->size + sizeof(uint16_t));
+  while (n > 0) {
+    cache->offset = (sizeof(struct spa_slab) + n * sizeof(uint16_t) +
+                     align - 1) & ~(align - 1);
+    if (cache->offset + n * cache->size <= RISCV_PAGE_SIZE)
+      break;
+    n--;
+  }
+  assert(n > 0);
+  cache->per_slab = n;
+
+  cache->next_cache = spa_caches;
+  spa_caches = cache;
 }
 
-uintptr_t spa_get() { return __spa_get(false); }
-uintptr_t spa_get_zero() { return __spa_get(true); }
+static inline void*
+spa_slab_obj(struct spa_cache* cache, struct spa_slab* slab, unsigned int idx)
+{
+  return (uint8_t*)slab + cache->offset + idx * cache->size;
+}
+
+static void
+spa_slab_link(struct spa_cache* cache, struct spa_slab* slab)
+{
+  slab->prev = NULL;
+  slab->next = cache->partial;
+  if (cache->partial)
+    cache->partial->prev = slab;
+  cache->partial = slab;
+}
+
+static void
+spa_slab_unlink(struct spa_cache* cache, struct spa_slab* slab)
+{
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    cache->partial = slab->next;
+  }
+  if (slab->next)
+    slab->next->prev = slab->prev;
+  slab->prev = slab->next = NULL;
+}
+
+static struct spa_slab*
+spa_slab_new(struct spa_cache* cache)
+{
+  struct spa_slab* slab = cache->spare;
+  unsigned int i;
+
+  /* the spare is still all free, and constructed */
+  if (slab) {
+    cache->spare = NULL;
+    spa_slab_link(cache, slab);
+    return slab;
+  }
+
+  slab = (struct spa_slab*)spa_get();
+  if (!slab)
+    return NULL;
+
+  slab->cache = cache;
+  slab->in_use = 0;
+  slab->free = 0;
+  for (i = 0; i < cache->per_slab; i++) {
+    slab->next_free[i] = i + 1 < cache->per_slab ? i + 1 : SPA_SLAB_END;
+    if (cache->ctor)
+      cache->ctor(spa_slab_obj(cache, slab, i));
+  }
+  cache->slabs++;
+
+  spa_slab_link(cache, slab);
+  return slab;
+}
+
+void*
+spa_cache_alloc(struct spa_cache* cache)
+{
+  struct spa_slab* slab;
+  unsigned int idx;
+  void* obj;
+
+  if (!cache->per_slab)
+    spa_cache_setup(cache);
+
+  slab = cache->partial;
+  if (!slab)
+    slab = spa_slab_new(cache);
+  if (!slab) {
+    cache->failures++;
+    return NULL;
+  }
+
+  idx = slab->free;
+  assert(idx < cache->per_slab);
+  slab->free = slab->next_free[idx];
+  /* full slabs are on no list */
+  if (++slab->in_use == cache->per_slab)
+    spa_slab_unlink(cache, slab);
+
+  cache->allocs++;
+  cache->in_use++;
+
+  obj = spa_slab_obj(cache, slab, idx);
+  if (!cache->ctor)
+    memset(obj, 0, cache->size);
+  return obj;
+}
 
-/* put a page to the simple page allocator */
 void
-spa_put(uintptr_t page_addr)
+spa_cache_free(struct spa_cache* cache, void* obj)
 {
-  uintptr_t prev;
+  struct spa_slab* slab = SPA_SLAB(obj);
+  uintptr_t off = (uintptr_t)obj - (uintptr_t)slab - cache->offset;
+  unsigned int idx = off / cache->size;
+
+  assert(slab->cache == cache);
+  assert(off % cache->size == 0 && idx < cache->per_slab);
+  assert(slab->in_use > 0);
 
-  assert(IS_ALIGNED(page_addr, RISCV_PAGE_BITS));
-  assert(page_addr >= EYRIE_LOAD_START && page_addr < (freemem_va_start  + freemem_size));
+  if (slab->in_use == cache->per_slab)
+    spa_slab_link(cache, slab);
+  slab->next_free[idx] = slab->free;
+  slab->free = idx;
 
-  if (!LIST_EMPTY(spa_free_pages)) {
-    prev = spa_free_pages.tail;
-    assert(prev);
-    NEXT_PAGE(prev) = page_addr;
+  cache->frees++;
+  cache->in_use--;
+
+  if (--slab->in_use)
+    return;
+
+  /* keep one empty slab around, give the others back */
+  spa_slab_unlink(cache, slab);
+  if (!cache->spare) {
+    cache->spare = slab;
   } else {
-    spa_free_pages.head = page_addr;
+    spa_put((uintptr_t)slab);
+    cache->slabs--;
   }
+}
+
+void*
+spa_alloc(size_t size)
+{
+  unsigned int k;
+
+  if (!size || size > SPA_SLAB_MAX_SIZE)
+    return NULL;
+
+  for (k = 0; spa_size_caches[k].size < size; k++)
+    ;
+  assert(k < SPA_SIZE_CACHES);
+  return spa_cache_alloc(&spa_size_caches[k]);
+}
 
-  NEXT_PAGE(page_addr) = 0;
-  spa_free_pages.tail = page_addr;
+void
+spa_free(void* obj)
+{
+  if (obj)
+    spa_cache_free(SPA_SLAB(obj)->cache, obj);
+}
+
+/* put [start, end) to the simple page allocator, as the biggest aligned
+ * blocks that fit */
+static void
+spa_put_range(uintptr_t start, uintptr_t end)
+{
+  uintptr_t cur;
+  unsigned int order;
 
-  spa_free_pages.count++;
-  return;
+  for (cur = start; cur < end; cur += (uintptr_t)RISCV_PAGE_SIZE << order) {
+    order = SPA_MAX_ORDER;
+    while (order > 0 &&
+           (!IS_ALIGNED(__pa(cur), RISCV_PAGE_BITS + order) ||
+            cur + ((uintptr_t)RISCV_PAGE_SIZE << order) > end))
+      order--;
+    spa_put_order(cur, order);
+  }
 }
 
 unsigned int
 spa_available(){
+  unsigned int free = spa_free_count + spa_cached_count() +
+                     ((spa_end - spa_frontier) >> RISCV_PAGE_BITS);
 #ifndef USE_PAGING
-  return spa_free_pages.count;
+  return free;
 #else
-  return spa_free_pages.count + paging_remaining_pages();
+  return free + paging_remaining_pages();
 #endif
 }
 
 void
 spa_init(uintptr_t base, size_t size)
 {
-  uintptr_t cur;
+  size_t frames_size;
+  unsigned int order;
 
-  LIST_INIT(spa_free_pages);
+  for (order = 0; order <= SPA_MAX_ORDER; order++)
+    LIST_INIT(spa_free_lists[order]);
+  LIST_INIT(spa_zero_pages);
+  memset(spa_hot, 0, sizeof(spa_hot));
+  spa_free_count = 0;
+
+  /* forget the slabs of every cache */
+  while (spa_caches) {
+    struct spa_cache* cache = spa_caches;
+    spa_caches = cache->next_cache;
+    cache->per_slab = 0;
+    cache->partial = cache->spare = NULL;
+    cache->next_cache = NULL;
+    cache->allocs = cache->frees = cache->failures = 0;
+    cache->in_use = cache->slabs = 0;
+  }
 
   // both base and size must be page-aligned
   assert(IS_ALIGNED(base, RISCV_PAGE_BITS));
   assert(IS_ALIGNED(size, RISCV_PAGE_BITS));
 
-  /* put all free pages in freemem (base) into spa_free_pages */
-  for(cur = base;
-      cur < base + size;
-      cur += RISCV_PAGE_SIZE) {
-    spa_put(cur);
-  }
+  /* the frame states and counts take the first pages of freemem, and the
+   * states are set up as the frontier passes their frames; the rest of
+   * freemem (base) starts out unused */
+  frames_size = PAGE_UP((size >> RISCV_PAGE_BITS) * (1 + sizeof(uint16_t)));
+  assert(frames_size < size);
+  spa_frames = (uint8_t*)base;
+  spa_counts = (uint16_t*)(base + ROUND_UP(size >> RISCV_PAGE_BITS, 1));
+  spa_base = base;
+  spa_frontier = base + frames_size;
+  spa_end = base + size;
 }
 #endif // USE_FREEMEM
@@ -4,9 +4,23 @@
 #define __FREEMEM_H__
 
 #define NEXT_PAGE(page) *((uintptr_t*)page)
+#define PREV_PAGE(page) *((uintptr_t*)page + 1)
 #define LIST_EMPTY(list) ((list).count == 0 || (list).head == 0)
 #define LIST_INIT(list) { (list).count = 0; (list).head = 0; (list).tail = 0; }
 
+/* Largest block the allocator hands out is 2^SPA_MAX_ORDER pages, which is
+ * one 2 MB megapage */
+#define SPA_MAX_ORDER 9
+
+/* what a page freed to a hot cache will be used for next */
+enum spa_hot_kind
+{
+	SPA_HOT_USER_DATA,
+	/* only for pages that are all zero, e.g., empty page tables */
+	SPA_HOT_PAGE_TABLE,
+	SPA_HOT_KINDS
+};
+
 struct pg_list
 {
 	uintptr_t head;
@@ -14,10 +28,63 @@ struct pg_list
 	unsigned int count;
 };
 
+struct spa_slab;
+
+/* An object cache: objects of one size, packed into one-page slabs taken
+ * with spa_get(). With a constructor, every object of a new slab is
+ * constructed once, and objects must be freed in their constructed state
+ * so they can be handed out again as they are. Without one, objects are
+ * zeroed when allocated. */
+struct spa_cache
+{
+	const char* name;
+	size_t size;
+	void (*ctor)(void* obj);
+
+	/* filled in on first use */
+	unsigned int per_slab;
+	unsigned int offset;
+	struct spa_slab* partial;
+	struct spa_slab* spare;
+	struct spa_cache* next_cache;
+
+	/* statistics */
+	unsigned long allocs;
+	unsigned long frees;
+	unsigned long failures;
+	unsigned int in_use;
+	unsigned int slabs;
+};
+
+#define SPA_CACHE_INIT(cache_name, type, constructor) \
+	{ .name = (cache_name), .size = sizeof(type), .ctor = (constructor) }
+
+/* Biggest object of a cache, or of spa_alloc() */
+#define SPA_SLAB_MAX_SIZE (RISCV_PAGE_SIZE / 4)
+
 void spa_init(uintptr_t base, size_t size);
 uintptr_t spa_get(void);
 uintptr_t spa_get_zero(void);
 void spa_put(uintptr_t page);
+/* 2^order physically contiguous pages, aligned to their size */
+uintptr_t spa_get_order(unsigned int order);
+void spa_put_order(uintptr_t block, unsigned int order);
+/* like spa_get_order, but only from free memory, without evicting */
+uintptr_t spa_try_get_order(unsigned int order);
 unsigned int spa_available();
+/* zero a few free pages ahead of spa_get_zero(), from idle paths */
+void spa_zero_refill(void);
+/* LIFO reuse of single pages freed for, and taken for, one purpose */
+void spa_put_hot(uintptr_t page, enum spa_hot_kind kind);
+uintptr_t spa_get_zero_hot(enum spa_hot_kind kind);
+/* a count the holder of a freemem page may keep with it, which is not
+ * reset when the page is freed; NULL for other pages */
+uint16_t* spa_page_count(uintptr_t page);
+/* NULL when out of memory */
+void* spa_cache_alloc(struct spa_cache* cache);
+void spa_cache_free(struct spa_cache* cache, void* obj);
+/* zeroed objects of up to SPA_SLAB_MAX_SIZE bytes, from per-size caches */
+void* spa_alloc(size_t size);
+void spa_free(void* obj);
 #endif
 #endif
@@ -7,6 +7,7 @@
 #include "timex.h"
 #include "interrupt.h"
 #include "printf.h"
+#include "freemem.h"
 #include <asm/csr.h>
 
 #define DEFAULT_CLOCK_DELAY 10000
@@ -21,6 +22,10 @@ void init_timer(void)
 void handle_timer_interrupt()
 {
   sbi_stop_enclave(0);
+#ifdef USE_FREEMEM
+  /* the tick interrupted user code, so nothing is using the allocator */
+  spa_zero_refill();
+#endif
   unsigned long next_cycle = get_cycles64() + DEFAULT_CLOCK_DELAY;
   sbi_set_timer(next_cycle);
   csr_set(sstatus, SR_SPIE);
@@ -10,12 +10,25 @@
 
 #include "freemem.h"
 #include "mm.h"
+#include "paging.h"
 #include "rt_util.h"
 #include "syscall.h"
+#include "vma.h"
 #include "uaccess.h"
 
 #define CLOCK_FREQ 1000000000
 
+/* not in older headers; the values are the kernel's */
+#ifndef MADV_FREE
+#define MADV_FREE 8
+#endif
+#ifndef MADV_COLD
+#define MADV_COLD 20
+#endif
+#ifndef MADV_PAGEOUT
+#define MADV_PAGEOUT 21
+#endif
+
 //TODO we should check which clock this is
 uintptr_t linux_clock_gettime(__clockid_t clock, struct timespec *tp){
   print_strace("[runtime] clock_gettime not fully supported (clock %x, assuming)\r\n", clock);
@@ -101,59 +114,290 @@ uintptr_t linux_uname(void* buf){
 
 uintptr_t syscall_munmap(void *addr, size_t length){
   uintptr_t ret = (uintptr_t)((void*)-1);
+  uintptr_t start = (uintptr_t)addr;
+  uintptr_t end = PAGE_UP(start + length);
+
+  if(!IS_ALIGNED(start, RISCV_PAGE_BITS) || end < start)
+    goto done;
+
+  // Splitting a mapping needs a new VMA
+  if(vma_remove(start, end))
+    goto done;
 
-  free_pages(vpn((uintptr_t)addr), length/RISCV_PAGE_SIZE);
+  free_pages(vpn(start), (end - start)/RISCV_PAGE_SIZE);
   ret = 0;
+
+ done:
   return ret;
 }
 
-uintptr_t syscall_mmap(void *addr, size_t length, int prot, int flags,
-                 int fd, __off_t offset){
-  uintptr_t ret = (uintptr_t)((void*)-1);
-
+/* PTE flags of user pages with the given PROT_* */
+static int
+prot_to_pte_flags(int prot){
   int pte_flags = PTE_U | PTE_A;
 
-  if(flags != (MAP_ANONYMOUS | MAP_PRIVATE) || fd != -1){
-    // we don't support mmaping any other way yet
-    goto done;
-  }
-
-  // Set flags
   if(prot & PROT_READ)
     pte_flags |= PTE_R;
   if(prot & PROT_WRITE)
     pte_flags |= PTE_W | PTE_D;
   if(prot & PROT_EXEC)
     pte_flags |= PTE_X;
+  return pte_flags;
+}
+
+/* find room for req_pages pages in the anonymous region, on a megapage
+ * boundary for big ones so that they can be mapped with megapages
+ * returns 0 if there is none */
+static uintptr_t
+find_anon_range(size_t req_pages){
+  // Start looking at EYRIE_ANON_REGION_START for VA space
+  uintptr_t lo = EYRIE_ANON_REGION_START;
+  uintptr_t start;
+  uintptr_t valid_pages;
+  uintptr_t slack = req_pages >= MEGAPAGE_PAGES ?
+                    (MEGAPAGE_PAGES - 1) << RISCV_PAGE_BITS : 0;
+  while((start = vma_find_gap(lo, EYRIE_ANON_REGION_END,
+                              ((uintptr_t)req_pages << RISCV_PAGE_BITS) + slack))){
+    if(slack)
+      start = ROUND_UP(start, RISCV_PAGE_BITS + MEGAPAGE_ORDER);
+    // The runtime's own mappings in the region are not VMAs (rv32)
+    valid_pages = test_va_range(vpn(start), req_pages);
+
+    if(req_pages == valid_pages)
+      return start;
+    lo = start + ((valid_pages + 1) << RISCV_PAGE_BITS);
+  }
+  return 0;
+}
+
+uintptr_t syscall_mprotect(void *addr, size_t len, int prot){
+  uintptr_t ret = (uintptr_t)((void*)-1);
+  uintptr_t start = (uintptr_t)addr;
+  uintptr_t end = PAGE_UP(start + len);
+  int pte_flags = prot_to_pte_flags(prot);
+
+  if((prot & ~(PROT_READ | PROT_WRITE | PROT_EXEC)) ||
+     !IS_ALIGNED(start, RISCV_PAGE_BITS) || end < start){
+    goto done;
+  }
+  if(start == end){
+    ret = 0;
+    goto done;
+  }
+
+  // Every page must be mapped, and splitting a mapping needs a new VMA
+  if(!vma_mapped(start, end) || vma_protect(start, end, pte_flags)){
+    goto done;
+  }
+
+  // Resident, swapped out and demand-zero pages alike, with one flush
+  protect_pages(vpn(start), (end - start) / RISCV_PAGE_SIZE, pte_flags);
+  ret = 0;
+
+ done:
+  print_strace("[runtime] [mprotect]: addr 0x%p, len %lu, prot 0x%x = 0x%p\r\n", addr, len, prot, ret);
+  return ret;
+}
+
+uintptr_t syscall_madvise(void *addr, size_t len, int advice){
+  uintptr_t ret = (uintptr_t)((void*)-1);
+  uintptr_t start = (uintptr_t)addr;
+  uintptr_t end = PAGE_UP(start + len);
+  size_t pages = (end - start) / RISCV_PAGE_SIZE;
+
+  if(!IS_ALIGNED(start, RISCV_PAGE_BITS) || end < start){
+    goto done;
+  }
+  if(start == end){
+    ret = 0;
+    goto done;
+  }
+  if(!vma_mapped(start, end)){
+    goto done;
+  }
+
+  switch(advice){
+  case MADV_NORMAL:
+  case MADV_RANDOM:
+    if(vma_advise(start, end, 0, VMA_SEQUENTIAL))
+      goto done;
+    break;
+
+  case MADV_SEQUENTIAL:
+    // Faults back, or swap in, a few pages ahead
+    if(vma_advise(start, end, VMA_SEQUENTIAL, 0))
+      goto done;
+    break;
+
+  case MADV_DONTNEED:
+  case MADV_FREE:
+    // Anonymous pages read as zero afterwards
+    release_pages(vpn(start), pages);
+    break;
+
+  case MADV_WILLNEED:
+    // There is no one to swap in later, so do a few now
+#ifdef USE_PAGING
+    prefetch_pages(vpn(start), pages);
+#endif
+    break;
+
+  case MADV_COLD:
+  case MADV_PAGEOUT:
+    // Evicted before any other page, when something has to be
+#ifdef USE_PAGING
+    paging_mark_cold(vpn(start), pages);
+#endif
+    break;
+
+  case MADV_HUGEPAGE:
+  case MADV_NOHUGEPAGE:
+  case MADV_DONTFORK:
+  case MADV_DOFORK:
+  case MADV_DONTDUMP:
+  case MADV_DODUMP:
+    // Nothing to do here
+    break;
+
+  default:
+    goto done;
+  }
+  ret = 0;
+
+ done:
+  print_strace("[runtime] [madvise]: addr 0x%p, len %lu, advice %d = 0x%p\r\n", addr, len, advice, ret);
+  return ret;
+}
+
+uintptr_t syscall_mremap(void *old_address, size_t old_size,
+                         size_t new_size, int flags, void *new_address){
+  uintptr_t ret = (uintptr_t)((void*)-1);
+  uintptr_t old_start = (uintptr_t)old_address;
+  uintptr_t old_end = PAGE_UP(old_start + old_size);
+  uintptr_t new_end = PAGE_UP(old_start + new_size);
+  size_t old_pages = (old_end - old_start) / RISCV_PAGE_SIZE;
+  size_t new_pages = vpn(PAGE_UP(new_size));
+  size_t more_pages = new_pages - old_pages;
+  uintptr_t start;
+  struct vma* v;
+  struct vma* next;
+  int prot, vma_flags;
+  bool ok;
+
+  // we don't support moving to a given address, or duplicating
+  if((flags & ~MREMAP_MAYMOVE) || !old_size || !new_size ||
+     !IS_ALIGNED(old_start, RISCV_PAGE_BITS) || old_end < old_start){
+    goto done;
+  }
 
+  // The old range must be all in one anonymous mapping
+  v = vma_find(old_start);
+  if(!v || !(v->flags & VMA_ANON) || v->end < old_end){
+    goto done;
+  }
 
+  // Shrinking, or no change, is a munmap of the tail
+  if(new_pages <= old_pages){
+    if(new_end < old_end && vma_remove(new_end, old_end))
+      goto done;
+    free_pages(vpn(new_end), old_pages - new_pages);
+    ret = old_start;
+    goto done;
+  }
+
+  if(more_pages + get_reserved_pages() > spa_available()){
+    goto done;
+  }
+
+  // Grow in place if nothing is in the way
+  next = vma_next(old_end);
+  if(new_end > old_end && new_end <= EYRIE_ANON_REGION_END &&
+     (!next || next->start >= new_end) &&
+     test_va_range(vpn(old_end), more_pages) == more_pages){
+    if(reserve_pages(vpn(old_end), more_pages, v->prot) != more_pages ||
+       vma_insert(old_end, new_end, v->prot, v->flags)){
+      free_pages(vpn(old_end), more_pages);
+      goto done;
+    }
+    ret = old_start;
+    goto done;
+  }
+
+  if(!(flags & MREMAP_MAYMOVE)){
+    goto done;
+  }
+
+  // Otherwise move the pages, not their contents, to where the whole new
+  // size fits, and reserve the rest after them
+  start = find_anon_range(new_pages);
+  if(!start){
+    goto done;
+  }
+  prot = v->prot;
+  vma_flags = v->flags;
+  if(reserve_pages(vpn(start) + old_pages, more_pages, prot) != more_pages){
+    free_pages(vpn(start) + old_pages, more_pages);
+    goto done;
+  }
+  // Take the old range out first: splitting its mapping needs a new VMA,
+  // and nothing has changed yet if there is none
+  if(vma_remove(old_start, old_end)){
+    free_pages(vpn(start) + old_pages, more_pages);
+    goto done;
+  }
+  if(vma_insert(start, start + (new_pages << RISCV_PAGE_BITS), prot, vma_flags)){
+    // The old range now either borders what is left of its mapping, which
+    // it merges back into, or gave its VMA back to the cache, so putting it
+    // back can't fail
+    ok = !vma_insert(old_start, old_end, prot, vma_flags);
+    assert(ok);
+    free_pages(vpn(start) + old_pages, more_pages);
+    goto done;
+  }
+  move_pages(vpn(old_start), vpn(start), old_pages);
+  ret = start;
+
+ done:
+  print_strace("[runtime] [mremap]: old 0x%p, old size %lu, new size %lu, flags 0x%x, new 0x%p = 0x%p\r\n", old_address, old_size, new_size, flags, new_address, ret);
+  return ret;
+}
+
+uintptr_t syscall_mmap(void *addr, size_t length, int prot, int flags,
+                 int fd, __off_t offset){
+  uintptr_t ret = (uintptr_t)((void*)-1);
+
+  int pte_flags = prot_to_pte_flags(prot);
+
+  if(flags != (MAP_ANONYMOUS | MAP_PRIVATE) || fd != -1){
+    // we don't support mmaping any other way yet
+    goto done;
+  }
 
   // Find a continuous VA space that will fit the req. size
   int req_pages = vpn(PAGE_UP(length));
 
-  // Do we have enough available phys pages?
-  if( req_pages > spa_available()){
+  // Do we have enough available phys pages, counting the ones already
+  // promised to demand-zero pages?
+  if( req_pages + get_reserved_pages() > spa_available()){
     goto done;
   }
 
-  // Start looking at EYRIE_ANON_REGION_START for VA space
-  uintptr_t starting_vpn = vpn(EYRIE_ANON_REGION_START);
-  uintptr_t valid_pages;
-  while((starting_vpn + req_pages) <= EYRIE_ANON_REGION_END){
-    valid_pages = test_va_range(starting_vpn, req_pages);
-
-    if(req_pages == valid_pages){
-      // Set a successful value if we allocate
-      // TODO free partial allocation on failure
-      if(alloc_pages(starting_vpn, req_pages, pte_flags) == req_pages){
-        ret = starting_vpn << RISCV_PAGE_BITS;
-      }
-      break;
-    }
-    else
-      starting_vpn += valid_pages + 1;
+  uintptr_t start = find_anon_range(req_pages);
+  if(!start){
+    goto done;
   }
 
+  // Set a successful value if we reserve; the pages are backed on
+  // first touch. The range was empty, so a short reservation is undone
+  // by freeing all of it
+  if(reserve_pages(vpn(start), req_pages, pte_flags) != req_pages ||
+     vma_insert(start, start + ((uintptr_t)req_pages << RISCV_PAGE_BITS),
+                pte_flags, VMA_ANON)){
+    free_pages(vpn(start), req_pages);
+    goto done;
+  }
+  ret = start;
+
  done:
   print_strace("[runtime] [mmap]: addr: 0x%p, length %lu, prot 0x%x, flags 0x%x, fd %i, offset %lu (%li pages %x) = 0x%p\r\n", addr, length, prot, flags, fd, offset, req_pages, pte_flags, ret);
 
@@ -163,39 +407,74 @@ uintptr_t syscall_mmap(void *addr, size_t length, int prot, int flags,
 
 
 uintptr_t syscall_brk(void* addr){
-  // Two possible valid calls to brk we handle:
+  // Three possible valid calls to brk we handle:
   // NULL -> give current break
-  // ADDR -> give more pages up to ADDR if possible
+  // ADDR above the break -> give more pages up to ADDR if possible
+  // ADDR below the break -> give back the pages above ADDR, but never
+  //                         below where the heap started
 
   uintptr_t req_break = (uintptr_t)addr;
 
   uintptr_t current_break = get_program_break();
   uintptr_t ret = current_break;
   int req_page_count = 0;
+  uintptr_t heap_end = PAGE_UP(current_break);
+  uintptr_t new_end = PAGE_UP(req_break);
+  size_t reserved;
+  struct vma* next;
+
+  // Return current break if null, current break or below the heap
+  if( req_break == 0  || req_break == current_break ||
+      req_break < get_program_break_start()){
+    goto done;
+  }
 
-  // Return current break if null or current break
-  if( req_break == 0  || req_break <= current_break){
+  if( req_break < current_break){
+    // Trimming the end of the heap never splits its VMA
+    if( new_end < heap_end){
+      if( vma_remove(new_end, heap_end)){
+        goto done;
+      }
+      // This also gives back the backing pages of swapped out ones
+      free_pages(vpn(new_end), (heap_end - new_end) / RISCV_PAGE_SIZE);
+    }
+    set_program_break(req_break);
+    ret = req_break;
     goto done;
   }
 
   // Otherwise try to allocate pages
 
   // Can we allocate enough phys pages?
-  req_page_count = (PAGE_UP(req_break) - current_break) / RISCV_PAGE_SIZE;
+  req_page_count = (new_end - heap_end) / RISCV_PAGE_SIZE;
   print_strace("spa_available=%d\n", spa_available());
-  if( spa_available() < req_page_count){
+  if( spa_available() < req_page_count + get_reserved_pages()){
     goto done;
   }
 
-  // Allocate pages
-  // TODO free pages on failure
-  if( alloc_pages(vpn(current_break),
-                  req_page_count,
-                  PTE_W | PTE_R | PTE_D | PTE_U | PTE_A)
-      != req_page_count){
+  // The heap can't grow into a mapping, or the runtime's own pages, so
+  // that the whole new range is ours to roll back
+  next = vma_next(heap_end);
+  if( next && next->start < new_end){
+    goto done;
+  }
+  if( test_va_range(vpn(heap_end), req_page_count) != req_page_count){
     goto done;
   }
 
+  // Reserve pages, backed on first touch
+  if( req_page_count){
+    reserved = reserve_pages(vpn(heap_end),
+                             req_page_count,
+                             PTE_W | PTE_R | PTE_D | PTE_U | PTE_A);
+    if( reserved != req_page_count ||
+        vma_insert(heap_end, new_end,
+                   PTE_W | PTE_R | PTE_D | PTE_U | PTE_A, VMA_HEAP)){
+      free_pages(vpn(heap_end), reserved);
+      goto done;
+    }
+  }
+
   // Success
   set_program_break(req_break);
   ret = req_break;
@@ -19,6 +19,10 @@ uintptr_t linux_RET_BAD_wrap(unsigned long which);
 uintptr_t syscall_munmap(void *addr, size_t length);
 uintptr_t syscall_mmap(void *addr, size_t length, int prot, int flags,
                   int fd, __off_t offset);
+uintptr_t syscall_mprotect(void *addr, size_t len, int prot);
+uintptr_t syscall_madvise(void *addr, size_t len, int advice);
+uintptr_t syscall_mremap(void *old_address, size_t old_size,
+                         size_t new_size, int flags, void *new_address);
 uintptr_t syscall_brk(void* addr);
 #endif /* _LINUX_WRAP_H_ */
 #endif /* LINUX_SYSCALL_WRAPPING */
@@ -0,0 +1,22 @@
+#if defined(USE_FREEMEM) && defined(USE_PAGING)
+
+#include "merk_integrity.h"
+
+#include <stddef.h>
+
+static merk_violation_hook_t merk_violation_hook = NULL;
+
+void
+merk_set_violation_hook(merk_violation_hook_t hook) {
+  merk_violation_hook = hook;
+}
+
+merk_status_t
+merk_report(merk_status_t status, uintptr_t key) {
+  if (status != MERK_OK && merk_violation_hook) {
+    merk_violation_hook(status, key);
+  }
+  return status;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#pragma once
+
+#if defined(USE_FREEMEM) && defined(USE_PAGING)
+
+#include <stdint.h>
+
+/* Why a Merkle tree operation failed. The trees compute these on every
+ * path, without logging or asserts, and pass failures to merk_report. */
+typedef enum merk_status {
+  MERK_OK = 0,
+  // the key has no entry in the tree
+  MERK_NOT_FOUND,
+  // the entry for the key does not have the expected hash
+  MERK_HASH_MISMATCH,
+  // a node does not match the hash its parent holds for it
+  MERK_TAMPERED,
+  // a walk went deeper than the tree can legitimately be
+  MERK_TOO_DEEP,
+  // no backing page for a new node
+  MERK_NO_MEMORY,
+} merk_status_t;
+
+/* Called with every failure and the key (or slot) it was for. Integrity
+ * violations are reported before the operation returns, so the hook can
+ * decide whether the enclave goes on. */
+typedef void (*merk_violation_hook_t)(merk_status_t status, uintptr_t key);
+
+void
+merk_set_violation_hook(merk_violation_hook_t hook);
+
+/* Pass status to the hook if it is a failure, and return it */
+merk_status_t
+merk_report(merk_status_t status, uintptr_t key);
+
+#endif
@@ -0,0 +1,156 @@
+#if defined(USE_FREEMEM) && defined(USE_PAGING)
+
+#include "merk_pool.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "paging.h"
+#include "vm_defs.h"
+
+_Static_assert(
+    sizeof(merk_pool_page_t) <= 64,
+    "merk_pool_page_t should fit in one small node!");
+_Static_assert(
+    MERK_POOL_FREE_WORDS <= 8, "merk_pool_page_t summary is too narrow!");
+
+#define MERK_POOL_PAGE(node) \
+  ((merk_pool_page_t*)((uintptr_t)(node) & ~(uintptr_t)(RISCV_PAGE_SIZE - 1)))
+
+static void
+merk_pool_setup(merk_pool_t* pool) {
+  assert(pool->node_size >= MERK_POOL_MIN_NODE);
+  pool->nodes_per_page = RISCV_PAGE_SIZE / pool->node_size;
+  pool->header_nodes =
+      (sizeof(merk_pool_page_t) + pool->node_size - 1) / pool->node_size;
+}
+
+// A page with room for only one node is not worth a header
+static inline bool
+merk_pool_whole_page(const merk_pool_t* pool) {
+  return pool->nodes_per_page < 2;
+}
+
+static inline size_t
+merk_pool_usable(const merk_pool_t* pool) {
+  return pool->nodes_per_page - pool->header_nodes;
+}
+
+static void
+merk_pool_link(merk_pool_t* pool, merk_pool_page_t* page) {
+  page->prev = NULL;
+  page->next = pool->partial;
+  if (pool->partial) pool->partial->prev = page;
+  pool->partial = page;
+}
+
+static void
+merk_pool_unlink(merk_pool_t* pool, merk_pool_page_t* page) {
+  if (page->prev) {
+    page->prev->next = page->next;
+  } else {
+    pool->partial = page->next;
+  }
+  if (page->next) page->next->prev = page->prev;
+  page->prev = page->next = NULL;
+}
+
+static merk_pool_page_t*
+merk_pool_new_page(merk_pool_t* pool) {
+  merk_pool_page_t* page = pool->spare;
+  if (page) {
+    pool->spare = NULL;
+  } else {
+    page = (merk_pool_page_t*)paging_alloc_backing_page();
+    if (!page) return NULL;
+  }
+  memset(page, 0, sizeof(*page));
+
+  for (size_t i = pool->header_nodes; i < pool->nodes_per_page; i++) {
+    page->free[i / 64] |= 1ull << (i % 64);
+  }
+  for (size_t w = 0; w < MERK_POOL_FREE_WORDS; w++) {
+    if (page->free[w]) page->summary |= 1 << w;
+  }
+  page->free_count = merk_pool_usable(pool);
+
+  merk_pool_link(pool, page);
+  return page;
+}
+
+static void*
+merk_pool_take(merk_pool_t* pool, merk_pool_page_t* page) {
+  assert(page->free_count && page->summary);
+
+  size_t w   = __builtin_ctz(page->summary);
+  size_t idx = w * 64 + __builtin_ctzll(page->free[w]);
+  page->free[w] &= page->free[w] - 1;
+  if (!page->free[w]) page->summary &= ~(1 << w);
+  assert(idx >= pool->header_nodes && idx < pool->nodes_per_page);
+
+  if (!--page->free_count) merk_pool_unlink(pool, page);
+
+  void* node = (uint8_t*)page + idx * pool->node_size;
+  memset(node, 0, pool->node_size);
+  return node;
+}
+
+void*
+merk_pool_alloc(merk_pool_t* pool) {
+  if (!pool->nodes_per_page) merk_pool_setup(pool);
+
+  if (merk_pool_whole_page(pool)) {
+    void* node = (void*)paging_alloc_backing_page();
+    if (node) memset(node, 0, pool->node_size);
+    return node;
+  }
+
+  merk_pool_page_t* page = pool->partial;
+  if (!page) page = merk_pool_new_page(pool);
+  if (!page) return NULL;
+  return merk_pool_take(pool, page);
+}
+
+void*
+merk_pool_alloc_near(merk_pool_t* pool, const void* hint) {
+  if (!pool->nodes_per_page) merk_pool_setup(pool);
+
+  if (hint && !merk_pool_whole_page(pool)) {
+    merk_pool_page_t* page = MERK_POOL_PAGE(hint);
+    if (page->free_count) return merk_pool_take(pool, page);
+  }
+  return merk_pool_alloc(pool);
+}
+
+void
+merk_pool_free(merk_pool_t* pool, void* node) {
+  if (!node) return;
+  assert(pool->nodes_per_page);
+
+  if (merk_pool_whole_page(pool)) {
+    paging_free_backing_page((uintptr_t)node);
+    return;
+  }
+
+  merk_pool_page_t* page = MERK_POOL_PAGE(node);
+  size_t idx = ((uintptr_t)node - (uintptr_t)page) / pool->node_size;
+  assert(idx >= pool->header_nodes && idx < pool->nodes_per_page);
+  assert((uint8_t*)page + idx * pool->node_size == (uint8_t*)node);
+  assert((page->free[idx / 64] & (1ull << (idx % 64))) == 0);
+
+  page->free[idx / 64] |= 1ull << (idx % 64);
+  page->summary |= 1 << (idx / 64);
+
+  if (page->free_count++ == 0) merk_pool_link(pool, page);
+
+  if (page->free_count == merk_pool_usable(pool)) {
+    merk_pool_unlink(pool, page);
+    if (!pool->spare) {
+      pool->spare = page;
+    } else {
+      paging_free_backing_page((uintptr_t)page);
+    }
+  }
+}
+
+#endif
@@ -0,0 +1,57 @@
+#pragma once
+
+#if defined(USE_FREEMEM) && defined(USE_PAGING)
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm_defs.h"
+
+/* Fixed-size node pool for the Merkle trees, carved out of backing pages.
+ *
+ * Each page starts with a header that takes the first node slot(s) and
+ * holds a free bitmap plus a summary of which bitmap words are non-zero, so
+ * finding a free node is two ctz's. Pages with free nodes sit on a doubly
+ * linked list; a page leaves it when it fills and rejoins on its first free.
+ * A page whose nodes are all freed goes back to the backing allocator,
+ * except that one is kept cached so a tree hovering at a page boundary
+ * doesn't bounce pages.
+ *
+ * Nodes too big to share a page with a header get a page each. */
+#define MERK_POOL_MIN_NODE 32
+#define MERK_POOL_FREE_WORDS \
+  ((RISCV_PAGE_SIZE / MERK_POOL_MIN_NODE + 63) / 64)
+
+typedef struct merk_pool_page {
+  uint64_t free[MERK_POOL_FREE_WORDS];
+  uint16_t free_count;
+  // bit w is set while free[w] != 0
+  uint8_t summary;
+  struct merk_pool_page* prev;
+  struct merk_pool_page* next;
+} merk_pool_page_t;
+
+typedef struct merk_pool {
+  size_t node_size;
+  // Filled in on first use
+  size_t nodes_per_page;
+  size_t header_nodes;
+  merk_pool_page_t* partial;
+  merk_pool_page_t* spare;
+} merk_pool_t;
+
+#define MERK_POOL_INIT(type) \
+  { .node_size = sizeof(type) }
+
+/* Returns a zeroed node, or NULL when the backing store is exhausted */
+void*
+merk_pool_alloc(merk_pool_t* pool);
+/* Like merk_pool_alloc, but prefers the page of hint, which must be NULL or
+ * a live node of this pool */
+void*
+merk_pool_alloc_near(merk_pool_t* pool, const void* hint);
+void
+merk_pool_free(merk_pool_t* pool, void* node);
+
+#endif
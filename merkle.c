@@ -8,111 +8,102 @@
 
 // #include <sys/mman.h>
 
+#include "compiler.h"
+#include "merk_integrity.h"
+#include "merk_pool.h"
 #include "paging.h"
 #include "vm_defs.h"
 
 #if defined(USE_SHA3_ROCC)
 #include "sha3.h"
 #include "encoding.h"
-#include "compiler.h"
 #include "rocc.h"
 #else
 #include "sha256.h"
 #endif
 
-#ifndef MERK_SILENT
-#define MERK_LOG printf
-#else
-#define MERK_LOG(...)
-#endif
-
-_Static_assert(sizeof(merkle_node_t) == 64, "merkle_node_t is not 64 bytes!");
-
-#define MERK_NODES_PER_PAGE (RISCV_PAGE_SIZE / sizeof(merkle_node_t))
-
-typedef struct merkle_page_freelist {
-  uint64_t free[MERK_NODES_PER_PAGE / 64];
-  uint16_t free_count;
-  bool in_freelist;
-  struct merkle_page_freelist* next;
-} merkle_page_freelist_t;
-
 _Static_assert(
-    sizeof(merkle_page_freelist_t) <= sizeof(merkle_node_t),
-    "merkle_page_freelist_t does not fit in one merkle_node_t!");
-
-static merkle_page_freelist_t*
-merk_alloc_page(void) {
-  void* page                        = (void*)paging_alloc_backing_page();
-  merkle_page_freelist_t* free_list = (merkle_page_freelist_t*)page;
-  memset(free_list, 0, sizeof(*free_list));
+    sizeof(merkle_node_t) == MERK_NODE_BYTES,
+    "merkle_node_t is not MERK_NODE_BYTES bytes!");
 
-  for (size_t i = 0; i < MERK_NODES_PER_PAGE; i += 64) {
-    size_t this_page_nodes = MERK_NODES_PER_PAGE - i;
-    free_list->free[i / 64] =
-        (this_page_nodes < 64) * (1ull << this_page_nodes) - 1;
-  }
-  free_list->free[0] &= ~(uint64_t)1;
-  free_list->free_count = MERK_NODES_PER_PAGE - 1;
+#ifdef MERK_COMPACT
+_Static_assert(
+    MERK_NODE_BYTES % 16 == 0, "compact node handles need 16-byte nodes!");
 
-  return free_list;
+static inline merk_key_t
+merk_key(uintptr_t key) {
+  assert(key >= paging_backing_region());
+  assert((key & (RISCV_PAGE_SIZE - 1)) == 0);
+  return (key - paging_backing_region()) >> RISCV_PAGE_BITS;
 }
 
-static merkle_page_freelist_t* merk_free_list = NULL;
+static inline uintptr_t
+merk_node_key(const merkle_node_t* node) {
+  return paging_backing_region() + ((uintptr_t)node->ptr << RISCV_PAGE_BITS);
+}
 
-static merkle_node_t*
-merk_reserve_node_in_page(merkle_page_freelist_t* free_list) {
-  if (!free_list->free_count) return NULL;
+static inline merk_handle_t
+merk_handle(merkle_node_t* node) {
+  if (!node) return 0;
+  uintptr_t offset = (uintptr_t)node - paging_backing_region();
+  assert(offset >> 4 <= UINT32_MAX);
+  return offset >> 4;
+}
 
-  for (size_t i = 0; i < MERK_NODES_PER_PAGE / 64; i++) {
-    if (free_list->free[i]) {
-      size_t free_idx = __builtin_ctzll(free_list->free[i]);
-      free_list->free[i] &= ~(1ull << free_idx);
-      free_list->free_count--;
+static inline merkle_node_t*
+merk_child(const merkle_node_t* node, int side) {
+  merk_handle_t handle = node->children[side];
+  if (!handle) return NULL;
+  return (merkle_node_t*)(paging_backing_region() + ((uintptr_t)handle << 4));
+}
+#else
+static inline merk_key_t
+merk_key(uintptr_t key) {
+  return key;
+}
 
-      merkle_node_t* page = (merkle_node_t*)free_list;
-      assert(free_idx != 0);
+static inline uintptr_t
+merk_node_key(const merkle_node_t* node) {
+  return node->ptr;
+}
 
-      return page + free_idx;
-    }
-  }
-  return NULL;
+static inline merk_handle_t
+merk_handle(merkle_node_t* node) {
+  return node;
 }
 
-static merkle_node_t*
-merk_alloc_node(void) {
-  while (merk_free_list && merk_free_list->free_count == 0) {
-    // Clear out the unfree lists
-    merk_free_list->in_freelist = false;
-    merk_free_list              = merk_free_list->next;
-  }
+static inline merkle_node_t*
+merk_child(const merkle_node_t* node, int side) {
+  return node->children[side];
+}
+#endif
 
-  if (!merk_free_list) {
-    merk_free_list              = merk_alloc_page();
-    merk_free_list->in_freelist = true;
-  }
+static inline merkle_node_t*
+merk_left(const merkle_node_t* node) {
+  return merk_child(node, 0);
+}
 
-  merkle_node_t* out = merk_reserve_node_in_page(merk_free_list);
-  return out;
+static inline merkle_node_t*
+merk_right(const merkle_node_t* node) {
+  return merk_child(node, 1);
 }
 
-static void
-merk_free_node(merkle_node_t* node) {
-  uintptr_t page                    = (uintptr_t)node & ~(RISCV_PAGE_SIZE - 1);
-  merkle_page_freelist_t* free_list = (merkle_page_freelist_t*)page;
-  size_t idx                        = node - (merkle_node_t*)page;
+static merk_pool_t merk_pool = MERK_POOL_INIT(merkle_node_t);
 
-  assert(idx < MERK_NODES_PER_PAGE);
-  assert((free_list->free[idx / 64] & (1ull << (idx % 64))) == 0);
+static inline merkle_node_t*
+merk_alloc_node(void) {
+  return (merkle_node_t*)merk_pool_alloc(&merk_pool);
+}
 
-  free_list->free[idx / 64] |= (1ull << (idx % 64));
-  free_list->free_count++;
+// Place a new node in the page of a node it will point to or sit next to
+static inline merkle_node_t*
+merk_alloc_node_near(const merkle_node_t* hint) {
+  return (merkle_node_t*)merk_pool_alloc_near(&merk_pool, hint);
+}
 
-  if (!free_list->in_freelist) {
-    free_list->next        = merk_free_list;
-    merk_free_list         = free_list;
-    free_list->in_freelist = true;
-  }
+static inline void
+merk_free_node(merkle_node_t* node) {
+  merk_pool_free(&merk_pool, node);
 }
 
 static bool
@@ -227,58 +218,119 @@ merk_hash_single_node(
   #endif
 }
 
-bool
-merk_verify(
-    volatile merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
-  merkle_node_t node = *root;
-  if (!root->right) {
-    MERK_LOG("Root node doesn't have right child\n");
-    return false;
-  }
+/* Deferred mode: the nodes on the paths of deferred inserts are held here, in
+ * enclave memory, and their hashes are stale until merk_commit. Every
+ * ancestor of a dirty node is dirty, and a node's entry always comes after
+ * its parent's, so committing in reverse order hashes each node once, after
+ * its children. */
+#ifndef MERK_DIRTY_MAX
+#define MERK_DIRTY_MAX 64
+#endif
 
-  merkle_node_t left;
-  merkle_node_t right = *root->right;
+typedef struct merkle_dirty_entry {
+  merkle_node_t* node;  // where the node lives outside the enclave
+  merkle_node_t copy;   // trusted contents, except for the hash
+  // trusted ptr and hash of each child, while that child is clean
+  merkle_node_t child[2];
+  int8_t child_entry[2];  // entry of a dirty child, or -1
+  int8_t parent, side;
+} merkle_dirty_entry_t;
 
-  // Verify root node
-  if (!merk_verify_single_node(&node, NULL, &right)) {
-    MERK_LOG("Error verifying root!\n");
-    return false;
-  }
+static merkle_dirty_entry_t merk_dirty[MERK_DIRTY_MAX];
+static int merk_dirty_count = 0;
+
+// No legitimate path is longer; walks stop here rather than follow a loop
+// planted in untrusted memory
+#define MERK_MAX_DEPTH 32
 
-  node = right;
+// Verify the path below node, which is already trusted
+static merk_status_t
+merk_verify_path(merkle_node_t node, uintptr_t key, const uint8_t hash[32]) {
+  merkle_node_t left, right;
+  merk_key_t slot = merk_key(key);
 
-  for (int i = 0;; i++) {
+  for (int i = 0; i < MERK_MAX_DEPTH; i++) {
     // node is a leaf, so return its hash check
     if (!node.left && !node.right) {
-      int diff = memcmp(hash, node.hash, 32);
-      if(diff){
-        MERK_LOG("Compare failed, addr=0x%lx, hash=0x%lx_%lx, node.hash=0x%lx_%lx\n", key, *(uint64_t*)hash, *((uint64_t*)hash+1), *(uint64_t*)(node.hash), *((uint64_t*)(node.hash)+1));
+      if (node.ptr != slot) return merk_report(MERK_NOT_FOUND, key);
+      if (memcmp(hash, node.hash, 32) != 0) {
+        return merk_report(MERK_HASH_MISMATCH, key);
       }
-      return memcmp(hash, node.hash, 32) == 0;
+      return MERK_OK;
     }
 
     // Load in the next layer. This is to prevent race conditions
-    if (node.left) left = *(volatile merkle_node_t*)node.left;
-    if (node.right) right = *(volatile merkle_node_t*)node.right;
+    if (node.left) left = *(volatile merkle_node_t*)merk_left(&node);
+    if (node.right) right = *(volatile merkle_node_t*)merk_right(&node);
 
     bool node_ok = merk_verify_single_node(
         &node, node.left ? &left : NULL, node.right ? &right : NULL);
-    if (!node_ok) {
-      MERK_LOG("Error at node with ptr %zx in layer %d\n", node.ptr, i);
-      return false;
-    }
+    if (!node_ok) return merk_report(MERK_TAMPERED, merk_node_key(&node));
 
     // BST traversal
-    if (key < node.ptr) {
+    if (slot < node.ptr) {
       node = left;
     } else {
       node = right;
     }
   }
+  return merk_report(MERK_TOO_DEEP, key);
+}
+
+// Walk the dirty entries for key down to the first clean node, and check
+// that node against the trusted copy of it held by its dirty parent
+static merk_status_t
+merk_verify_dirty(uintptr_t key, const uint8_t hash[32]) {
+  merk_key_t slot = merk_key(key);
+  int e = 0, side = slot >= merk_dirty[0].copy.ptr;
+
+  // Entries are only added below their parents, so this is bounded
+  while (merk_dirty[e].child_entry[side] > e) {
+    e    = merk_dirty[e].child_entry[side];
+    side = slot >= merk_dirty[e].copy.ptr;
+  }
+
+  const merkle_dirty_entry_t* entry = &merk_dirty[e];
+  merkle_node_t* child_ptr          = merk_child(&entry->copy, side);
+  if (!child_ptr) return merk_report(MERK_NOT_FOUND, key);
+
+  merkle_node_t node = *(volatile merkle_node_t*)child_ptr;
+  if (node.ptr != entry->child[side].ptr ||
+      memcmp(node.hash, entry->child[side].hash, 32) != 0) {
+    return merk_report(MERK_TAMPERED, merk_node_key(&entry->copy));
+  }
+  return merk_verify_path(node, key, hash);
+}
+
+static merk_status_t
+merk_verify_status(
+    volatile merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
+  if (merk_dirty_count && merk_dirty[0].node == (merkle_node_t*)root) {
+    return merk_verify_dirty(key, hash);
+  }
+
+  merkle_node_t node = *root;
+  if (!node.right) return merk_report(MERK_NOT_FOUND, key);
+
+  merkle_node_t right = *(volatile merkle_node_t*)merk_right(&node);
+
+  // Verify root node
+  if (!merk_verify_single_node(&node, NULL, &right)) {
+    return merk_report(MERK_TAMPERED, key);
+  }
+
+  return merk_verify_path(right, key, hash);
+}
+
+bool
+merk_verify(
+    volatile merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
+  return merk_verify_status(root, key, hash) == MERK_OK;
 }
 
 // Insert a node at the leaf position. May insert a new intermediate node or
-// overwrite an existing one. Returns the node modified.
+// overwrite an existing one. Returns the node modified, or NULL if there is
+// no memory for a new intermediate node.
 static merkle_node_t*
 merk_splice_node(merkle_node_t* leaf, merkle_node_t* node) {
   if (node->ptr == leaf->ptr) {
@@ -287,20 +339,21 @@ merk_splice_node(merkle_node_t* leaf, merkle_node_t* node) {
     return node;
   }
 
-  merkle_node_t* new_parent = merk_alloc_node();
+  merkle_node_t* new_parent = merk_alloc_node_near(leaf);
+  if (!new_parent) return NULL;
 
   if (node->ptr < leaf->ptr) {
     *new_parent = (merkle_node_t){
         .ptr   = leaf->ptr,
-        .left  = node,
-        .right = leaf,
+        .left  = merk_handle(node),
+        .right = merk_handle(leaf),
     };
     merk_hash_single_node(new_parent, node, leaf);
   } else {
     *new_parent = (merkle_node_t){
         .ptr   = node->ptr,
-        .left  = leaf,
-        .right = node,
+        .left  = merk_handle(leaf),
+        .right = merk_handle(node),
     };
     merk_hash_single_node(new_parent, leaf, node);
   }
@@ -308,17 +361,24 @@ merk_splice_node(merkle_node_t* leaf, merkle_node_t* node) {
   return new_parent;
 }
 
-#define MERK_MAX_DEPTH 32
 static merkle_node_t* intermediate_nodes[MERK_MAX_DEPTH] = {};
 
 int
 merk_insert(merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
+  // The nodes below the root are stale while deferred inserts are pending
+  if (merk_dirty_count) merk_commit(root);
+
+  merk_key_t slot              = merk_key(key);
   merkle_node_t new_node_data = {
-      .ptr = key,
+      .ptr = slot,
   };
   memcpy(new_node_data.hash, hash, 32);
 
-  merkle_node_t* new_node            = merk_alloc_node();
+  merkle_node_t* new_node = merk_alloc_node();
+  if (!new_node) {
+    merk_report(MERK_NO_MEMORY, key);
+    return -1;
+  }
   *(volatile merkle_node_t*)new_node = new_node_data;
 
   // The root never contains data, only a single pointer to the start
@@ -328,7 +388,7 @@ merk_insert(merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
   // memory while others don't need to.
   if (!root->right) {
     merk_hash_single_node(root, NULL, &new_node_data);
-    root->right = new_node;
+    root->right = merk_handle(new_node);
     return 0;
   }
 
@@ -342,23 +402,21 @@ merk_insert(merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
 
     // Traverse the BST
 
-    bool traverse_left        = key < parent->ptr;
+    bool traverse_left        = slot < parent->ptr;
     bool child_idx            = traverse_left ^ 1;
-    intermediate_nodes[i + 1] = parent->children[child_idx];
+    intermediate_nodes[i + 1] = merk_child(parent, child_idx);
     if (!intermediate_nodes[i + 1]) break;
   }
 
-  if (i == MERK_MAX_DEPTH) {
-    printf(
-        "Inserted to merkle tree with problematic key insertion order! "
-        "This has led to an unbalanced tree exceeding the depth capacity of "
-        "%d. "
-        "Aborting!",
-        MERK_MAX_DEPTH);
-    assert(false);
+  // The key insertion order has unbalanced the tree past its depth capacity
+  if (i == MERK_MAX_DEPTH - 1) {
+    merk_free_node(new_node);
+    merk_report(MERK_TOO_DEEP, key);
+    return -1;
   }
 
   merkle_node_t curr_node = *intermediate_nodes[i];
+  bool spliced            = false;
 
   for (; i > 0; i--) {
     // Here we walk back up the tree to percolate up our new hashes.
@@ -379,10 +437,10 @@ merk_insert(merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
     merkle_node_t parent      = *(volatile merkle_node_t*)parent_ptr;
     merkle_node_t sibling;
     bool has_sibling = parent.left && parent.right;
-    int node_idx     = parent.right == node_ptr;
+    int node_idx     = merk_right(&parent) == node_ptr;
 
     if (has_sibling)
-      sibling = *(volatile merkle_node_t*)parent.children[!node_idx];
+      sibling = *(volatile merkle_node_t*)merk_child(&parent, !node_idx);
 
     // Check to see that the sibling we pull is valid.
     // We don't care about node_ptr races here, because if it's been tampered
@@ -393,8 +451,11 @@ merk_insert(merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
       copied_children[node_idx]  = node_ptr;
       copied_children[!node_idx] = &sibling;
       if (!merk_verify_single_node(
-              &parent, copied_children[0], copied_children[1]))
+              &parent, copied_children[0], copied_children[1])) {
+        if (!spliced) merk_free_node(new_node);
+        merk_report(MERK_TAMPERED, merk_node_key(&parent));
         return -1;
+      }
     }
 
     // At the leaf, insert the new node. merk_splice_node will handle updating
@@ -402,13 +463,19 @@ merk_insert(merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
     // the new "leaf" / bottom-layer node.
     if (!curr_node.left && !curr_node.right) {
       node_ptr = intermediate_nodes[i] = merk_splice_node(node_ptr, new_node);
+      if (!node_ptr) {
+        merk_free_node(new_node);
+        merk_report(MERK_NO_MEMORY, key);
+        return -1;
+      }
       curr_node                        = *node_ptr;
+      spliced                          = true;
 
-      parent.children[node_idx] = node_ptr;
+      parent.children[node_idx] = merk_handle(node_ptr);
     }
 
     // Hash our data from the saved curr_node and sibling.
-    assert(node_ptr == parent.children[node_idx]);
+    assert(node_ptr == merk_child(&parent, node_idx));
     const merkle_node_t* copied_children[2];
     copied_children[node_idx]  = &curr_node;
     copied_children[!node_idx] = has_sibling ? &sibling : NULL;
@@ -425,4 +492,457 @@ merk_insert(merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
   return 0;
 }
 
+// Give back a subtree built by merk_bulk_build_range that nothing points to
+static void
+merk_bulk_free(merkle_node_t* node) {
+  if (!node) return;
+  merk_bulk_free(merk_left(node));
+  merk_bulk_free(merk_right(node));
+  merk_free_node(node);
+}
+
+// Build a balanced subtree over keys[0..n), hashing each node once. The new
+// node is also returned in *out so that its parent is hashed from that copy
+// rather than from what was written to untrusted memory. Returns NULL, with
+// nothing left allocated, if there is no memory for a node.
+static merkle_node_t*
+merk_bulk_build_range(
+    const uintptr_t* keys, const uint8_t (*hashes)[32], size_t n,
+    merkle_node_t* out) {
+  uintptr_t key = keys[0];
+
+  if (n == 1) {
+    *out = (merkle_node_t){
+        .ptr = merk_key(keys[0]),
+    };
+    memcpy(out->hash, hashes[0], 32);
+  } else {
+    // Splitting at the middle keeps the tree within MERK_MAX_DEPTH for any
+    // n that fits in memory, and the right half starts at the separator
+    size_t mid = n / 2;
+    merkle_node_t left, right;
+    merkle_node_t* left_ptr = merk_bulk_build_range(keys, hashes, mid, &left);
+    if (!left_ptr) return NULL;
+    merkle_node_t* right_ptr =
+        merk_bulk_build_range(keys + mid, hashes + mid, n - mid, &right);
+    if (!right_ptr) {
+      merk_bulk_free(left_ptr);
+      return NULL;
+    }
+
+    key  = keys[mid];
+    *out = (merkle_node_t){
+        .ptr   = merk_key(keys[mid]),
+        .left  = merk_handle(left_ptr),
+        .right = merk_handle(right_ptr),
+    };
+    merk_hash_single_node(out, &left, &right);
+  }
+
+  merkle_node_t* node = merk_alloc_node();
+  if (!node) {
+    merk_bulk_free(merk_left(out));
+    merk_bulk_free(merk_right(out));
+    merk_report(MERK_NO_MEMORY, key);
+    return NULL;
+  }
+  *(volatile merkle_node_t*)node = *out;
+  return node;
+}
+
+int
+merk_bulk_build(
+    merkle_node_t* root, const uintptr_t* keys, const uint8_t (*hashes)[32],
+    size_t n) {
+  // Only into an empty tree, and keys must be strictly increasing
+  if (root->right) return -1;
+  for (size_t i = 1; i < n; i++) {
+    if (keys[i - 1] >= keys[i]) return -1;
+  }
+  if (!n) return 0;
+
+  merkle_node_t top;
+  merkle_node_t* top_ptr = merk_bulk_build_range(keys, hashes, n, &top);
+  if (!top_ptr) return -1;
+
+  merkle_node_t new_root = {};
+  merk_hash_single_node(&new_root, NULL, &top);
+  new_root.right                 = merk_handle(top_ptr);
+  *(volatile merkle_node_t*)root = new_root;
+  return 0;
+}
+
+_Static_assert(
+    MERK_DIRTY_MAX >= MERK_MAX_DEPTH && MERK_DIRTY_MAX <= INT8_MAX,
+    "MERK_DIRTY_MAX must hold one full path and fit an int8_t index!");
+
+// Add a copy of the internal node at node_ptr to the dirty table, after
+// checking its children against expected, the trusted copy of the node.
+// Returns the new entry, or -1 if the node has been tampered with.
+static int
+merk_dirty_add(
+    merkle_node_t* node_ptr, const merkle_node_t* expected, int parent,
+    int side) {
+  assert(merk_dirty_count < MERK_DIRTY_MAX);
+  merkle_dirty_entry_t* entry = &merk_dirty[merk_dirty_count];
+
+  entry->copy = *(volatile merkle_node_t*)node_ptr;
+  if (entry->copy.ptr != expected->ptr ||
+      (!entry->copy.left && !entry->copy.right)) {
+    merk_report(MERK_TAMPERED, merk_node_key(expected));
+    return -1;
+  }
+  for (int s = 0; s < 2; s++) {
+    if (entry->copy.children[s]) {
+      entry->child[s] = *(volatile merkle_node_t*)merk_child(&entry->copy, s);
+    }
+    entry->child_entry[s] = -1;
+  }
+  if (!merk_verify_single_node(
+          expected, entry->copy.left ? &entry->child[0] : NULL,
+          entry->copy.right ? &entry->child[1] : NULL)) {
+    merk_report(MERK_TAMPERED, merk_node_key(expected));
+    return -1;
+  }
+
+  entry->node   = node_ptr;
+  entry->parent = parent;
+  entry->side   = side;
+  return merk_dirty_count++;
+}
+
+int
+merk_insert_deferred(
+    merkle_node_t* root, uintptr_t key, const uint8_t hash[32]) {
+  // Nothing to share the path with yet
+  if (!root->right) return merk_insert(root, key, hash);
+
+  merk_key_t slot = merk_key(key);
+  bool committed  = false;
+  int e;
+retry:
+  if (!merk_dirty_count) {
+    merkle_node_t root_copy = *root;
+    if (merk_dirty_add(root, &root_copy, -1, 0) < 0) return -1;
+  }
+  assert(merk_dirty[0].node == root);
+
+  // Walk down through the dirty nodes, taking every clean internal node we
+  // pass into the table. Nothing is modified until the leaf is reached, so
+  // when the table fills up we can commit it and start over. Every step
+  // moves to a later entry or adds one, so the walk ends once the table is
+  // full; a path that fills an empty table is longer than any legitimate one.
+  for (e = 0;;) {
+    merkle_dirty_entry_t* entry = &merk_dirty[e];
+    int side                    = slot >= entry->copy.ptr;
+
+    if (entry->child_entry[side] >= 0) {
+      e = entry->child_entry[side];
+      continue;
+    }
+
+    merkle_node_t* child_ptr = merk_child(&entry->copy, side);
+    if (!child_ptr) {
+      merk_report(MERK_TAMPERED, merk_node_key(&entry->copy));
+      return -1;
+    }
+    merkle_node_t child = *(volatile merkle_node_t*)child_ptr;
+
+    if (child.left || child.right) {
+      if (merk_dirty_count == MERK_DIRTY_MAX) {
+        if (committed) {
+          merk_report(MERK_TOO_DEEP, key);
+          return -1;
+        }
+        merk_commit(root);
+        committed = true;
+        goto retry;
+      }
+      int c = merk_dirty_add(child_ptr, &entry->child[side], e, side);
+      if (c < 0) return -1;
+      entry->child_entry[side] = c;
+      e                        = c;
+      continue;
+    }
+
+    // child is the leaf to splice at; it must be what its parent recorded
+    const merkle_node_t* leaf = &entry->child[side];
+    if (child.ptr != leaf->ptr || memcmp(child.hash, leaf->hash, 32) != 0) {
+      merk_report(MERK_TAMPERED, merk_node_key(leaf));
+      return -1;
+    }
+
+    merkle_node_t new_node_data = {
+        .ptr = slot,
+    };
+    memcpy(new_node_data.hash, hash, 32);
+    merkle_node_t* new_node = merk_alloc_node();
+    if (!new_node) {
+      merk_report(MERK_NO_MEMORY, key);
+      return -1;
+    }
+    *(volatile merkle_node_t*)new_node = new_node_data;
+
+    if (slot == leaf->ptr) {
+      merk_free_node(child_ptr);
+      entry->copy.children[side] = merk_handle(new_node);
+      entry->child[side]         = new_node_data;
+      return 0;
+    }
+
+    // Same splice as merk_splice_node, but hashed from the trusted copies.
+    // The new intermediate node is clean: only entry and above are stale.
+    bool new_left = slot < leaf->ptr;
+    merkle_node_t new_parent_data = {
+        .ptr   = new_left ? leaf->ptr : slot,
+        .left  = merk_handle(new_left ? new_node : child_ptr),
+        .right = merk_handle(new_left ? child_ptr : new_node),
+    };
+    merk_hash_single_node(
+        &new_parent_data, new_left ? &new_node_data : leaf,
+        new_left ? leaf : &new_node_data);
+
+    merkle_node_t* new_parent = merk_alloc_node_near(child_ptr);
+    if (!new_parent) {
+      merk_free_node(new_node);
+      merk_report(MERK_NO_MEMORY, key);
+      return -1;
+    }
+    *(volatile merkle_node_t*)new_parent = new_parent_data;
+    entry->copy.children[side]           = merk_handle(new_parent);
+    entry->child[side]                   = new_parent_data;
+    return 0;
+  }
+}
+
+void
+merk_commit(merkle_node_t* root) {
+  if (!merk_dirty_count) return;
+  assert(merk_dirty[0].node == root);
+
+  for (int i = merk_dirty_count - 1; i >= 0; i--) {
+    merkle_dirty_entry_t* entry = &merk_dirty[i];
+    merk_hash_single_node(
+        &entry->copy, entry->copy.left ? &entry->child[0] : NULL,
+        entry->copy.right ? &entry->child[1] : NULL);
+    *(volatile merkle_node_t*)entry->node = entry->copy;
+
+    if (entry->parent >= 0) {
+      merk_dirty[entry->parent].child[entry->side] = entry->copy;
+    }
+  }
+  merk_dirty_count = 0;
+}
+
+/* Range operations take the run one chunk at a time, so that which of its
+ * keys were found fits in a fixed bitmap. Each chunk is one walk from the
+ * root: a node on the shared part of the paths is loaded and checked once. */
+#define MERK_RANGE_CHUNK 256
+
+typedef struct merk_range {
+  uintptr_t first_key;
+  size_t n;
+  merk_key_t lo, hi;  // first and last key of the chunk, as stored
+  const uint8_t (*hashes)[32];
+  size_t found_count;
+  uint64_t found[MERK_RANGE_CHUNK / 64];
+} merk_range_t;
+
+static void
+merk_range_init(
+    merk_range_t* range, uintptr_t first_key, size_t n,
+    const uint8_t (*hashes)[32]) {
+  memset(range, 0, sizeof(*range));
+  range->first_key = first_key;
+  range->n         = n;
+  range->lo        = merk_key(first_key);
+  range->hi        = merk_key(first_key + (n - 1) * RISCV_PAGE_SIZE);
+  range->hashes    = hashes;
+}
+
+// Index in the chunk of the key held by leaf, or -1 if it is not one of them
+static long
+merk_range_index(merk_range_t* range, const merkle_node_t* leaf) {
+  if (leaf->ptr < range->lo || leaf->ptr > range->hi) return -1;
+  uintptr_t offset = merk_node_key(leaf) - range->first_key;
+  if (offset & (RISCV_PAGE_SIZE - 1)) return -1;
+
+  long idx = offset >> RISCV_PAGE_BITS;
+  if (!(range->found[idx / 64] & (1ull << (idx % 64)))) {
+    range->found[idx / 64] |= 1ull << (idx % 64);
+    range->found_count++;
+  }
+  return idx;
+}
+
+// Load both children of node, which is trusted, and check them against it
+static bool
+merk_load_children(
+    const merkle_node_t* node, merkle_node_t* left, merkle_node_t* right) {
+  if (node->left) *left = *(volatile merkle_node_t*)merk_left(node);
+  if (node->right) *right = *(volatile merkle_node_t*)merk_right(node);
+
+  if (!merk_verify_single_node(
+          node, node->left ? left : NULL, node->right ? right : NULL)) {
+    merk_report(MERK_TAMPERED, merk_node_key(node));
+    return false;
+  }
+  return true;
+}
+
+// Check the leaves under node, which is trusted, that hold keys in [lo, hi].
+// A key of the chunk that is missing leads to a leaf with another key and is
+// caught by the caller's count.
+static bool
+merk_verify_range_node(
+    const merkle_node_t* node, merk_key_t lo, merk_key_t hi,
+    merk_range_t* range, int depth) {
+  if (!node->left && !node->right) {
+    long idx = merk_range_index(range, node);
+    if (idx >= 0 && memcmp(node->hash, range->hashes[idx], 32) != 0) {
+      merk_report(MERK_HASH_MISMATCH, merk_node_key(node));
+      return false;
+    }
+    return true;
+  }
+  if (depth >= MERK_MAX_DEPTH) {
+    merk_report(MERK_TOO_DEEP, merk_node_key(node));
+    return false;
+  }
+
+  merkle_node_t left, right;
+  if (!merk_load_children(node, &left, &right)) return false;
+
+  if (node->left && lo < node->ptr &&
+      !merk_verify_range_node(
+          &left, lo, hi < node->ptr ? hi : node->ptr - 1, range, depth + 1)) {
+    return false;
+  }
+  if (node->right && hi >= node->ptr &&
+      !merk_verify_range_node(
+          &right, lo > node->ptr ? lo : node->ptr, hi, range, depth + 1)) {
+    return false;
+  }
+  return true;
+}
+
+// Set the hashes of the leaves under node, a trusted copy, that hold keys in
+// [lo, hi], writing back the children that changed and rehashing node.
+// Returns 1 if node changed, 0 if not and -1 if the tree was tampered with.
+static int
+merk_update_range_node(
+    merkle_node_t* node, merk_key_t lo, merk_key_t hi, merk_range_t* range,
+    int depth) {
+  if (!node->left && !node->right) {
+    long idx = merk_range_index(range, node);
+    if (idx < 0) return 0;
+    memcpy(node->hash, range->hashes[idx], 32);
+    return 1;
+  }
+  if (depth >= MERK_MAX_DEPTH) {
+    merk_report(MERK_TOO_DEEP, merk_node_key(node));
+    return -1;
+  }
+
+  merkle_node_t left, right;
+  if (!merk_load_children(node, &left, &right)) return -1;
+
+  int changed = 0;
+  if (node->left && lo < node->ptr) {
+    int res = merk_update_range_node(
+        &left, lo, hi < node->ptr ? hi : node->ptr - 1, range, depth + 1);
+    if (res < 0) return -1;
+    if (res) *(volatile merkle_node_t*)merk_left(node) = left;
+    changed |= res;
+  }
+  if (node->right && hi >= node->ptr) {
+    int res = merk_update_range_node(
+        &right, lo > node->ptr ? lo : node->ptr, hi, range, depth + 1);
+    if (res < 0) return -1;
+    if (res) *(volatile merkle_node_t*)merk_right(node) = right;
+    changed |= res;
+  }
+
+  if (changed) {
+    merk_hash_single_node(
+        node, node->left ? &left : NULL, node->right ? &right : NULL);
+  }
+  return changed;
+}
+
+bool
+merk_verify_range(
+    merkle_node_t* root, uintptr_t first_key, size_t n,
+    const uint8_t (*hashes)[32]) {
+  if (merk_dirty_count) merk_commit(root);
+
+  for (size_t done = 0; done < n; done += MERK_RANGE_CHUNK) {
+    merk_range_t range;
+    size_t chunk = n - done < MERK_RANGE_CHUNK ? n - done : MERK_RANGE_CHUNK;
+    merk_range_init(
+        &range, first_key + done * RISCV_PAGE_SIZE, chunk, hashes + done);
+
+    merkle_node_t node = *(volatile merkle_node_t*)root;
+    if (!node.right) {
+      merk_report(MERK_NOT_FOUND, range.first_key);
+      return false;
+    }
+    merkle_node_t right = *(volatile merkle_node_t*)merk_right(&node);
+    if (!merk_verify_single_node(&node, NULL, &right)) {
+      merk_report(MERK_TAMPERED, range.first_key);
+      return false;
+    }
+
+    if (!merk_verify_range_node(&right, range.lo, range.hi, &range, 0)) {
+      return false;
+    }
+    if (range.found_count != range.n) {
+      merk_report(MERK_NOT_FOUND, range.first_key);
+      return false;
+    }
+  }
+  return true;
+}
+
+int
+merk_update_range(
+    merkle_node_t* root, uintptr_t first_key, size_t n,
+    const uint8_t (*hashes)[32]) {
+  if (merk_dirty_count) merk_commit(root);
+
+  for (size_t done = 0; done < n; done += MERK_RANGE_CHUNK) {
+    merk_range_t range;
+    size_t chunk = n - done < MERK_RANGE_CHUNK ? n - done : MERK_RANGE_CHUNK;
+    merk_range_init(
+        &range, first_key + done * RISCV_PAGE_SIZE, chunk, hashes + done);
+
+    merkle_node_t node = *(volatile merkle_node_t*)root;
+    if (node.right) {
+      merkle_node_t right = *(volatile merkle_node_t*)merk_right(&node);
+      if (!merk_verify_single_node(&node, NULL, &right)) {
+        merk_report(MERK_TAMPERED, range.first_key);
+        return -1;
+      }
+
+      int res = merk_update_range_node(&right, range.lo, range.hi, &range, 0);
+      if (res < 0) return -1;
+      if (res) {
+        *(volatile merkle_node_t*)merk_right(&node) = right;
+        merk_hash_single_node(&node, NULL, &right);
+        *(volatile merkle_node_t*)root = node;
+      }
+    }
+
+    // Keys that are not in the tree yet go in one at a time
+    for (size_t i = 0; i < range.n && range.found_count < range.n; i++) {
+      if (range.found[i / 64] & (1ull << (i % 64))) continue;
+      if (merk_insert(
+              root, range.first_key + i * RISCV_PAGE_SIZE, range.hashes[i])) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
 #endif
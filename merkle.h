@@ -6,26 +6,83 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+/* With MERK_COMPACT, keys are stored as backing page slots and children as
+ * handles into the backing region (byte offset / 16, 0 for none), which
+ * brings a node down from 64 to 48 bytes. Use merk_child, merk_node_key and
+ * friends in merkle.c rather than the fields. */
+#ifdef MERK_COMPACT
+typedef uint32_t merk_key_t;
+typedef uint32_t merk_handle_t;
+#define MERK_NODE_BYTES 48
+#else
+typedef uintptr_t merk_key_t;
+typedef union merkle_node* merk_handle_t;
+#define MERK_NODE_BYTES 64
+#endif
+
 typedef union merkle_node {
   struct {
-    uintptr_t ptr;
+    merk_key_t ptr;
+#ifndef MERK_COMPACT
     uint8_t hash[32];
+#endif
     union {
       struct {
-        union merkle_node *left, *right;
+        merk_handle_t left, right;
       };
-      union merkle_node* children[2];
+      merk_handle_t children[2];
     };
+#ifdef MERK_COMPACT
+    uint8_t hash[32];
+#endif
   };
   struct {
-    uint64_t raw_words[8];
+    uint64_t raw_words[MERK_NODE_BYTES / 8];
   };
 } merkle_node_t;
 
+/* Every failure below, including an integrity violation, is passed to
+ * merk_report (merk_integrity.h) before the operation returns. */
 int
 merk_insert(merkle_node_t* root, uintptr_t key, const uint8_t hash[32]);
 bool
 merk_verify(
     volatile merkle_node_t* root, uintptr_t key, const uint8_t hash_out[32]);
 
+/* Deferred mode: merk_insert_deferred updates the leaf and keeps the nodes
+ * above it, with stale hashes, in an enclave-private table. Inserts that
+ * share a path with it hash the shared part once, at the next merk_commit.
+ * merk_verify stays correct in the meantime. merk_insert commits first, and
+ * so does a deferred insert that would overflow the table. Returns 0, or -1
+ * if the tree was found tampered with. */
+int
+merk_insert_deferred(merkle_node_t* root, uintptr_t key, const uint8_t hash[32]);
+void
+merk_commit(merkle_node_t* root);
+
+/* Build the tree in an empty root from n (key, hash) pairs sorted by strictly
+ * increasing key. Every node is hashed once, instead of once per insert that
+ * passes through it. Returns 0 on success, -1 if root is not empty, the
+ * keys are not sorted, or there is no memory for the nodes, in which case
+ * root is left empty. */
+int
+merk_bulk_build(
+    merkle_node_t* root, const uintptr_t* keys, const uint8_t (*hashes)[32],
+    size_t n);
+
+/* Range operations on the n backing pages first_key, first_key +
+ * RISCV_PAGE_SIZE, ..., with hashes[i] for the i-th. The paths to them are
+ * walked once per run rather than once per key. merk_verify_range fails if
+ * any of the keys is missing or differs. merk_update_range sets the keys
+ * that are present in place and inserts the rest; it returns 0, or -1 if the
+ * tree was found tampered with. Both commit deferred inserts first. */
+bool
+merk_verify_range(
+    merkle_node_t* root, uintptr_t first_key, size_t n,
+    const uint8_t (*hashes)[32]);
+int
+merk_update_range(
+    merkle_node_t* root, uintptr_t first_key, size_t n,
+    const uint8_t (*hashes)[32]);
+
 #endif
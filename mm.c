@@ -4,15 +4,26 @@
 #include "mm.h"
 #include "freemem.h"
 #include "paging.h"
+#include "string.h"
+#include "vma.h"
 
 #ifdef USE_FREEMEM
 
+/* User megapages are backed by one buddy block each, where the allocator
+ * has blocks that big (rv64) */
+#define USER_MEGAPAGES (MEGAPAGE_ORDER <= SPA_MAX_ORDER)
+
 /* Page table utilities */
 static pte*
-__walk_create(pte* root, uintptr_t addr);
+__walk_internal(pte* root, uintptr_t addr, int create, int level);
 
 /* Hacky storage of current u-mode break */
 static uintptr_t current_program_break;
+/* the initial break, below which the heap never shrinks */
+static uintptr_t program_break_start;
+
+/* demand-zero pages that have no frame yet */
+static size_t reserved_pages;
 
 uintptr_t get_program_break(){
   return current_program_break;
@@ -22,33 +33,187 @@ void set_program_break(uintptr_t new_break){
   current_program_break = new_break;
 }
 
+void init_program_break(uintptr_t start){
+  program_break_start = current_program_break = start;
+}
+
+uintptr_t get_program_break_start(){
+  return program_break_start;
+}
+
+size_t get_reserved_pages(){
+  return reserved_pages;
+}
+
+static void
+__count_user_pages(long count)
+{
+#ifdef USE_PAGING
+  for (; count > 0; count--)
+    paging_inc_user_page();
+  for (; count < 0; count++)
+    paging_dec_user_page();
+#endif
+}
+
+/* A direct-mapped cache of the leaf tables of the VA ranges looked up
+ * last, so that repeated walks near the same addresses (fault handling,
+ * translate) skip the upper levels. A slot is dropped when its table is
+ * given back; a cached table never turns into anything else before that. */
+#define LEAF_CACHE_SIZE 64
+#define LEAF_TABLE_SHIFT (RISCV_PAGE_BITS + RISCV_PT_INDEX_BITS)
+
+static struct leaf_slot
+{
+  uintptr_t tag; // addr >> LEAF_TABLE_SHIFT
+  pte* table;    // NULL if empty
+} leaf_cache[LEAF_CACHE_SIZE];
+
+static inline struct leaf_slot*
+__leaf_slot(uintptr_t addr)
+{
+  return &leaf_cache[(addr >> LEAF_TABLE_SHIFT) % LEAF_CACHE_SIZE];
+}
+
+/* the last-level PTE of addr if its table is cached, or NULL */
+static inline pte*
+__leaf_cached(uintptr_t addr)
+{
+  struct leaf_slot* slot = __leaf_slot(addr);
+
+  if (!slot->table || slot->tag != addr >> LEAF_TABLE_SHIFT)
+    return NULL;
+  return &slot->table[RISCV_GET_PT_INDEX(addr, RISCV_PT_LEVELS)];
+}
+
+static inline void
+__leaf_remember(uintptr_t addr, pte* table)
+{
+  struct leaf_slot* slot = __leaf_slot(addr);
+  slot->tag = addr >> LEAF_TABLE_SHIFT;
+  slot->table = table;
+}
+
+static inline void
+__leaf_forget(uintptr_t addr)
+{
+  struct leaf_slot* slot = __leaf_slot(addr);
+  if (slot->tag == addr >> LEAF_TABLE_SHIFT)
+    slot->table = NULL;
+}
+
+/* Page tables taken from freemem keep the number of their non-zero
+ * entries in the page's freemem count, so that a table can be given back
+ * as soon as it is empty again; the root table and those outside freemem
+ * have no count and stay. */
+static inline void
+__count_entries(pte* entry, int delta)
+{
+  uint16_t* count = spa_page_count((uintptr_t)entry & ~MASK(RISCV_PAGE_BITS));
+  if (count)
+    *count += delta;
+}
+
+/* a user leaf above the last level, backed or demand-zero */
+static inline int
+__is_megapage(pte entry)
+{
+  return (entry & PTE_U) &&
+         (entry & (PTE_R | PTE_W | PTE_X | PTE_DZ | PTE_PROTNONE));
+}
+
+/* Every megapage, backed or demand-zero, has a zeroed table deposited
+ * for it when it is made, so that splitting it never allocates: a split
+ * may be needed while freemem is exhausted, or by the pager in the middle
+ * of an eviction, where allocating would evict again. The deposited
+ * tables are linked through their first word. */
+static uintptr_t megapage_tables;
+
+static void
+__deposit_table(uintptr_t table)
+{
+  *(uintptr_t*)table = megapage_tables;
+  megapage_tables = table;
+}
+
+static uintptr_t
+__withdraw_table()
+{
+  uintptr_t table = megapage_tables;
+
+  assert(table);
+  megapage_tables = *(uintptr_t*)table;
+  *(uintptr_t*)table = 0;
+  return table;
+}
+
+/* turn a megapage into a table of the same pages, so that they can be
+ * mapped, freed or evicted one by one */
+static void
+__split_megapage(pte* entry)
+{
+  uintptr_t table = __withdraw_table();
+  pte* t = (pte*) table;
+  size_t i;
+
+  uint16_t* count = spa_page_count(table);
+  if (count)
+    *count = BIT(RISCV_PT_INDEX_BITS);
+  for (i = 0; i < BIT(RISCV_PT_INDEX_BITS); i++) {
+    if (*entry & (PTE_V | PTE_PROTNONE))
+      t[i] = *entry + ((pte)i << PTE_PPN_SHIFT);
+    else
+      t[i] = *entry;
+  }
+
+  *entry = ptd_create(ppn(__pa(table)));
+}
+
 static pte*
-__continue_walk_create(pte* root, uintptr_t addr, pte* pte)
+__continue_walk_create(pte* root, uintptr_t addr, pte* pte, int level)
 {
-  uintptr_t new_page = spa_get_zero();
+  uintptr_t new_page = spa_get_zero_hot(SPA_HOT_PAGE_TABLE);
   assert(new_page);
 
+  uint16_t* count = spa_page_count(new_page);
+  if (count)
+    *count = 0;
+
   unsigned long free_ppn = ppn(__pa(new_page));
   *pte = ptd_create(free_ppn);
-  return __walk_create(root, addr);
+  __count_entries(pte, 1);
+  return __walk_internal(root, addr, 1, level);
 }
 
+/* walk the page table down to the PTE of addr at the given level,
+ * splitting any megapage on the way */
 static pte*
-__walk_internal(pte* root, uintptr_t addr, int create)
+__walk_internal(pte* root, uintptr_t addr, int create, int level)
 {
   pte* t = root;
+  pte* cached;
   int i;
-  for (i = 1; i < RISCV_PT_LEVELS; i++)
+
+  if (level == RISCV_PT_LEVELS && root == root_page_table &&
+      (cached = __leaf_cached(addr)))
+    return cached;
+
+  for (i = 1; i < level; i++)
   {
     size_t idx = RISCV_GET_PT_INDEX(addr, i);
 
+    if (__is_megapage(t[idx]))
+      __split_megapage(&t[idx]);
+
     if (!(t[idx] & PTE_V))
-      return create ? __continue_walk_create(root, addr, &t[idx]) : 0;
+      return create ? __continue_walk_create(root, addr, &t[idx], level) : 0;
 
     t = (pte*) __va(pte_ppn(t[idx]) << RISCV_PAGE_BITS);
   }
 
-  return &t[RISCV_GET_PT_INDEX(addr, 3)];
+  if (level == RISCV_PT_LEVELS && root == root_page_table)
+    __leaf_remember(addr, t);
+  return &t[RISCV_GET_PT_INDEX(addr, level)];
 }
 
 /* walk the page table and return PTE
@@ -56,7 +221,7 @@ __walk_internal(pte* root, uintptr_t addr, int create)
 static pte*
 __walk(pte* root, uintptr_t addr)
 {
-  return __walk_internal(root, addr, 0);
+  return __walk_internal(root, addr, 0, RISCV_PT_LEVELS);
 }
 
 /* walk the page table and return PTE
@@ -64,16 +229,84 @@ __walk(pte* root, uintptr_t addr)
 static pte*
 __walk_create(pte* root, uintptr_t addr)
 {
-  return __walk_internal(root, addr, 1);
+  return __walk_internal(root, addr, 1, RISCV_PT_LEVELS);
+}
+
+/* walk the page table and return the leaf PTE of addr, without changing
+ * anything; *level is where it is, above the last one for a megapage
+ * return 0 if no mapping exists */
+static pte*
+__walk_leaf(pte* root, uintptr_t addr, int* level)
+{
+  pte* t = root;
+  pte* cached;
+  int i;
+
+  if (root == root_page_table && (cached = __leaf_cached(addr))) {
+    *level = RISCV_PT_LEVELS;
+    return cached;
+  }
+
+  for (i = 1; i < RISCV_PT_LEVELS; i++)
+  {
+    size_t idx = RISCV_GET_PT_INDEX(addr, i);
+
+    if (__is_megapage(t[idx]))
+      break;
+    if (!(t[idx] & PTE_V))
+      return 0;
+
+    t = (pte*) __va(pte_ppn(t[idx]) << RISCV_PAGE_BITS);
+  }
+
+  if (i == RISCV_PT_LEVELS && root == root_page_table)
+    __leaf_remember(addr, t);
+  *level = i;
+  return &t[RISCV_GET_PT_INDEX(addr, i)];
+}
+
+
+/* how many of count pages from vpn have their PTEs in the same leaf table
+ * as vpn, so that the range walkers visit each table once */
+static inline size_t
+__table_span(uintptr_t vpn, size_t count)
+{
+  size_t span = BIT(RISCV_PT_INDEX_BITS) - (vpn & MASK(RISCV_PT_INDEX_BITS));
+  return span < count ? span : count;
 }
 
+/* back an unallocated PTE with a zeroed page
+ * returns VA of the page, (returns 0 if fails) */
+static uintptr_t
+__alloc_pte(pte* pte, int flags)
+{
+  uintptr_t page;
+
+	/* if the page has been already allocated, return the page */
+  if(*pte & PTE_V) {
+    return __va(pte_ppn(*pte) << RISCV_PAGE_BITS);
+  }
+
+  if(*pte & PTE_DZ)
+    reserved_pages--;
+  else if(!*pte)
+    __count_entries(pte, 1);
+
+	/* otherwise, allocate one from the freemem; user memory starts zeroed */
+  page = spa_get_zero_hot(SPA_HOT_USER_DATA);
+  assert(page);
+
+  *pte = pte_create(ppn(__pa(page)), flags | PTE_V);
+  __count_user_pages(1);
+
+  return page;
+}
 
 /* allocate a new page to a given vpn
  * returns VA of the page, (returns 0 if fails) */
 uintptr_t
 alloc_page(uintptr_t vpn, int flags)
 {
-  uintptr_t page;
   pte* pte = __walk_create(root_page_table, vpn << RISCV_PAGE_BITS);
 
   assert(flags & PTE_U);
@@ -81,31 +314,177 @@ alloc_page(uintptr_t vpn, int flags)
   if (!pte)
     return 0;
 
-	/* if the page has been already allocated, return the page */
-  if(*pte & PTE_V) {
-    return __va(*pte << RISCV_PAGE_BITS);
+  return __alloc_pte(pte, flags);
+}
+
+static void
+__reserve_pte(pte* pte, int flags)
+{
+  /* already allocated, reserved or swapped out */
+  if (*pte)
+    return;
+
+  *pte = (flags & PTE_FLAG_MASK & ~PTE_V) | PTE_DZ;
+  __count_entries(pte, 1);
+  reserved_pages++;
+}
+
+/* reserve a page at a given vpn, to be backed by a zeroed frame on its
+ * first access (see populate_page)
+ * returns 0 if fails */
+int
+reserve_page(uintptr_t vpn, int flags)
+{
+  pte* pte = __walk_create(root_page_table, vpn << RISCV_PAGE_BITS);
+
+  assert(flags & PTE_U);
+
+  if (!pte)
+    return 0;
+
+  __reserve_pte(pte, flags);
+  return 1;
+}
+
+/* reserve a whole megapage at a given vpn, aligned to it, if the
+ * permissions and the page table allow
+ * returns 0 if not */
+static int
+__reserve_megapage(uintptr_t vpn, int flags)
+{
+#if USER_MEGAPAGES
+  uintptr_t table;
+  pte* pte;
+
+  /* a megapage without permissions would look like a table */
+  if (!(flags & (PTE_R | PTE_W | PTE_X)))
+    return 0;
+
+  table = spa_get_zero_hot(SPA_HOT_PAGE_TABLE);
+  if (!table)
+    return 0;
+
+  pte = __walk_internal(root_page_table, vpn << RISCV_PAGE_BITS, 1, MEGAPAGE_LEVEL);
+  if (!pte || *pte) {
+    spa_put_hot(table, SPA_HOT_PAGE_TABLE);
+    return 0;
   }
 
-	/* otherwise, allocate one from the freemem */
-  page = spa_get();
-  assert(page);
+  __deposit_table(table);
+  *pte = (flags & PTE_FLAG_MASK & ~PTE_V) | PTE_DZ;
+  __count_entries(pte, 1);
+  reserved_pages += MEGAPAGE_PAGES;
+  return 1;
+#else
+  return 0;
+#endif
+}
 
-  *pte = pte_create(ppn(__pa(page)), flags | PTE_V);
-#ifdef USE_PAGING
-  paging_inc_user_page();
+/* back the demand-zero page of a faulting VA, with a whole megapage if
+ * it was reserved as one and a free block is at hand
+ * returns VA of the new page, (returns 0 if va is not demand-zero, or
+ * there is no memory) */
+uintptr_t
+populate_page(uintptr_t va)
+{
+  uintptr_t page;
+  int level;
+  pte* pte = __walk_leaf(root_page_table, va, &level);
+
+  if (!pte || (*pte & PTE_V) || !(*pte & PTE_DZ))
+    return 0;
+
+  /* PROT_NONE: a valid PTE without permissions would be a table */
+  if (!(*pte & (PTE_R | PTE_W | PTE_X)))
+    return 0;
+
+#if USER_MEGAPAGES
+  if (level < RISCV_PT_LEVELS) {
+    /* never evict to make room for a whole megapage */
+    page = spa_try_get_order(MEGAPAGE_ORDER);
+    if (page) {
+      memset((void*)page, 0, RISCV_PAGE_SIZE << MEGAPAGE_ORDER);
+      *pte = pte_create(ppn(__pa(page)), *pte & ~PTE_DZ);
+      reserved_pages -= MEGAPAGE_PAGES;
+      __count_user_pages(MEGAPAGE_PAGES);
+      return page + (va & MASK(RISCV_PAGE_BITS + MEGAPAGE_ORDER) & ~MASK(RISCV_PAGE_BITS));
+    }
+
+    /* back just this page */
+    pte = __walk(root_page_table, va);
+    if (!pte)
+      return 0;
+  }
 #endif
 
+  /* this may evict, but never this PTE, which isn't valid */
+  page = spa_get_zero_hot(SPA_HOT_USER_DATA);
+  if (!page)
+    return 0;
+
+  *pte = pte_create(ppn(__pa(page)), *pte & ~PTE_DZ);
+  reserved_pages--;
+  __count_user_pages(1);
+
   return page;
 }
 
-void
-free_page(uintptr_t vpn){
+/* back the demand-zero page of a faulting VA like populate_page, and in
+ * a mapping that is read sequentially, the few pages after it as well
+ * returns VA of the faulting page, (returns 0 like populate_page) */
+uintptr_t
+populate_fault(uintptr_t va)
+{
+  uintptr_t page = populate_page(va);
+  uintptr_t next = (va & ~MASK(RISCV_PAGE_BITS)) + RISCV_PAGE_SIZE;
+  struct vma* v;
+  size_t i;
+
+  if (!page)
+    return 0;
+
+  v = vma_find(va);
+  if (v && (v->flags & VMA_SEQUENTIAL)) {
+    for (i = 0; i < FAULT_AROUND_PAGES && next < v->end; i++) {
+      if (!populate_page(next))
+        break;
+      next += RISCV_PAGE_SIZE;
+    }
+  }
+  return page;
+}
+
+static void
+__free_pte(pte* pte)
+{
+  // Reserved but never touched: nothing to give back
+  if(*pte & PTE_DZ) {
+    *pte = 0;
+    __count_entries(pte, -1);
+    reserved_pages--;
+    return;
+  }
 
-  pte* pte = __walk(root_page_table, vpn << RISCV_PAGE_BITS);
+  // PROT_NONE: still has its frame, but is not counted as a user page
+  if(*pte & PTE_PROTNONE) {
+    uintptr_t ppn = pte_ppn(*pte);
+    *pte = 0;
+    __count_entries(pte, -1);
+    spa_put_hot(__va(ppn << RISCV_PAGE_BITS), SPA_HOT_USER_DATA);
+    return;
+  }
 
-  // No such PTE, or invalid
-  if(!pte || !(*pte & PTE_V))
+  // Swapped out: give back its backing page instead
+  if(!(*pte & PTE_V)) {
+#ifdef USE_PAGING
+    if(*pte & PTE_U) {
+      paging_free_backing_page(__paging_va(pte_ppn(*pte) << RISCV_PAGE_BITS));
+      *pte = 0;
+      __count_entries(pte, -1);
+    }
+#endif
     return;
+  }
 
   assert(*pte & PTE_U);
 
@@ -113,15 +492,16 @@ free_page(uintptr_t vpn){
   // Mark invalid
   // TODO maybe do more here
   *pte = 0;
+  __count_entries(pte, -1);
 
-#ifdef USE_PAGING
-  paging_dec_user_page();
-#endif
-  // Return phys page
-  spa_put(__va(ppn << RISCV_PAGE_BITS));
-
-  return;
+  __count_user_pages(-1);
+  // Return phys page, while it is still warm
+  spa_put_hot(__va(ppn << RISCV_PAGE_BITS), SPA_HOT_USER_DATA);
+}
 
+void
+free_page(uintptr_t vpn){
+  free_pages(vpn, 1);
 }
 
 /* allocate n new pages from a given vpn
@@ -129,24 +509,370 @@ free_page(uintptr_t vpn){
 size_t
 alloc_pages(uintptr_t vpn, size_t count, int flags)
 {
-  unsigned int i;
-  for (i = 0; i < count; i++) {
-    if(!alloc_page(vpn + i, flags))
+  size_t i, j, span;
+
+  assert(flags & PTE_U);
+
+  for (i = 0; i < count; i += span) {
+    span = __table_span(vpn + i, count - i);
+    pte* ptes = __walk_create(root_page_table, (vpn + i) << RISCV_PAGE_BITS);
+    if (!ptes)
       break;
+
+    for (j = 0; j < span; j++) {
+      if (!__alloc_pte(&ptes[j], flags))
+        return i + j;
+    }
   }
 
   return i;
 }
 
+/* reserve n new demand-zero pages from a given vpn, as megapages where
+ * whole aligned ones fit
+ * returns the number of pages reserved */
+size_t
+reserve_pages(uintptr_t vpn, size_t count, int flags)
+{
+  size_t i, j, span;
+
+  assert(flags & PTE_U);
+
+  for (i = 0; i < count; i += span) {
+    span = __table_span(vpn + i, count - i);
+    if (span == MEGAPAGE_PAGES && __reserve_megapage(vpn + i, flags))
+      continue;
+
+    pte* ptes = __walk_create(root_page_table, (vpn + i) << RISCV_PAGE_BITS);
+    if (!ptes)
+      break;
+
+    for (j = 0; j < span; j++)
+      __reserve_pte(&ptes[j], flags);
+  }
+
+  return i;
+}
+
+/* free a whole megapage at a given vpn, if there is one
+ * returns 0 if not */
+static int
+__free_megapage(uintptr_t vpn)
+{
+  int level;
+  pte* pte = __walk_leaf(root_page_table, vpn << RISCV_PAGE_BITS, &level);
+
+  if (!pte || level == RISCV_PT_LEVELS)
+    return 0;
+
+  if (*pte & (PTE_V | PTE_PROTNONE)) {
+    spa_put_order(__va(pte_ppn(*pte) << RISCV_PAGE_BITS), MEGAPAGE_ORDER);
+    if (*pte & PTE_V)
+      __count_user_pages(-(long)MEGAPAGE_PAGES);
+  } else {
+    reserved_pages -= MEGAPAGE_PAGES;
+  }
+  *pte = 0;
+  __count_entries(pte, -1);
+  spa_put_hot(__withdraw_table(), SPA_HOT_PAGE_TABLE);
+  return 1;
+}
+
+/* give back the tables on the way to addr that have become empty, from
+ * the bottom up */
+static void
+__free_empty_tables(uintptr_t addr)
+{
+  pte* parents[RISCV_PT_LEVELS];
+  pte* t = root_page_table;
+  int i;
+
+  for (i = 1; i < RISCV_PT_LEVELS; i++) {
+    pte* entry = &t[RISCV_GET_PT_INDEX(addr, i)];
+    if (!(*entry & PTE_V) || __is_megapage(*entry))
+      break;
+    parents[i] = entry;
+    t = (pte*) __va(pte_ppn(*entry) << RISCV_PAGE_BITS);
+  }
+
+  while (--i > 0) {
+    uint16_t* count = spa_page_count((uintptr_t)t);
+    if (!count || *count)
+      break;
+
+    *parents[i] = 0;
+    __count_entries(parents[i], -1);
+    __leaf_forget(addr);
+    spa_put_hot((uintptr_t)t, SPA_HOT_PAGE_TABLE);
+    t = (pte*)((uintptr_t)parents[i] & ~MASK(RISCV_PAGE_BITS));
+  }
+}
+
 void
 free_pages(uintptr_t vpn, size_t count){
-  unsigned int i;
-  for (i = 0; i < count; i++) {
-    free_page(vpn + i);
+  size_t i, j, span;
+  int level;
+  int cleared = 0;
+
+  for (i = 0; i < count; i += span) {
+    span = __table_span(vpn + i, count - i);
+    if (span == MEGAPAGE_PAGES && __free_megapage(vpn + i)) {
+      __free_empty_tables((vpn + i) << RISCV_PAGE_BITS);
+      cleared = 1;
+      continue;
+    }
+
+    // No leaf table, so nothing mapped in the whole span
+    pte* ptes = __walk_leaf(root_page_table, (vpn + i) << RISCV_PAGE_BITS, &level);
+    if (!ptes)
+      continue;
+
+    // Part of a megapage: split it, which takes its deposited table and
+    // can't fail
+    if (level < RISCV_PT_LEVELS) {
+      ptes = __walk(root_page_table, (vpn + i) << RISCV_PAGE_BITS);
+      assert(ptes);
+    }
+
+    for (j = 0; j < span; j++)
+      __free_pte(&ptes[j]);
+    __free_empty_tables((vpn + i) << RISCV_PAGE_BITS);
+    cleared = 1;
   }
 
+  // Neither the freed pages nor the freed tables may be reached through
+  // the TLB once they are reused
+  if (cleared)
+    tlb_flush();
 }
 
+/* move a whole megapage from old_vpn to new_vpn, both aligned to it, if
+ * there is one and nothing is below new_vpn yet
+ * returns 0 if not */
+static int
+__move_megapage(uintptr_t old_vpn, uintptr_t new_vpn)
+{
+#if USER_MEGAPAGES
+  int level;
+  pte* dst;
+  pte* src = __walk_leaf(root_page_table, old_vpn << RISCV_PAGE_BITS, &level);
+
+  if (!src || level == RISCV_PT_LEVELS)
+    return 0;
+
+  /* making the new tables may evict from, and split, the megapage */
+  dst = __walk_internal(root_page_table, new_vpn << RISCV_PAGE_BITS, 1, MEGAPAGE_LEVEL);
+  src = __walk_leaf(root_page_table, old_vpn << RISCV_PAGE_BITS, &level);
+  if (!dst || *dst || level == RISCV_PT_LEVELS)
+    return 0;
+
+  *dst = *src;
+  __count_entries(dst, 1);
+  *src = 0;
+  __count_entries(src, -1);
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/* move the PTEs of count pages from old_vpn to new_vpn, where nothing is
+ * mapped, without touching the pages: valid, demand-zero and swapped out
+ * pages all keep what backs them */
+void
+move_pages(uintptr_t old_vpn, uintptr_t new_vpn, size_t count){
+  size_t i, j, span, moved;
+  int level;
+  int cleared = 0;
+
+  for (i = 0; i < count; i += span) {
+    span = __table_span(old_vpn + i, count - i);
+    span = __table_span(new_vpn + i, span);
+    if (span == MEGAPAGE_PAGES && __move_megapage(old_vpn + i, new_vpn + i)) {
+      __free_empty_tables((old_vpn + i) << RISCV_PAGE_BITS);
+      cleared = 1;
+      continue;
+    }
+
+    // No leaf table, so nothing mapped in the whole span
+    if (!__walk_leaf(root_page_table, (old_vpn + i) << RISCV_PAGE_BITS, &level))
+      continue;
+
+    // The new table may evict, and split, before the old one is walked
+    pte* dst = __walk_create(root_page_table, (new_vpn + i) << RISCV_PAGE_BITS);
+    pte* src = __walk(root_page_table, (old_vpn + i) << RISCV_PAGE_BITS);
+    assert(dst && src);
+
+    for (j = 0, moved = 0; j < span; j++) {
+      if (!src[j])
+        continue;
+      dst[j] = src[j];
+      src[j] = 0;
+      moved++;
+    }
+    __count_entries(dst, moved);
+    __count_entries(src, -(int)moved);
+    __free_empty_tables((old_vpn + i) << RISCV_PAGE_BITS);
+    __free_empty_tables((new_vpn + i) << RISCV_PAGE_BITS);
+    cleared = 1;
+  }
+
+  // The old VAs must not reach the pages through the TLB
+  if (cleared)
+    tlb_flush();
+}
+
+/* give a user PTE, which maps the given number of pages, the permissions
+ * of flags, keeping what backs it; a backed page without any permission
+ * is kept invalid, as a valid PTE without them would be a table */
+static void
+__protect_pte(pte* pte, int flags, long pages)
+{
+  flags &= PTE_FLAG_MASK & ~(PTE_V | PTE_DZ | PTE_PROTNONE);
+
+  if (!*pte)
+    return;
+
+  // Reserved: backed on first touch with the new flags
+  if (*pte & PTE_DZ) {
+    *pte = flags | PTE_DZ;
+    return;
+  }
+
+  // Swapped out: swapped in with the new flags
+  if (!(*pte & (PTE_V | PTE_PROTNONE))) {
+    *pte = pte_create_invalid(pte_ppn(*pte), flags);
+    return;
+  }
+
+  if (flags & (PTE_R | PTE_W | PTE_X)) {
+    if (*pte & PTE_PROTNONE)
+      __count_user_pages(pages);
+    *pte = pte_create(pte_ppn(*pte), flags);
+  } else {
+    // Not a user page the pager may pick while it can't be touched
+    if (*pte & PTE_V)
+      __count_user_pages(-pages);
+    *pte = pte_create_invalid(pte_ppn(*pte), flags | PTE_PROTNONE);
+  }
+}
+
+/* change the permissions of count pages from vpn to flags, without
+ * swapping in or backing any of them */
+void
+protect_pages(uintptr_t vpn, size_t count, int flags){
+  size_t i, j, span;
+  int level;
+  int changed = 0;
+
+  assert(flags & PTE_U);
+
+  for (i = 0; i < count; i += span) {
+    span = __table_span(vpn + i, count - i);
+    pte* ptes = __walk_leaf(root_page_table, (vpn + i) << RISCV_PAGE_BITS, &level);
+    if (!ptes)
+      continue;
+
+    // A whole megapage keeps being one
+    if (level < RISCV_PT_LEVELS && span == MEGAPAGE_PAGES) {
+      __protect_pte(ptes, flags, MEGAPAGE_PAGES);
+      changed = 1;
+      continue;
+    }
+
+    ptes = __walk(root_page_table, (vpn + i) << RISCV_PAGE_BITS);
+    assert(ptes);
+
+    for (j = 0; j < span; j++)
+      __protect_pte(&ptes[j], flags, 1);
+    changed = 1;
+  }
+
+  // One flush for the whole range
+  if (changed)
+    tlb_flush();
+}
+
+/* make a backed, or swapped out, user page demand-zero again */
+static void
+__release_pte(pte* pte)
+{
+  int flags;
+
+  if (!*pte || (*pte & PTE_DZ))
+    return;
+
+  flags = *pte & PTE_FLAG_MASK & ~(PTE_V | PTE_PROTNONE);
+  __free_pte(pte);
+  __reserve_pte(pte, flags);
+}
+
+/* give back the frames and backing pages of count pages from vpn; they
+ * stay mapped, and are zero on their next touch */
+void
+release_pages(uintptr_t vpn, size_t count){
+  size_t i, j, span;
+  int level, flags;
+  int cleared = 0;
+
+  for (i = 0; i < count; i += span) {
+    span = __table_span(vpn + i, count - i);
+    pte* ptes = __walk_leaf(root_page_table, (vpn + i) << RISCV_PAGE_BITS, &level);
+    if (!ptes)
+      continue;
+
+    // A whole megapage is given back as one
+    if (level < RISCV_PT_LEVELS && span == MEGAPAGE_PAGES) {
+      if (*ptes & PTE_DZ)
+        continue;
+      flags = *ptes & PTE_FLAG_MASK & ~(PTE_V | PTE_PROTNONE);
+      __free_megapage(vpn + i);
+      reserve_pages(vpn + i, span, flags);
+      cleared = 1;
+      continue;
+    }
+
+    ptes = __walk(root_page_table, (vpn + i) << RISCV_PAGE_BITS);
+    assert(ptes);
+
+    for (j = 0; j < span; j++)
+      __release_pte(&ptes[j]);
+    cleared = 1;
+  }
+
+  if (cleared)
+    tlb_flush();
+}
+
+#ifdef USE_PAGING
+/* swap in the swapped out pages among count pages from vpn, ahead of
+ * their faults; at most PREFETCH_MAX_PAGES, as each one evicts another
+ * page
+ * returns the number of pages swapped in */
+size_t
+prefetch_pages(uintptr_t vpn, size_t count){
+  size_t i, j, span;
+  size_t done = 0;
+  int level;
+
+  for (i = 0; i < count; i += span) {
+    span = __table_span(vpn + i, count - i);
+    pte* ptes = __walk_leaf(root_page_table, (vpn + i) << RISCV_PAGE_BITS, &level);
+    // Megapages are split when one of their pages is evicted
+    if (!ptes || level < RISCV_PT_LEVELS)
+      continue;
+
+    for (j = 0; j < span; j++) {
+      if (!ptes[j] || (ptes[j] & (PTE_V | PTE_DZ | PTE_PROTNONE)))
+        continue;
+      if (!paging_swap_in(&ptes[j]) || ++done == PREFETCH_MAX_PAGES)
+        return done;
+    }
+  }
+  return done;
+}
+#endif /* USE_PAGING */
+
 /*
  * Check if a range of VAs contains any allocated pages, starting with
  * the given VA. Returns the number of sequential pages that meet the
@@ -155,31 +881,45 @@ free_pages(uintptr_t vpn, size_t count){
 size_t
 test_va_range(uintptr_t vpn, size_t count){
 
-  unsigned int i;
-  /* Validate the region */
-  for (i = 0; i < count; i++) {
-    pte* pte = __walk_internal(root_page_table, (vpn+i) << RISCV_PAGE_BITS, 0);
-    // If the page exists and is valid then we cannot use it
-    if(pte && *pte){
-      break;
+  size_t i, j, span;
+  /* Validate the region, a leaf table at a time */
+  for (i = 0; i < count; i += span) {
+    int level;
+    span = __table_span(vpn + i, count - i);
+    pte* ptes = __walk_leaf(root_page_table, (vpn + i) << RISCV_PAGE_BITS, &level);
+    if (!ptes)
+      continue;
+
+    // A megapage occupies the whole span
+    if (level < RISCV_PT_LEVELS)
+      return i;
+
+    for (j = 0; j < span; j++) {
+      // If the page exists and is valid then we cannot use it
+      if(ptes[j])
+        return i + j;
     }
   }
-  return i;
+  return count;
 }
 
 /* get a mapped physical address for a VA */
 uintptr_t
 translate(uintptr_t va)
 {
-  pte* pte = __walk(root_page_table, va);
+  int level;
+  pte* pte = __walk_leaf(root_page_table, va, &level);
 
   if(pte && (*pte & PTE_V))
-    return (pte_ppn(*pte) << RISCV_PAGE_BITS) | (RISCV_PAGE_OFFSET(va));
+    return (pte_ppn(*pte) << RISCV_PAGE_BITS) |
+           (va & MASK(RISCV_GET_LVL_PGSIZE_BITS(level)));
   else
     return 0;
 }
 
-/* try to retrieve PTE for a VA, return 0 if fail */
+/* try to retrieve PTE for a VA, return 0 if fail
+ * a megapage is split, so this is always the PTE of one page; that never
+ * allocates, so the pager may call this while evicting */
 pte*
 pte_of_va(uintptr_t va)
 {
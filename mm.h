@@ -5,17 +5,41 @@
 
 #include "vm_defs.h"
 
+/* user megapages are leaves one level above the last */
+#define MEGAPAGE_LEVEL (RISCV_PT_LEVELS - 1)
+#define MEGAPAGE_ORDER (RISCV_GET_LVL_PGSIZE_BITS(MEGAPAGE_LEVEL) - RISCV_PAGE_BITS)
+#define MEGAPAGE_PAGES BIT(MEGAPAGE_ORDER)
+
+/* pages backed after a demand-zero fault, or swapped in after a fault,
+ * in a sequentially read mapping */
+#define FAULT_AROUND_PAGES 16
+/* most pages swapped in by one prefetch_pages() */
+#define PREFETCH_MAX_PAGES 32
+
 uintptr_t translate(uintptr_t va);
 pte* pte_of_va(uintptr_t va);
 #ifdef USE_FREEMEM
 uintptr_t alloc_page(uintptr_t vpn, int flags);
 void free_page(uintptr_t vpn);
 size_t alloc_pages(uintptr_t vpn, size_t count, int flags);
+int reserve_page(uintptr_t vpn, int flags);
+size_t reserve_pages(uintptr_t vpn, size_t count, int flags);
+uintptr_t populate_page(uintptr_t va);
+uintptr_t populate_fault(uintptr_t va);
 void free_pages(uintptr_t vpn, size_t count);
+void move_pages(uintptr_t old_vpn, uintptr_t new_vpn, size_t count);
+void protect_pages(uintptr_t vpn, size_t count, int flags);
+void release_pages(uintptr_t vpn, size_t count);
+#ifdef USE_PAGING
+size_t prefetch_pages(uintptr_t vpn, size_t count);
+#endif
 size_t test_va_range(uintptr_t vpn, size_t count);
 
 uintptr_t get_program_break();
 void set_program_break(uintptr_t new_break);
+void init_program_break(uintptr_t start);
+uintptr_t get_program_break_start();
+size_t get_reserved_pages();
 
 void map_with_reserved_page_table(uintptr_t base, uintptr_t size, uintptr_t ptr, pte* l2_pt, pte* l3_pt);
 #endif /* USE_FREEMEM */
@@ -6,8 +6,10 @@
 #include <stddef.h>
 
 #include "aes.h"
+#include "merk_integrity.h"
 #include "merkle.h"
 #include "bpt_merkle.h"
+#include "smt_merkle.h"
 #include "paging.h"
 #include "sbi.h"
 #include "sha256.h"
@@ -20,8 +22,41 @@ static uintptr_t ctr_indirect_ptrs[NUM_CTR_INDIRECTS];
 static uintptr_t paging_next_backing_page_offset;
 static uintptr_t paging_inc_backing_page_offset_by;
 
+// Pages handed back by paging_free_backing_page, one bit per page of the
+// backing region, reused before the cursor moves on. The bits are kept in
+// enclave memory, taken at init, so that the host can't have a page handed
+// out twice.
+#define FREED_BITS_PER_PAGE (RISCV_PAGE_SIZE * 8)
+#define NUM_FREED_BITMAP_PAGES                                        \
+  ((NUM_CTR_INDIRECTS * (RISCV_PAGE_SIZE / 8) + FREED_BITS_PER_PAGE - 1) / \
+   FREED_BITS_PER_PAGE)
+static uint64_t* paging_freed_bitmap[NUM_FREED_BITMAP_PAGES];
+static size_t paging_freed_backing_count;
+// no page before this one is freed
+static size_t paging_freed_backing_hint;
+// pages the cursor has yet to hand out
+static size_t paging_fresh_backing_count;
+
+static uint64_t*
+paging_freed_word(size_t idx) {
+  return &paging_freed_bitmap[idx / FREED_BITS_PER_PAGE]
+                             [(idx % FREED_BITS_PER_PAGE) / 64];
+}
+
 uintptr_t
 paging_alloc_backing_page() {
+  if (paging_freed_backing_count) {
+    size_t idx = paging_freed_backing_hint & ~(size_t)63;
+    uint64_t* word;
+    while (!*(word = paging_freed_word(idx))) idx += 64;
+
+    idx += __builtin_ctzll(*word);
+    *word &= *word - 1;
+    paging_freed_backing_count--;
+    paging_freed_backing_hint = idx;
+    return paging_backing_region() + (idx << RISCV_PAGE_BITS);
+  }
+
   uintptr_t offs_update =
       (paging_next_backing_page_offset + paging_inc_backing_page_offset_by) %
       paging_backing_region_size();
@@ -38,13 +73,28 @@ paging_alloc_backing_page() {
   assert(IS_ALIGNED(next_page, RISCV_PAGE_BITS));
 
   paging_next_backing_page_offset = offs_update;
+  paging_fresh_backing_count--;
   return next_page;
 }
 
+void
+paging_free_backing_page(uintptr_t page) {
+  assert(paging_backpage_inbounds(page));
+  assert(IS_ALIGNED(page, RISCV_PAGE_BITS));
+
+  size_t idx     = (page - paging_backing_region()) >> RISCV_PAGE_BITS;
+  uint64_t* word = paging_freed_word(idx);
+  uint64_t bit   = 1ull << (idx % 64);
+
+  assert(!(*word & bit));
+  *word |= bit;
+  paging_freed_backing_count++;
+  if (idx < paging_freed_backing_hint) paging_freed_backing_hint = idx;
+}
+
 unsigned int
 paging_remaining_pages() {
-  return (paging_backing_region_size() - paging_next_backing_page_offset) /
-         RISCV_PAGE_SIZE;
+  return paging_fresh_backing_count + paging_freed_backing_count;
 }
 
 static uintptr_t
@@ -66,6 +116,22 @@ find_coprime_of(uintptr_t n) {
   return res;
 }
 
+// The Merkle trees only return a status; the failure is logged here, and
+// the enclave stops where the page is swapped
+static void
+pswap_integrity_violation(merk_status_t status, uintptr_t key) {
+  warn("merkle tree check failed with status %d at 0x%lx", status, key);
+}
+
+#ifdef USE_PAGE_HASH_SMT
+static smt_merkle_node_t paging_merk_root;
+
+static size_t
+pswap_slot(uintptr_t back_page) {
+  return (back_page - paging_backing_region()) >> RISCV_PAGE_BITS;
+}
+#endif
+
 void
 pswap_init(void) {
   uintptr_t backing_pages = paging_backing_region_size() / RISCV_PAGE_SIZE;
@@ -75,6 +141,25 @@ pswap_init(void) {
   warn("num_pages = %zx, pagesize_inc = %zx", backing_pages, inc);
 
   paging_next_backing_page_offset = 0;
+  // the cursor stops short of the page it would wrap around to
+  paging_fresh_backing_count = backing_pages - 1;
+
+  assert(backing_pages <= NUM_FREED_BITMAP_PAGES * FREED_BITS_PER_PAGE);
+  for (size_t i = 0; i * FREED_BITS_PER_PAGE < backing_pages; i++) {
+    if (!paging_freed_bitmap[i]) {
+      paging_freed_bitmap[i] = (uint64_t*)spa_get_zero();
+      assert(paging_freed_bitmap[i]);
+    } else {
+      memset(paging_freed_bitmap[i], 0, RISCV_PAGE_SIZE);
+    }
+  }
+  paging_freed_backing_count = 0;
+  paging_freed_backing_hint  = 0;
+
+  merk_set_violation_hook(pswap_integrity_violation);
+#ifdef USE_PAGE_HASH_SMT
+  smt_merk_init(&paging_merk_root, backing_pages);
+#endif
 }
 
 static uint64_t*
@@ -136,7 +221,7 @@ static bpt_merkle_node_t paging_merk_root = {
 };
 #endif
 
-#ifndef USE_PAGE_HASH_BPT
+#ifndef USE_HPME
 static void
 pswap_encrypt(const void* addr, void* dst, uint64_t pageout_ctr) {
   size_t len = RISCV_PAGE_SIZE;
@@ -175,7 +260,8 @@ pswap_decrypt(const void* addr, void* dst, uint64_t pageout_ctr) {
 
 static void
 pswap_hash(uint8_t* hash, void* page_addr, uint64_t pageout_ctr) {
-#ifdef USE_PAGE_HASH
+#if defined(USE_PAGE_HASH) || defined(USE_PAGE_HASH_BPT) || \
+    defined(USE_PAGE_HASH_SMT)
   SHA256_CTX hasher;
 
   sha256_init(&hasher);
@@ -184,7 +270,7 @@ pswap_hash(uint8_t* hash, void* page_addr, uint64_t pageout_ctr) {
   sha256_final(&hasher, hash);
 #endif
 }
-#endif // ndef USE_PAGE_HASH_BPT
+#endif // ndef USE_HPME
 
 /* evict a page from EPM and store it to the backing storage
  * back_page (PA1) <-- epm_page (PA2) <-- swap_page (PA1)
@@ -204,6 +290,11 @@ page_swap_epm(uintptr_t back_page, uintptr_t epm_page, uintptr_t swap_page) {
 
   uint8_t new_hash[32] = {0};
   #ifndef USE_HPME
+  // swap_page may be back_page itself, so keep what it holds now
+  static char buffer[RISCV_PAGE_SIZE];
+  if (swap_page) {
+    memcpy(buffer, (void*)swap_page, RISCV_PAGE_SIZE);
+  }
   pswap_hash(new_hash, (void*)epm_page, new_pageout_ctr);
   pswap_encrypt((void*)epm_page, (void*)back_page, new_pageout_ctr);
   #else
@@ -216,6 +307,7 @@ page_swap_epm(uintptr_t back_page, uintptr_t epm_page, uintptr_t swap_page) {
   }
   debug("[runtime] epm_page data:0x%lx, back_page data: 0x%lx\n", *((uint64_t*)epm_page), *((uint64_t*)back_page));
   debug("[runtime] sbi_hpme_enc done, new_hash=0x%lx_%lx\n", *((uint64_t*)new_hash+1), *((uint64_t*)new_hash));
+  #endif
 
   if (swap_page) {
     uint8_t old_hash[32] = {0};
@@ -224,28 +316,40 @@ page_swap_epm(uintptr_t back_page, uintptr_t epm_page, uintptr_t swap_page) {
     pswap_hash(old_hash, (void*)epm_page, old_pageout_ctr);
     #else
     sbi_hpme_dec(__pa(epm_page), old_pageout_ctr, kernel_va_to_pa(old_hash));
-    #endif
     debug("[runtime] sbi_hpme_dec done\n");
-
-  #endif
+    #endif
 
 #ifdef USE_PAGE_HASH
     bool ok = merk_verify(&paging_merk_root, back_page, old_hash);
-    assert(ok);
+    if (!ok) sbi_exit_enclave(-1);
     debug("[runtime] merk_verify passed\n");
 #elif defined USE_PAGE_HASH_BPT
     // bpt_merk_travel(&paging_merk_root);
     bool ok = bpt_merk_verify(&paging_merk_root, back_page, old_hash);
-    assert(ok);
+    if (!ok) sbi_exit_enclave(-1);
     debug("[runtime] bpt_merk_verify passed\n");
+#elif defined USE_PAGE_HASH_SMT
+    bool ok =
+        smt_merk_verify(&paging_merk_root, pswap_slot(back_page), old_hash);
+    if (!ok) sbi_exit_enclave(-1);
+    debug("[runtime] smt_merk_verify passed\n");
 #endif
   }
 
-#ifdef USE_PAGE_HASH
-  merk_insert(&paging_merk_root, back_page, new_hash);
+#if defined(USE_PAGE_HASH) && defined(USE_PAGE_HASH_LAZY)
+  // hash the upper levels once per burst of evictions
+  int res = merk_insert_deferred(&paging_merk_root, back_page, new_hash);
+  if (res) sbi_exit_enclave(-1);
+#elif defined USE_PAGE_HASH
+  int res = merk_insert(&paging_merk_root, back_page, new_hash);
+  if (res) sbi_exit_enclave(-1);
 #elif defined USE_PAGE_HASH_BPT
-  bpt_merk_insert(&paging_merk_root, back_page, new_hash);
+  int res = bpt_merk_insert(&paging_merk_root, back_page, new_hash);
+  if (res) sbi_exit_enclave(-1);
   // bpt_merk_travel(&paging_merk_root);
+#elif defined USE_PAGE_HASH_SMT
+  int res = smt_merk_insert(&paging_merk_root, pswap_slot(back_page), new_hash);
+  if (res) sbi_exit_enclave(-1);
 #endif
 
 
@@ -8,6 +8,7 @@
 
 #include "page_swap.h"
 #include "vm.h"
+#include "vma.h"
 
 uintptr_t paging_pa_start;
 
@@ -21,6 +22,17 @@ static uintptr_t paging_backing_storage_size;
 
 static uintptr_t paging_user_page_count = 0;
 
+/* ranges of user pages that are not needed soon (madvise), evicted
+ * before any other page; the oldest hint makes room for a new one */
+#define PAGING_COLD_RANGES 16
+
+static struct paging_cold_range
+{
+  uintptr_t vpn;
+  size_t count;
+} paging_cold[PAGING_COLD_RANGES];
+static unsigned int paging_cold_head, paging_cold_count;
+
 extern uintptr_t rt_trap_table;
 
 void paging_inc_user_page(void)
@@ -105,15 +117,22 @@ __traverse_page_table_and_pick_internal(
 
     /* if this is a leaf */
     if(level == 1 ||
-        (entry & PTE_R) || (entry & PTE_W) || (entry & PTE_X))
+        (entry & PTE_R) || (entry & PTE_W) || (entry & PTE_X) ||
+        (entry & PTE_DZ) || (entry & PTE_PROTNONE))
     {
       if ((entry & PTE_U) && (entry & PTE_V))
       {
-        *count = *count - 1;
+        /* a megapage counts as, and is picked from, all its pages */
+        uintptr_t pages = BIT((level - 1) * RISCV_PT_INDEX_BITS);
+
+        if (*count <= pages) {
+          virt_addr = (virt_addr << ((level - 1) * RISCV_PT_INDEX_BITS)) +
+                      ((*count - 1) << RISCV_PAGE_BITS);
+          *count = 0;
+          return virt_addr;
+        }
+        *count = *count - pages;
       }
-
-      if (*count == 0)
-        return virt_addr;
     }
     else
     {
@@ -154,8 +173,42 @@ __traverse_page_table_and_pick(uintptr_t count)
   return ret;
 }
 
+void paging_mark_cold(uintptr_t vpn, size_t count)
+{
+  unsigned int slot;
+
+  if (paging_cold_count == PAGING_COLD_RANGES) {
+    paging_cold_head = (paging_cold_head + 1) % PAGING_COLD_RANGES;
+    paging_cold_count--;
+  }
+  slot = (paging_cold_head + paging_cold_count) % PAGING_COLD_RANGES;
+  paging_cold[slot].vpn = vpn;
+  paging_cold[slot].count = count;
+  paging_cold_count++;
+}
+
+/* the next page of the cold ranges that is still resident, or 0; each
+ * page is looked at once */
+static uintptr_t __pick_cold_page()
+{
+  while (paging_cold_count) {
+    struct paging_cold_range* range = &paging_cold[paging_cold_head];
+
+    while (range->count) {
+      uintptr_t va = range->vpn << RISCV_PAGE_BITS;
+      range->vpn++;
+      range->count--;
+      if (translate(va))
+        return va;
+    }
+    paging_cold_head = (paging_cold_head + 1) % PAGING_COLD_RANGES;
+    paging_cold_count--;
+  }
+  return 0;
+}
+
 /* pick a virtual page to evict
- * at this moment, we randomly choose a user page
+ * the cold pages go first; otherwise, we randomly choose a user page
  * return: va of a page mapped to user
  *         0 if failed */
 uintptr_t __pick_page()
@@ -165,6 +218,10 @@ uintptr_t __pick_page()
   uintptr_t rnd;
   uintptr_t count;
 
+  target = __pick_cold_page();
+  if (target)
+    return target;
+
   assert(paging_user_page_count > 0);
   rnd = sbi_random();
   count = (rnd % paging_user_page_count) + 1;
@@ -218,12 +275,33 @@ uintptr_t paging_evict_and_free_one(uintptr_t swap_va)
   return src_pa;
 }
 
+int paging_swap_in(pte* entry)
+{
+  uintptr_t back_ptr = __paging_va(pte_ppn(*entry) << RISCV_PAGE_BITS);
+  uintptr_t frame;
+
+  assert(back_ptr >= paging_backing_storage_addr);
+  assert(back_ptr < paging_backing_storage_addr + paging_backing_storage_size);
+
+  /* evict & swap */
+  frame = paging_evict_and_free_one(back_ptr);
+  if (!frame)
+    return 0;
+
+  assert(*entry & PTE_U);
+  /* validate the entry */
+  *entry = pte_create(ppn(frame), *entry & PTE_FLAG_MASK);
+  paging_inc_user_page();
+  return 1;
+}
+
 void paging_handle_page_fault(struct encl_ctx* ctx)
 {
   uintptr_t addr;
   uintptr_t back_ptr;
-  uintptr_t frame;
   pte* entry;
+  struct vma* vma;
+  size_t ahead;
 
   addr = ctx->sbadaddr;
 
@@ -233,6 +311,10 @@ void paging_handle_page_fault(struct encl_ctx* ctx)
     goto exit;
   }
 
+  /* first touch of a demand-zero page */
+  if (populate_fault(addr))
+    return;
+
   entry = pte_of_va(addr);
 
   /* VA is never mapped, exit */
@@ -247,6 +329,17 @@ void paging_handle_page_fault(struct encl_ctx* ctx)
     goto exit;
   }
 
+  if (*entry & PTE_DZ){
+    printf("no frame for demand-zero page\n");
+    goto exit;
+  }
+
+  /* PROT_NONE, resident or not */
+  if ((*entry & PTE_PROTNONE) || !(*entry & (PTE_R | PTE_W | PTE_X))){
+    printf("PTE has no permissions\n");
+    goto exit;
+  }
+
   /* where is the page? */
   back_ptr = __paging_va(pte_ppn(*entry) << RISCV_PAGE_BITS);
   if (!back_ptr){
@@ -256,20 +349,19 @@ void paging_handle_page_fault(struct encl_ctx* ctx)
 
   // debug("back_ptr=0x%lx, addr=0x%lx, paging_backing_storage_addr=0x%lx, paging_backing_storage_size=0x%lx, sepc=0x%lx\n", back_ptr, addr,
   //   paging_backing_storage_addr, paging_backing_storage_size, ctx->regs.sepc);
-  assert(back_ptr >= paging_backing_storage_addr);
-  assert(back_ptr < paging_backing_storage_addr + paging_backing_storage_size);
 
-  /* evict & swap */
-  frame = paging_evict_and_free_one(back_ptr);
-  if (!frame){
+  if (!paging_swap_in(entry)){
     printf("frame is NULL\n");
     goto exit;
   }
 
-  assert(*entry & PTE_U);
-  /* validate the entry */
-  *entry = pte_create(ppn(frame), *entry & PTE_FLAG_MASK);
-  paging_inc_user_page();
+  /* a sequential reader will want the next pages too */
+  vma = vma_find(addr);
+  if (vma && (vma->flags & VMA_SEQUENTIAL)) {
+    ahead = vpn(vma->end - 1) - vpn(addr);
+    prefetch_pages(vpn(addr) + 1,
+                   ahead < FAULT_AROUND_PAGES ? ahead : FAULT_AROUND_PAGES);
+  }
 
   return;
 exit:
@@ -18,6 +18,11 @@ unsigned int paging_remaining_pages(void);
 void init_paging(uintptr_t user_pa_start, uintptr_t user_pa_end);
 void paging_handle_page_fault(struct encl_ctx* ctx);
 uintptr_t paging_evict_and_free_one(uintptr_t swap_va);
+/* bring a swapped out page back into its PTE
+ * returns 0 if fails */
+int paging_swap_in(pte* entry);
+/* evict these pages before any others */
+void paging_mark_cold(uintptr_t vpn, size_t count);
 
 extern uintptr_t paging_pa_start;
 extern pte paging_l2_page_table[BIT(RISCV_PT_INDEX_BITS)]
@@ -40,6 +45,9 @@ static inline uintptr_t __paging_va(uintptr_t pa)
 
 uintptr_t
 paging_alloc_backing_page(void);
+/* Return a page from paging_alloc_backing_page that is no longer used */
+void
+paging_free_backing_page(uintptr_t page);
 
 uintptr_t
 paging_backing_region(void);
@@ -54,6 +54,12 @@ void not_implemented_fatal(struct encl_ctx* ctx){
 
 void rt_page_fault(struct encl_ctx* ctx)
 {
+#ifdef USE_FREEMEM
+  /* first touch of a demand-zero page */
+  if (populate_fault(ctx->sbadaddr))
+    return;
+#endif
+
 #ifdef FATAL_DEBUG
   unsigned long addr, cause, pc;
   pc = ctx->regs.sepc;
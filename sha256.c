@@ -1,4 +1,4 @@
-#if defined (USE_PAGE_HASH) || (defined (USE_PAGE_HASH_BPT) && !defined(USE_SHA3_ROCC))
+#if defined (USE_PAGE_HASH) || ((defined (USE_PAGE_HASH_BPT) || defined (USE_PAGE_HASH_SMT)) && !defined(USE_SHA3_ROCC))
 
 /*********************************************************************
 * Filename:   sha256.c
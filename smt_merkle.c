@@ -0,0 +1,326 @@
+#if defined(USE_PAGE_HASH_SMT)
+
+#include "smt_merkle.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "merk_integrity.h"
+#include "merk_pool.h"
+#include "paging.h"
+#include "vm_defs.h"
+
+#if defined(USE_SHA3_ROCC)
+#include "sha3.h"
+#include "encoding.h"
+#include "rocc.h"
+#else
+#include "sha256.h"
+#endif
+
+_Static_assert(
+    sizeof(smt_merkle_node_t) == 64, "smt_merkle_node_t is not 64 bytes!");
+
+static merk_pool_t smt_merk_pool = MERK_POOL_INIT(smt_merkle_node_t);
+
+static void
+smt_merk_hash_pair(
+    const uint8_t left[32], const uint8_t right[32], uint8_t out[32]) {
+#if defined(USE_SHA3_ROCC)
+  uint8_t data_to_be_hashed[64] __aligned(8);
+  uint8_t calculated_hash[32] __aligned(8);
+  int data_size = 64;
+
+  memcpy(data_to_be_hashed, left, 32);
+  memcpy(data_to_be_hashed + 32, right, 32);
+
+  asm volatile("fence");
+
+  ROCC_INSTRUCTION_SS(2, data_to_be_hashed, calculated_hash, 0);
+
+  ROCC_INSTRUCTION_S(2, data_size, 1);
+
+  asm volatile("fence" ::: "memory");
+
+  memcpy(out, calculated_hash, 32);
+#else
+  SHA256_CTX hasher;
+  sha256_init(&hasher);
+  sha256_update(&hasher, left, 32);
+  sha256_update(&hasher, right, 32);
+  sha256_final(&hasher, out);
+#endif
+}
+
+// smt_default_hash[h] is the hash of an empty subtree of height h. Leaves
+// are height 0, and an empty slot hashes to all zeros.
+static uint8_t smt_default_hash[SMT_MAX_DEPTH + 1][32];
+static bool smt_default_hash_ready = false;
+
+void
+smt_merk_init(smt_merkle_node_t* root, size_t slots) {
+  if (!smt_default_hash_ready) {
+    memset(smt_default_hash[0], 0, 32);
+    for (int h = 1; h <= SMT_MAX_DEPTH; h++) {
+      smt_merk_hash_pair(
+          smt_default_hash[h - 1], smt_default_hash[h - 1],
+          smt_default_hash[h]);
+    }
+    smt_default_hash_ready = true;
+  }
+
+  int depth = 1;
+  while (depth < SMT_MAX_DEPTH && ((size_t)1 << depth) < slots) depth++;
+  assert(((size_t)1 << depth) >= slots);
+
+  memset(root, 0, sizeof(*root));
+  root->depth = depth;
+  memcpy(root->hash, smt_default_hash[depth], 32);
+}
+
+// Load both children of node, which sits at height h and is trusted, and
+// check them against its hash. Absent children are empty subtrees.
+static bool
+smt_merk_load_children(
+    const smt_merkle_node_t* node, int h, smt_merkle_node_t children[2]) {
+  for (int s = 0; s < 2; s++) {
+    if (node->children[s]) {
+      children[s] = *(volatile smt_merkle_node_t*)node->children[s];
+    } else {
+      memset(&children[s], 0, sizeof(children[s]));
+      memcpy(children[s].hash, smt_default_hash[h - 1], 32);
+    }
+  }
+
+  // An empty subtree hashes to the default, and everything below it is
+  // default, so there is nothing to check. The pointers aren't covered by
+  // any hash, so they alone don't make a subtree empty.
+  if (!node->children[0] && !node->children[1] &&
+      memcmp(node->hash, smt_default_hash[h], 32) == 0)
+    return true;
+
+  uint8_t calculated_hash[32] __aligned(8);
+  smt_merk_hash_pair(children[0].hash, children[1].hash, calculated_hash);
+  return memcmp(calculated_hash, node->hash, 32) == 0;
+}
+
+// The path of the last insert, from the leaf (height 0) up to the root:
+// trusted copies of the nodes, where they live, and their siblings' hashes
+static smt_merkle_node_t smt_path[SMT_MAX_DEPTH + 1];
+static smt_merkle_node_t* smt_path_ptrs[SMT_MAX_DEPTH + 1];
+static uint8_t smt_sibling_hash[SMT_MAX_DEPTH][32];
+
+int
+smt_merk_insert(smt_merkle_node_t* root, size_t slot, const uint8_t hash[32]) {
+  int depth = root->depth;
+  assert(depth > 0 && depth <= SMT_MAX_DEPTH);
+  assert(slot < ((size_t)1 << depth));
+
+  smt_path[depth]      = *(volatile smt_merkle_node_t*)root;
+  smt_path_ptrs[depth] = root;
+
+  // Walk down, checking every node on the path and keeping the sibling
+  // hashes we just checked
+  for (int h = depth; h > 0; h--) {
+    smt_merkle_node_t children[2];
+    int side = (slot >> (h - 1)) & 1;
+
+    if (!smt_merk_load_children(&smt_path[h], h, children)) {
+      merk_report(MERK_TAMPERED, slot);
+      return -1;
+    }
+    memcpy(smt_sibling_hash[h - 1], children[!side].hash, 32);
+    smt_path[h - 1]      = children[side];
+    smt_path_ptrs[h - 1] = smt_path[h].children[side];
+  }
+
+  // Materialize the nodes of empty subtrees on the path, each next to its
+  // parent where there is room. Below the first absent node all are absent.
+  int first_new = depth;
+  for (int h = depth - 1; h >= 0; h--) {
+    if (smt_path_ptrs[h]) continue;
+    if (first_new == depth) first_new = h;
+
+    const smt_merkle_node_t* hint =
+        h + 1 < depth ? smt_path_ptrs[h + 1] : NULL;
+    smt_path_ptrs[h] =
+        (smt_merkle_node_t*)merk_pool_alloc_near(&smt_merk_pool, hint);
+    if (!smt_path_ptrs[h]) {
+      merk_report(MERK_NO_MEMORY, slot);
+      // Nothing points at the new nodes yet
+      for (int k = h + 1; k <= first_new; k++) {
+        merk_pool_free(&smt_merk_pool, smt_path_ptrs[k]);
+      }
+      return -1;
+    }
+    smt_path[h + 1].children[(slot >> h) & 1] = smt_path_ptrs[h];
+  }
+
+  // Walk back up, rehashing from the leaf
+  memcpy(smt_path[0].hash, hash, 32);
+  for (int h = 0; h < depth; h++) {
+    int side = (slot >> h) & 1;
+
+    *(volatile smt_merkle_node_t*)smt_path_ptrs[h] = smt_path[h];
+
+    if (side) {
+      smt_merk_hash_pair(
+          smt_sibling_hash[h], smt_path[h].hash, smt_path[h + 1].hash);
+    } else {
+      smt_merk_hash_pair(
+          smt_path[h].hash, smt_sibling_hash[h], smt_path[h + 1].hash);
+    }
+  }
+
+  *(volatile smt_merkle_node_t*)root = smt_path[depth];
+  return 0;
+}
+
+bool
+smt_merk_verify(smt_merkle_node_t* root, size_t slot, const uint8_t hash[32]) {
+  int depth = root->depth;
+  assert(depth > 0 && depth <= SMT_MAX_DEPTH);
+  assert(slot < ((size_t)1 << depth));
+
+  smt_merkle_node_t node = *(volatile smt_merkle_node_t*)root;
+  for (int h = depth; h > 0; h--) {
+    smt_merkle_node_t children[2];
+    int side = (slot >> (h - 1)) & 1;
+
+    if (!smt_merk_load_children(&node, h, children)) {
+      merk_report(MERK_TAMPERED, slot);
+      return false;
+    }
+    if (!node.children[side]) {
+      merk_report(MERK_NOT_FOUND, slot);
+      return false;
+    }
+    node = children[side];
+  }
+
+  if (memcmp(hash, node.hash, 32) != 0) {
+    merk_report(MERK_HASH_MISMATCH, slot);
+    return false;
+  }
+  return true;
+}
+
+// Slots [first, last] of a range operation, with hashes[i] for first + i
+typedef struct smt_merk_range {
+  size_t first, last;
+  const uint8_t (*hashes)[32];
+} smt_merk_range_t;
+
+// Whether the subtree of height h that starts at slot base meets the range
+static inline bool
+smt_merk_range_meets(const smt_merk_range_t* range, int h, size_t base) {
+  return base <= range->last && base + ((size_t)1 << h) - 1 >= range->first;
+}
+
+// Check the leaves of the range under node, a trusted copy of height h
+// starting at slot base
+static bool
+smt_merk_verify_range_node(
+    const smt_merkle_node_t* node, int h, size_t base,
+    const smt_merk_range_t* range) {
+  if (h == 0) {
+    if (memcmp(node->hash, range->hashes[base - range->first], 32) != 0) {
+      merk_report(MERK_HASH_MISMATCH, base);
+      return false;
+    }
+    return true;
+  }
+
+  smt_merkle_node_t children[2];
+  if (!smt_merk_load_children(node, h, children)) {
+    merk_report(MERK_TAMPERED, base);
+    return false;
+  }
+  for (int side = 0; side < 2; side++) {
+    size_t child_base = base + ((size_t)side << (h - 1));
+    if (!smt_merk_range_meets(range, h - 1, child_base)) continue;
+    if (!node->children[side]) {
+      merk_report(MERK_NOT_FOUND, child_base);
+      return false;
+    }
+    if (!smt_merk_verify_range_node(&children[side], h - 1, child_base, range)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Set the leaves of the range under node, a trusted copy of height h
+// starting at slot base, and rehash node. Children are written back here;
+// node is written by the caller. hint is where node lives, or NULL for the
+// root.
+static int
+smt_merk_update_range_node(
+    smt_merkle_node_t* node, const smt_merkle_node_t* hint, int h,
+    size_t base, const smt_merk_range_t* range) {
+  if (h == 0) {
+    memcpy(node->hash, range->hashes[base - range->first], 32);
+    return 0;
+  }
+
+  smt_merkle_node_t children[2];
+  if (!smt_merk_load_children(node, h, children)) {
+    merk_report(MERK_TAMPERED, base);
+    return -1;
+  }
+  for (int side = 0; side < 2; side++) {
+    size_t child_base = base + ((size_t)side << (h - 1));
+    if (!smt_merk_range_meets(range, h - 1, child_base)) continue;
+
+    if (!node->children[side]) {
+      node->children[side] =
+          (smt_merkle_node_t*)merk_pool_alloc_near(&smt_merk_pool, hint);
+      if (!node->children[side]) {
+        merk_report(MERK_NO_MEMORY, child_base);
+        return -1;
+      }
+    }
+    if (smt_merk_update_range_node(
+            &children[side], node->children[side], h - 1, child_base,
+            range)) {
+      return -1;
+    }
+    *(volatile smt_merkle_node_t*)node->children[side] = children[side];
+  }
+
+  smt_merk_hash_pair(children[0].hash, children[1].hash, node->hash);
+  return 0;
+}
+
+bool
+smt_merk_verify_range(
+    smt_merkle_node_t* root, size_t first_slot, size_t n,
+    const uint8_t (*hashes)[32]) {
+  int depth = root->depth;
+  assert(depth > 0 && depth <= SMT_MAX_DEPTH);
+  if (!n) return true;
+  assert(first_slot + n - 1 < ((size_t)1 << depth));
+
+  smt_merk_range_t range = {first_slot, first_slot + n - 1, hashes};
+  smt_merkle_node_t node = *(volatile smt_merkle_node_t*)root;
+  return smt_merk_verify_range_node(&node, depth, 0, &range);
+}
+
+int
+smt_merk_update_range(
+    smt_merkle_node_t* root, size_t first_slot, size_t n,
+    const uint8_t (*hashes)[32]) {
+  int depth = root->depth;
+  assert(depth > 0 && depth <= SMT_MAX_DEPTH);
+  if (!n) return 0;
+  assert(first_slot + n - 1 < ((size_t)1 << depth));
+
+  smt_merk_range_t range = {first_slot, first_slot + n - 1, hashes};
+  smt_merkle_node_t node = *(volatile smt_merkle_node_t*)root;
+  if (smt_merk_update_range_node(&node, NULL, depth, 0, &range)) return -1;
+  *(volatile smt_merkle_node_t*)root = node;
+  return 0;
+}
+
+#endif
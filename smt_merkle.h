@@ -0,0 +1,51 @@
+#pragma once
+
+#if defined(USE_FREEMEM) && defined(USE_PAGING)
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Sparse Merkle tree over the backing page slots: a full binary tree of
+ * fixed depth whose leaves are the page hashes, indexed by slot. Subtrees
+ * that hold no page are not stored; their hash is the precomputed default
+ * for their height. An insert or verify always hashes one fixed-length path,
+ * with no splits or rebalancing. Failures are passed to merk_report
+ * (merk_integrity.h) before an operation returns. */
+#define SMT_MAX_DEPTH 32
+
+typedef union smt_merkle_node smt_merkle_node_t;
+
+union smt_merkle_node {
+  struct {
+    uint8_t hash[32];
+    smt_merkle_node_t* children[2];
+    // root only: number of levels below the root
+    uint8_t depth;
+  };
+  struct {
+    uint64_t raw_words[8];
+  };
+};
+
+/* Set up root, in enclave memory, as an empty tree over slots slots */
+void
+smt_merk_init(smt_merkle_node_t* root, size_t slots);
+int
+smt_merk_insert(smt_merkle_node_t* root, size_t slot, const uint8_t hash[32]);
+bool
+smt_merk_verify(smt_merkle_node_t* root, size_t slot, const uint8_t hash[32]);
+
+/* Range operations on slots first_slot .. first_slot + n - 1, with hashes[i]
+ * for the i-th. Each node above the range is loaded and checked once, and
+ * each node in it is rehashed once. */
+bool
+smt_merk_verify_range(
+    smt_merkle_node_t* root, size_t first_slot, size_t n,
+    const uint8_t (*hashes)[32]);
+int
+smt_merk_update_range(
+    smt_merkle_node_t* root, size_t first_slot, size_t n,
+    const uint8_t (*hashes)[32]);
+
+#endif
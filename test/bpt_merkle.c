@@ -0,0 +1,515 @@
+#define _GNU_SOURCE
+
+#include "../bpt_merkle.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "../bpt_merkle.c"
+#include "mock.h"
+
+void
+sbi_exit_enclave(uintptr_t code) {
+  exit(code);
+}
+
+// Backing pages left to hand out before failing, to run out of memory on
+// purpose
+static size_t backing_pages_left = SIZE_MAX;
+
+uintptr_t
+paging_alloc_backing_page() {
+  if (!backing_pages_left) return 0;
+  if (backing_pages_left != SIZE_MAX) backing_pages_left--;
+
+  void* out = mmap(
+      NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert_int_not_equal(out, MAP_FAILED);
+  return (uintptr_t)out;
+}
+
+void
+paging_free_backing_page(uintptr_t page) {
+  assert_int_equal(munmap((void*)page, 4096), 0);
+  if (backing_pages_left != SIZE_MAX) backing_pages_left++;
+}
+
+// The last failure passed to the violation hook
+static merk_status_t reported_status;
+static uintptr_t reported_key;
+
+static void
+record_violation(merk_status_t status, uintptr_t key) {
+  reported_status = status;
+  reported_key    = key;
+}
+
+#define NUM_KEYS 2000
+#define KEY(i) (((uintptr_t)(i) + 1) * RISCV_PAGE_SIZE)
+
+static void
+key_hash(uintptr_t key, uint8_t gen, uint8_t hash[32]) {
+  SHA256_CTX sha;
+  sha256_init(&sha);
+  sha256_update(&sha, (const uint8_t*)&key, sizeof(key));
+  sha256_update(&sha, &gen, 1);
+  sha256_final(&sha, hash);
+}
+
+size_t*
+shuffled_idxs(size_t max) {
+  size_t* shuffled_idxs = (size_t*)malloc(sizeof(size_t) * max);
+  for (size_t i = 0; i < max; i++) shuffled_idxs[i] = i;
+
+  for (size_t i = max - 1; i > 0; i--) {
+    size_t j         = rand() % (i + 1);
+    size_t tmp       = shuffled_idxs[i];
+    shuffled_idxs[i] = shuffled_idxs[j];
+    shuffled_idxs[j] = tmp;
+  }
+  return shuffled_idxs;
+}
+
+static void
+shuffled_insert(bpt_merkle_node_t* root, size_t num_keys, uint8_t gen) {
+  size_t* idxs = shuffled_idxs(num_keys);
+  uint8_t hash[32];
+
+  for (size_t i = 0; i < num_keys; i++) {
+    key_hash(KEY(idxs[i]), gen, hash);
+    bpt_merk_insert(root, KEY(idxs[i]), hash);
+  }
+  free(idxs);
+}
+
+static size_t
+count_verify_fails(bpt_merkle_node_t* root, size_t num_keys, uint8_t gen) {
+  size_t fails = 0;
+  uint8_t hash[32];
+
+  for (size_t i = 0; i < num_keys; i++) {
+    key_hash(KEY(i), gen, hash);
+    fails += !bpt_merk_verify(root, KEY(i), hash);
+  }
+  return fails;
+}
+
+static bpt_merkle_node_t*
+find_leaf(bpt_merkle_node_t* root, uintptr_t key) {
+  bpt_merkle_node_t* node = root;
+  while (!node->is_leaf) {
+    int idx = bpt_merk_pivot_rank(node, key);
+    node    = node->children[idx - (idx != 0)];
+  }
+  return node;
+}
+
+static size_t
+tree_depth(bpt_merkle_node_t* root) {
+  size_t depth = 1;
+  for (; !root->is_leaf; root = root->children[0]) depth++;
+  return depth;
+}
+
+static void
+test_verify_nonexistant() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  uint8_t zeros[32]      = {};
+  reported_status = MERK_OK;
+  assert_false(bpt_merk_verify(&root, KEY(0), zeros));
+  assert_int_equal(reported_status, MERK_NOT_FOUND);
+}
+
+static void
+test_insert_and_verify_1() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  uint8_t hash[32];
+
+  key_hash(KEY(0), 0, hash);
+  bpt_merk_insert(&root, KEY(0), hash);
+  assert_true(bpt_merk_verify(&root, KEY(0), hash));
+}
+
+static void
+test_insert_and_verify_2() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  uint8_t hash_1[32], hash_2[32];
+
+  key_hash(KEY(1), 0, hash_1);
+  key_hash(KEY(0), 0, hash_2);
+  bpt_merk_insert(&root, KEY(1), hash_1);
+  bpt_merk_insert(&root, KEY(0), hash_2);
+  assert_true(bpt_merk_verify(&root, KEY(1), hash_1));
+  assert_true(bpt_merk_verify(&root, KEY(0), hash_2));
+}
+
+static void
+test_insert_and_verify_many() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  shuffled_insert(&root, NUM_KEYS, 0);
+  assert_int_equal(count_verify_fails(&root, NUM_KEYS, 0), 0);
+
+  // Overwriting every key keeps the shape and replaces every hash
+  size_t depth = tree_depth(&root);
+  shuffled_insert(&root, NUM_KEYS, 1);
+  assert_int_equal(tree_depth(&root), depth);
+  assert_int_equal(count_verify_fails(&root, NUM_KEYS, 1), 0);
+  assert_int_equal(count_verify_fails(&root, NUM_KEYS, 0), NUM_KEYS);
+}
+
+static void
+test_verify_out_of_range() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  uint8_t hash[32]       = {};
+  shuffled_insert(&root, NUM_KEYS, 0);
+
+  // Below the first pivot, between two keys, and past the last key
+  assert_false(bpt_merk_verify(&root, 0, hash));
+  assert_false(bpt_merk_verify(&root, KEY(7) + 1, hash));
+  assert_false(bpt_merk_verify(&root, KEY(NUM_KEYS), hash));
+}
+
+static void
+check_pivot_rank(bpt_merkle_node_t* node) {
+  for (int i = 0; i < node->valid_num; i++) {
+    uintptr_t probes[3] = {
+        node->addr_pivot[i] - 1, node->addr_pivot[i], node->addr_pivot[i] + 1};
+    for (int p = 0; p < 3; p++) {
+      int expected = 0;
+      while (expected < node->valid_num &&
+             node->addr_pivot[expected] <= probes[p]) {
+        expected++;
+      }
+      assert_int_equal(bpt_merk_pivot_rank(node, probes[p]), expected);
+    }
+  }
+  if (!node->is_leaf) {
+    for (int i = 0; i < node->valid_num; i++) {
+      check_pivot_rank(node->children[i]);
+    }
+  }
+}
+
+static void
+test_pivot_rank() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  shuffled_insert(&root, NUM_KEYS, 0);
+  check_pivot_rank(&root);
+}
+
+static void
+test_poison_data() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  shuffled_insert(&root, NUM_KEYS, 0);
+
+  uintptr_t key = KEY(rand() % NUM_KEYS);
+  uint8_t hash[32];
+  key_hash(key, 0, hash);
+
+  // Flip a random bit in the hash to simulate a tampered entry
+  hash[rand() & 31] ^= 1 << (rand() & 7);
+  reported_status = MERK_OK;
+  assert_false(bpt_merk_verify(&root, key, hash));
+  assert_int_equal(reported_status, MERK_HASH_MISMATCH);
+  assert_int_equal(reported_key, key);
+}
+
+static void
+test_poison_leaf() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  shuffled_insert(&root, NUM_KEYS, 0);
+
+  uintptr_t key           = KEY(rand() % NUM_KEYS);
+  bpt_merkle_node_t* leaf = find_leaf(&root, key);
+  int slot                = bpt_merk_pivot_rank(leaf, key) - 1;
+  assert_int_equal(leaf->addr_pivot[slot], key);
+
+  // Tamper with the stored hash and then present it as the expected one
+  leaf->data[slot][rand() & 31] ^= 1 << (rand() & 7);
+  assert_false(bpt_merk_verify(&root, key, leaf->data[slot]));
+}
+
+static void
+sorted_run(size_t num_keys, uintptr_t** keys, uint8_t (**hashes)[32]) {
+  *keys   = (uintptr_t*)malloc(sizeof(uintptr_t) * num_keys);
+  *hashes = (uint8_t(*)[32])malloc(32 * num_keys);
+  for (size_t i = 0; i < num_keys; i++) {
+    (*keys)[i] = KEY(i);
+    key_hash(KEY(i), 0, (*hashes)[i]);
+  }
+}
+
+static void
+check_fill(bpt_merkle_node_t* node, bool is_root) {
+  // Below the root, branches have two or more children and leaves are at
+  // least half full
+  if (!is_root) {
+    assert_true(node->valid_num >= 2);
+    assert_true(!node->is_leaf || node->valid_num * 2 >= BPT_DEGREE);
+  }
+  if (!node->is_leaf) {
+    assert_true(node->valid_num >= 2);
+    for (int i = 0; i < node->valid_num; i++) {
+      assert_int_equal(node->addr_pivot[i], node->children[i]->addr_pivot[0]);
+      check_fill(node->children[i], false);
+    }
+  }
+}
+
+static void
+test_bulk_build() {
+  size_t sizes[] = {1, BPT_DEGREE, BPT_DEGREE + 1, NUM_KEYS};
+  for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+    bpt_merkle_node_t root = {.is_leaf = true};
+    uintptr_t* keys;
+    uint8_t(*hashes)[32];
+    sorted_run(sizes[s], &keys, &hashes);
+
+    assert_true(bpt_merk_bulk_build(&root, keys, hashes, sizes[s]));
+    assert_int_equal(count_verify_fails(&root, sizes[s], 0), 0);
+
+    check_fill(&root, true);
+
+    // The tree keeps working with inserts after a bulk build
+    shuffled_insert(&root, sizes[s] + 64, 1);
+    assert_int_equal(count_verify_fails(&root, sizes[s] + 64, 1), 0);
+    check_pivot_rank(&root);
+
+    free(keys);
+    free(hashes);
+  }
+}
+
+static void
+test_bulk_build_rejects() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  uintptr_t* keys;
+  uint8_t(*hashes)[32];
+  sorted_run(16, &keys, &hashes);
+
+  keys[7] = keys[8];
+  assert_false(bpt_merk_bulk_build(&root, keys, hashes, 16));
+  assert_int_equal(root.valid_num, 0);
+
+  keys[7] = KEY(7);
+  bpt_merk_insert(&root, KEY(100), hashes[0]);
+  assert_false(bpt_merk_bulk_build(&root, keys, hashes, 16));
+
+  free(keys);
+  free(hashes);
+}
+
+static void
+test_insert_no_memory() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  uint8_t hash[32];
+  size_t n;
+  int res = 0;
+
+  // Insert in order until a split finds no memory
+  backing_pages_left = 0;
+  reported_status    = MERK_OK;
+  for (n = 0; n < 100 * NUM_KEYS; n++) {
+    key_hash(KEY(n), 0, hash);
+    res = bpt_merk_insert(&root, KEY(n), hash);
+    if (res) break;
+  }
+  backing_pages_left = SIZE_MAX;
+  assert_int_equal(res, -1);
+  assert_int_equal(reported_status, MERK_NO_MEMORY);
+
+  // The tree is as it was before the failed insert
+  assert_int_equal(count_verify_fails(&root, n, 0), 0);
+  assert_false(bpt_merk_verify(&root, KEY(n), hash));
+  check_pivot_rank(&root);
+
+  // and takes it once there is memory again
+  assert_int_equal(bpt_merk_insert(&root, KEY(n), hash), 0);
+  assert_int_equal(count_verify_fails(&root, n + 1, 0), 0);
+}
+
+static void
+test_bulk_build_no_memory() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  uintptr_t* keys;
+  uint8_t(*hashes)[32];
+  sorted_run(NUM_KEYS, &keys, &hashes);
+
+  backing_pages_left = 2;
+  reported_status    = MERK_OK;
+  assert_false(bpt_merk_bulk_build(&root, keys, hashes, NUM_KEYS));
+  assert_int_equal(reported_status, MERK_NO_MEMORY);
+  assert_true(root.is_leaf);
+  assert_int_equal(root.valid_num, 0);
+
+  // Nothing built before running out was kept: a two-leaf tree still fits
+  bool built = bpt_merk_bulk_build(&root, keys, hashes, BPT_DEGREE + 1);
+  backing_pages_left = SIZE_MAX;
+  assert_true(built);
+  assert_int_equal(count_verify_fails(&root, BPT_DEGREE + 1, 0), 0);
+
+  free(keys);
+  free(hashes);
+}
+
+// Hashes for the run KEY(first), KEY(first + 1), ...
+static uint8_t (*run_hashes(size_t first, size_t n, uint8_t gen))[32] {
+  uint8_t(*hashes)[32] = (uint8_t(*)[32])malloc(32 * n);
+  for (size_t i = 0; i < n; i++) key_hash(KEY(first + i), gen, hashes[i]);
+  return hashes;
+}
+
+static void
+test_verify_range() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  shuffled_insert(&root, NUM_KEYS, 0);
+  uint8_t(*hashes)[32] = run_hashes(0, NUM_KEYS + 1, 0);
+
+  // More than one chunk, runs from the middle, a single key
+  assert_true(bpt_merk_verify_range(&root, KEY(0), NUM_KEYS, hashes));
+  assert_true(bpt_merk_verify_range(&root, KEY(123), 300, hashes + 123));
+  assert_true(bpt_merk_verify_range(&root, KEY(7), 1, hashes + 7));
+
+  // A key past the end of the tree, and a wrong expected hash
+  assert_false(bpt_merk_verify_range(&root, KEY(1), NUM_KEYS, hashes + 1));
+  hashes[900][rand() & 31] ^= 1 << (rand() & 7);
+  assert_false(bpt_merk_verify_range(&root, KEY(0), NUM_KEYS, hashes));
+  free(hashes);
+}
+
+static void
+test_verify_range_poison() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  shuffled_insert(&root, NUM_KEYS, 0);
+  uint8_t(*hashes)[32] = run_hashes(0, NUM_KEYS, 0);
+
+  // Tamper with an entry in the run and present it as the expected hash
+  bpt_merkle_node_t* leaf = find_leaf(&root, KEY(500));
+  int slot                = bpt_merk_pivot_rank(leaf, KEY(500)) - 1;
+  leaf->data[slot][rand() & 31] ^= 1 << (rand() & 7);
+  memcpy(hashes[500], leaf->data[slot], 32);
+  assert_false(bpt_merk_verify_range(&root, KEY(400), 200, hashes + 400));
+  assert_false(bpt_merk_verify_range(&root, KEY(500), 1, hashes + 500));
+  free(hashes);
+}
+
+static void
+test_update_range_cycle() {
+  bpt_merkle_node_t root = {.is_leaf = true};
+  shuffled_insert(&root, NUM_KEYS, 0);
+  uint8_t(*hashes)[32] = run_hashes(500, 1, 1);
+  assert_false(root.is_leaf);
+
+  // Point the root's child on the path of the key back at the root: the
+  // walk stops at BPT_MAX_DEPTH instead of running off the stack
+  int slot                 = bpt_merk_pivot_rank(&root, KEY(500));
+  slot                     = slot - (slot != 0);
+  bpt_merkle_node_t* child = root.children[slot];
+  root.children[slot]      = &root;
+  uint8_t before[32];
+  memcpy(before, root.hash, 32);
+  reported_status = MERK_OK;
+  assert_false(bpt_merk_update_range(&root, KEY(500), 1, hashes));
+  assert_int_equal(reported_status, MERK_TOO_DEEP);
+  assert_memory_equal(before, root.hash, 32);
+
+  root.children[slot] = child;
+  assert_int_equal(count_verify_fails(&root, NUM_KEYS, 0), 0);
+  free(hashes);
+}
+
+static void
+test_update_range() {
+  // The first half is in the tree; the rest is inserted by the update
+  bpt_merkle_node_t root = {.is_leaf = true};
+  shuffled_insert(&root, NUM_KEYS / 2, 0);
+  uint8_t(*new_hashes)[32] = run_hashes(100, NUM_KEYS - 100, 1);
+
+  bpt_merk_update_range(&root, KEY(100), NUM_KEYS - 100, new_hashes);
+  assert_true(
+      bpt_merk_verify_range(&root, KEY(100), NUM_KEYS - 100, new_hashes));
+  assert_int_equal(count_verify_fails(&root, 100, 0), 0);
+  check_pivot_rank(&root);
+
+  // Updating in place leaves the rest of the tree as it was
+  uint8_t before[32];
+  memcpy(before, root.hash, 32);
+  bpt_merk_update_range(&root, KEY(100), NUM_KEYS - 100, new_hashes);
+  assert_memory_equal(before, root.hash, 32);
+  free(new_hashes);
+}
+
+static double
+elapsed_ns(struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+#define BENCH_LOOKUPS (1 << 16)
+
+// Not a pass/fail test: reports the cost of finding the leaf for a key and
+// of a full verify as the tree grows
+static void
+test_lookup_cost() {
+  size_t* probes = shuffled_idxs(BENCH_LOOKUPS);
+  uint8_t hash[32];
+
+  for (size_t num_keys = 1 << 8; num_keys <= 1 << 16; num_keys <<= 2) {
+    bpt_merkle_node_t root = {.is_leaf = true};
+    shuffled_insert(&root, num_keys, 0);
+
+    struct timespec start;
+    uintptr_t found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < BENCH_LOOKUPS; i++) {
+      uintptr_t key           = KEY(probes[i] % num_keys);
+      bpt_merkle_node_t* leaf = find_leaf(&root, key);
+      found += leaf->addr_pivot[bpt_merk_pivot_rank(leaf, key) - 1] == key;
+    }
+    double lookup_ns = elapsed_ns(&start) / BENCH_LOOKUPS;
+    assert_int_equal(found, BENCH_LOOKUPS);
+
+    size_t verifies = BENCH_LOOKUPS / 16;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < verifies; i++) {
+      uintptr_t key = KEY(probes[i] % num_keys);
+      key_hash(key, 0, hash);
+      assert_true(bpt_merk_verify(&root, key, hash));
+    }
+    double verify_ns = elapsed_ns(&start) / verifies;
+
+    printf(
+        "[BPT] degree %d, %zu keys, depth %zu: %.1f ns/lookup, "
+        "%.1f ns/verify\n",
+        BPT_DEGREE, num_keys, tree_depth(&root), lookup_ns, verify_ns);
+  }
+  free(probes);
+}
+
+int
+main() {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_verify_nonexistant),
+      cmocka_unit_test(test_insert_and_verify_1),
+      cmocka_unit_test(test_insert_and_verify_2),
+      cmocka_unit_test(test_insert_and_verify_many),
+      cmocka_unit_test(test_verify_out_of_range),
+      cmocka_unit_test(test_pivot_rank),
+      cmocka_unit_test(test_poison_data),
+      cmocka_unit_test(test_poison_leaf),
+      cmocka_unit_test(test_bulk_build),
+      cmocka_unit_test(test_bulk_build_rejects),
+      cmocka_unit_test(test_bulk_build_no_memory),
+      cmocka_unit_test(test_insert_no_memory),
+      cmocka_unit_test(test_verify_range),
+      cmocka_unit_test(test_verify_range_poison),
+      cmocka_unit_test(test_update_range_cycle),
+      cmocka_unit_test(test_update_range),
+      cmocka_unit_test(test_lookup_cost),
+  };
+  merk_set_violation_hook(record_violation);
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
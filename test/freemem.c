@@ -0,0 +1,513 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "../freemem.c"
+#include "mock.h"
+
+void
+sbi_exit_enclave(uintptr_t code) {
+  exit(code);
+}
+
+// Pages the fake pager may evict, last one first
+static uintptr_t* evictable;
+static size_t num_evictable;
+
+uintptr_t
+paging_evict_and_free_one(uintptr_t swap_va) {
+  (void)swap_va;
+  if (!num_evictable) return 0;
+  return __pa(evictable[--num_evictable]);
+}
+
+unsigned int
+paging_remaining_pages(void) {
+  return 0;
+}
+
+// Freemem is a fake region at EYRIE_LOAD_START, which is why this test is
+// built for rv32: its EYRIE_LOAD_START can be mapped on the host. PAs and
+// VAs are the same.
+#define REGION_SIZE (128 * 1024 * 1024)
+#define REGION_PAGES (REGION_SIZE / RISCV_PAGE_SIZE)
+// Start freemem off a 2 MB boundary to exercise the alignment
+#define FREEMEM_SKIP (3 * RISCV_PAGE_SIZE)
+
+static void
+init_region(size_t size) {
+  static void* region;
+  if (!region) {
+    region = mmap(
+        (void*)EYRIE_LOAD_START, REGION_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1,
+        0);
+    assert_int_equal(region, EYRIE_LOAD_START);
+  }
+  // Dirty the region so nothing passes for zeroed by accident
+  memset(region, 0xa5, REGION_SIZE);
+
+  load_pa_start    = EYRIE_LOAD_START;
+  freemem_va_start = EYRIE_LOAD_START + FREEMEM_SKIP;
+  freemem_size     = size - FREEMEM_SKIP;
+  num_evictable    = 0;
+  spa_init(freemem_va_start, freemem_size);
+}
+
+static size_t
+list_pages(void) {
+  size_t pages = 0;
+  for (unsigned int order = 0; order <= SPA_MAX_ORDER; order++) {
+    pages += (size_t)spa_free_lists[order].count << order;
+  }
+  return pages;
+}
+
+static void
+check_zero(uintptr_t page, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    assert_int_equal(((const uint8_t*)page)[i], 0);
+  }
+}
+
+size_t*
+shuffled_idxs(size_t max) {
+  size_t* shuffled_idxs = (size_t*)malloc(sizeof(size_t) * max);
+  for (size_t i = 0; i < max; i++) shuffled_idxs[i] = i;
+
+  for (size_t i = max - 1; i > 0; i--) {
+    size_t j         = rand() % (i + 1);
+    size_t tmp       = shuffled_idxs[i];
+    shuffled_idxs[i] = shuffled_idxs[j];
+    shuffled_idxs[j] = tmp;
+  }
+  return shuffled_idxs;
+}
+
+// Take every page as a single page
+static uintptr_t*
+take_all(size_t* num) {
+  size_t max    = spa_available();
+  uintptr_t* pages = (uintptr_t*)malloc(sizeof(uintptr_t) * max);
+  size_t n      = 0;
+  uintptr_t page;
+  while ((page = spa_get())) {
+    assert_true(n < max);
+    assert_true(page >= spa_base && page < spa_end);
+    pages[n++] = page;
+  }
+  assert_int_equal(n, max);
+  assert_int_equal(spa_available(), 0);
+  *num = n;
+  return pages;
+}
+
+static void
+test_init_lazy() {
+  init_region(REGION_SIZE);
+
+  // Nothing is linked until it is used or returned
+  assert_int_equal(list_pages(), 0);
+  // one state byte and one 16-bit count per frame
+  size_t meta = PAGE_UP((freemem_size >> RISCV_PAGE_BITS) * 3);
+  assert_int_equal(spa_available(), (freemem_size - meta) >> RISCV_PAGE_BITS);
+
+  uintptr_t page = spa_get();
+  assert_int_equal(page, spa_base + meta);
+  assert_int_equal(spa_frontier, page + RISCV_PAGE_SIZE);
+  spa_put(page);
+  assert_int_equal(list_pages(), 1);
+}
+
+static void
+test_page_count() {
+  init_region(REGION_SIZE);
+
+  uintptr_t a = spa_get();
+  uintptr_t b = spa_get();
+  uint16_t* count = spa_page_count(a);
+  assert_non_null(count);
+  assert_true(count != spa_page_count(b));
+
+  // It is the holder's, and outlives the page being freed
+  *count = 511;
+  spa_put(a);
+  assert_int_equal(spa_get(), a);
+  assert_int_equal(*spa_page_count(a), 511);
+
+  // Not for pages outside freemem, or never handed out
+  assert_null(spa_page_count(spa_base - RISCV_PAGE_SIZE));
+  assert_null(spa_page_count(spa_end - RISCV_PAGE_SIZE));
+}
+
+static void
+test_alloc_all_and_merge() {
+  init_region(REGION_SIZE);
+  size_t total = spa_available();
+
+  size_t n;
+  uintptr_t* pages = take_all(&n);
+  for (size_t i = 0; i < n; i++) {
+    memset((void*)pages[i], (int)i, RISCV_PAGE_SIZE);
+  }
+  // Nothing was handed out twice
+  for (size_t i = 0; i < n; i++) {
+    assert_int_equal(*(uint8_t*)pages[i], (uint8_t)i);
+  }
+
+  size_t* idxs = shuffled_idxs(n);
+  for (size_t i = 0; i < n; i++) spa_put(pages[idxs[i]]);
+  assert_int_equal(spa_available(), total);
+
+  // Everything merged back: only the unaligned ends are left in pieces
+  for (unsigned int order = 0; order < SPA_MAX_ORDER; order++) {
+    assert_true(spa_free_lists[order].count <= 2);
+  }
+  free(idxs);
+  free(pages);
+}
+
+static void
+test_orders() {
+  init_region(REGION_SIZE);
+  size_t total = spa_available();
+  uintptr_t blocks[SPA_MAX_ORDER + 1];
+
+  for (int round = 0; round < 2; round++) {
+    for (unsigned int order = 0; order <= SPA_MAX_ORDER; order++) {
+      size_t size   = (size_t)RISCV_PAGE_SIZE << order;
+      blocks[order] = spa_get_order(order);
+      assert_true(blocks[order] >= spa_base);
+      assert_true(blocks[order] + size <= spa_end);
+      assert_int_equal(__pa(blocks[order]) % size, 0);
+      memset((void*)blocks[order], (int)order, size);
+    }
+    for (unsigned int order = 0; order <= SPA_MAX_ORDER; order++) {
+      size_t size = (size_t)RISCV_PAGE_SIZE << order;
+      for (size_t i = 0; i < size; i += RISCV_PAGE_SIZE) {
+        assert_int_equal(((uint8_t*)blocks[order])[i], order);
+      }
+    }
+    for (unsigned int order = 0; order <= SPA_MAX_ORDER; order++) {
+      spa_put_order(blocks[order], order);
+    }
+    assert_int_equal(spa_available(), total);
+  }
+
+  // A block can come back a page at a time
+  uintptr_t block = spa_get_order(4);
+  for (int i = 15; i >= 0; i--) spa_put(block + i * RISCV_PAGE_SIZE);
+  assert_int_equal(spa_available(), total);
+  assert_int_equal(spa_get_order(4), block);
+  spa_put_order(block, 4);
+}
+
+static void
+test_zero() {
+  init_region(REGION_SIZE);
+  size_t total = spa_available();
+
+  uintptr_t page = spa_get_zero();
+  check_zero(page, RISCV_PAGE_SIZE);
+  memset((void*)page, 0xff, RISCV_PAGE_SIZE);
+  spa_put(page);
+
+  for (int i = 0; i < SPA_ZERO_POOL_MAX; i++) spa_zero_refill();
+  assert_int_equal(spa_zero_pages.count, SPA_ZERO_POOL_MAX);
+  assert_int_equal(spa_available(), total);
+
+  for (int i = 0; i < SPA_ZERO_POOL_MAX + 4; i++) {
+    page = spa_get_zero();
+    check_zero(page, RISCV_PAGE_SIZE);
+    memset((void*)page, 0xff, RISCV_PAGE_SIZE);
+  }
+  assert_int_equal(spa_zero_pages.count, 0);
+}
+
+static void
+test_hot_lifo() {
+  init_region(REGION_SIZE);
+  size_t total = spa_available();
+
+  uintptr_t a = spa_get(), b = spa_get();
+  memset((void*)a, 0xff, RISCV_PAGE_SIZE);
+  memset((void*)b, 0xff, RISCV_PAGE_SIZE);
+  spa_put_hot(a, SPA_HOT_USER_DATA);
+  spa_put_hot(b, SPA_HOT_USER_DATA);
+  assert_int_equal(spa_available(), total);
+
+  // Last freed, first reused, and cleared
+  assert_int_equal(spa_get_zero_hot(SPA_HOT_USER_DATA), b);
+  check_zero(b, RISCV_PAGE_SIZE);
+  assert_int_equal(spa_get_zero_hot(SPA_HOT_USER_DATA), a);
+
+  // Page-table pages are reused as they are
+  spa_put_hot(a, SPA_HOT_PAGE_TABLE);
+  *(volatile uint8_t*)a = 1;
+  assert_int_equal(spa_get_zero_hot(SPA_HOT_PAGE_TABLE), a);
+  assert_int_equal(*(uint8_t*)a, 1);
+  spa_put(a);
+
+  // A full cache spills its oldest page
+  uintptr_t pages[SPA_HOT_MAX + 1];
+  for (int i = 0; i <= SPA_HOT_MAX; i++) pages[i] = spa_get();
+  for (int i = 0; i <= SPA_HOT_MAX; i++) {
+    spa_put_hot(pages[i], SPA_HOT_USER_DATA);
+  }
+  assert_int_equal(spa_hot[SPA_HOT_USER_DATA].count, SPA_HOT_MAX);
+  for (int i = SPA_HOT_MAX; i > 0; i--) {
+    assert_int_equal(spa_get_zero_hot(SPA_HOT_USER_DATA), pages[i]);
+  }
+  spa_put(b);
+  for (int i = 1; i <= SPA_HOT_MAX; i++) spa_put(pages[i]);
+  assert_int_equal(spa_available(), total);
+}
+
+static void
+test_caches_give_back() {
+  init_region(4 * 1024 * 1024);
+  size_t n;
+  uintptr_t* pages = take_all(&n);
+
+  // Freed pages sitting in the caches still make up a block
+  size_t first = 0;
+  while (__pa(pages[first]) % (8 * RISCV_PAGE_SIZE)) first++;
+  for (size_t i = first; i < first + 4; i++) {
+    spa_put_hot(pages[i], SPA_HOT_USER_DATA);
+  }
+  for (size_t i = first + 4; i < first + 8; i++) spa_put(pages[i]);
+  for (int i = 0; i < 4; i++) spa_zero_refill();
+  assert_int_equal(spa_zero_pages.count, 4);
+
+  assert_int_equal(spa_get_order(3), pages[first]);
+  free(pages);
+}
+
+static void
+test_evict_fallback() {
+  init_region(4 * 1024 * 1024);
+  size_t n;
+  uintptr_t* pages = take_all(&n);
+
+  // All memory belongs to user pages; eviction gives them back one by one
+  evictable     = pages;
+  num_evictable = n;
+  uintptr_t block = spa_get_order(2);
+  assert_int_not_equal(block, 0);
+  assert_int_equal(__pa(block) % (4 * RISCV_PAGE_SIZE), 0);
+  assert_true(n - num_evictable <= SPA_EVICT_TRIES(2));
+
+  // Gives up after a bounded number of evictions when they never free two
+  // buddies
+  size_t m = 0;
+  for (size_t i = 0; i < num_evictable; i += 2) pages[m++] = pages[i];
+  num_evictable = m;
+  assert_int_equal(spa_get_order(1), 0);
+  assert_int_equal(m - num_evictable, SPA_EVICT_TRIES(1));
+  free(pages);
+}
+
+struct obj {
+  uint64_t a, b, c;
+};
+
+static struct spa_cache obj_cache = SPA_CACHE_INIT("obj", struct obj, NULL);
+
+static void
+test_cache() {
+  init_region(REGION_SIZE);
+  size_t total = spa_available();
+
+  // Enough objects for a few slabs
+  size_t n          = 1000;
+  struct obj** objs = (struct obj**)malloc(sizeof(struct obj*) * n);
+  for (size_t i = 0; i < n; i++) {
+    objs[i] = (struct obj*)spa_cache_alloc(&obj_cache);
+    assert_non_null(objs[i]);
+    assert_int_equal((uintptr_t)objs[i] % sizeof(uintptr_t), 0);
+    assert_int_equal(objs[i]->a | objs[i]->b | objs[i]->c, 0);
+    objs[i]->a = objs[i]->b = objs[i]->c = i;
+  }
+  for (size_t i = 0; i < n; i++) assert_int_equal(objs[i]->c, i);
+
+  size_t slabs = (n + obj_cache.per_slab - 1) / obj_cache.per_slab;
+  // Each object costs its size plus a free list index
+  assert_true(
+      obj_cache.per_slab * (sizeof(struct obj) + sizeof(uint16_t)) >
+      RISCV_PAGE_SIZE - 64);
+  assert_int_equal(obj_cache.slabs, slabs);
+  assert_int_equal(obj_cache.in_use, n);
+  assert_int_equal(spa_available(), total - slabs);
+
+  // Last freed, first reused
+  spa_cache_free(&obj_cache, objs[10]);
+  assert_int_equal(spa_cache_alloc(&obj_cache), objs[10]);
+
+  size_t* idxs = shuffled_idxs(n);
+  for (size_t i = 0; i < n; i++) spa_cache_free(&obj_cache, objs[idxs[i]]);
+  assert_int_equal(obj_cache.allocs, n + 1);
+  assert_int_equal(obj_cache.frees, n + 1);
+  assert_int_equal(obj_cache.in_use, 0);
+
+  // One empty slab is kept, and counts as free
+  assert_int_equal(obj_cache.slabs, 1);
+  assert_non_null(obj_cache.spare);
+  assert_int_equal(spa_available(), total);
+
+  // and goes back when memory runs out
+  size_t num;
+  uintptr_t* pages = take_all(&num);
+  assert_int_equal(obj_cache.slabs, 0);
+  assert_null(spa_cache_alloc(&obj_cache));
+  assert_int_equal(obj_cache.failures, 1);
+  spa_put(pages[0]);
+  assert_non_null(spa_cache_alloc(&obj_cache));
+
+  free(pages);
+  free(idxs);
+  free(objs);
+}
+
+static int ctor_calls;
+
+static void
+obj_ctor(void* p) {
+  struct obj* o = (struct obj*)p;
+  o->a          = 0x1234;
+  o->b = o->c = 0;
+  ctor_calls++;
+}
+
+static struct spa_cache ctor_cache =
+    SPA_CACHE_INIT("obj-ctor", struct obj, obj_ctor);
+
+static void
+test_cache_ctor() {
+  init_region(REGION_SIZE);
+  ctor_calls = 0;
+
+  struct obj* o = (struct obj*)spa_cache_alloc(&ctor_cache);
+  assert_int_equal(o->a, 0x1234);
+  // The whole slab was constructed at once
+  assert_int_equal(ctor_calls, ctor_cache.per_slab);
+
+  // Objects come back as they were freed, without constructing them again
+  o->b = 7;
+  spa_cache_free(&ctor_cache, o);
+  assert_int_equal(spa_cache_alloc(&ctor_cache), o);
+  assert_int_equal(o->a, 0x1234);
+  assert_int_equal(o->b, 7);
+
+  // So does the spare slab
+  spa_cache_free(&ctor_cache, o);
+  assert_non_null(ctor_cache.spare);
+  assert_int_equal(spa_cache_alloc(&ctor_cache), o);
+  assert_int_equal(ctor_calls, ctor_cache.per_slab);
+  spa_cache_free(&ctor_cache, o);
+}
+
+static void
+test_alloc_sizes() {
+  init_region(REGION_SIZE);
+  size_t total = spa_available();
+  void* objs[SPA_SLAB_MAX_SIZE + 1];
+
+  for (size_t size = 1; size <= SPA_SLAB_MAX_SIZE; size++) {
+    objs[size] = spa_alloc(size);
+    assert_non_null(objs[size]);
+    check_zero((uintptr_t)objs[size], size);
+    memset(objs[size], (int)size, size);
+    // Objects are naturally aligned, up to a cache line
+    size_t align = 1;
+    while (align < size && align < 64) align <<= 1;
+    assert_int_equal((uintptr_t)objs[size] % align, 0);
+  }
+  for (size_t size = 1; size <= SPA_SLAB_MAX_SIZE; size++) {
+    assert_int_equal(((uint8_t*)objs[size])[size - 1], (uint8_t)size);
+  }
+  assert_null(spa_alloc(0));
+  assert_null(spa_alloc(SPA_SLAB_MAX_SIZE + 1));
+
+  for (size_t size = 1; size <= SPA_SLAB_MAX_SIZE; size++) spa_free(objs[size]);
+  spa_free(NULL);
+  for (size_t k = 0; k < SPA_SIZE_CACHES; k++) {
+    assert_int_equal(spa_size_caches[k].in_use, 0);
+    assert_true(spa_size_caches[k].slabs <= 1);
+  }
+  assert_int_equal(spa_available(), total);
+}
+
+static double
+elapsed_ns(struct timespec* start) {
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+#define BENCH_WORKING_SET 16
+#define BENCH_ROUNDS (1 << 14)
+
+// Not a pass/fail test: reports the cost of a page fault-like alloc, fill
+// and free cycle, when freed pages are reused hot versus when they are
+// reused first-in first-out, the way the allocator used to
+static void
+test_reuse_cost() {
+  init_region(REGION_SIZE);
+  uintptr_t ws[BENCH_WORKING_SET];
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    for (int i = 0; i < BENCH_WORKING_SET; i++) {
+      ws[i] = spa_get_zero_hot(SPA_HOT_USER_DATA);
+      memset((void*)ws[i], r, RISCV_PAGE_SIZE);
+    }
+    for (int i = 0; i < BENCH_WORKING_SET; i++) {
+      spa_put_hot(ws[i], SPA_HOT_USER_DATA);
+    }
+  }
+  double hot_ns = elapsed_ns(&start) / (BENCH_ROUNDS * BENCH_WORKING_SET);
+
+  // FIFO: every page of the region goes round before one is reused
+  size_t n;
+  uintptr_t* fifo = take_all(&n);
+  size_t head     = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (int r = 0; r < BENCH_ROUNDS; r++) {
+    for (int i = 0; i < BENCH_WORKING_SET; i++) {
+      ws[i] = fifo[head];
+      head  = (head + 1) % n;
+      memset((void*)ws[i], 0, RISCV_PAGE_SIZE);
+      memset((void*)ws[i], r, RISCV_PAGE_SIZE);
+    }
+  }
+  double fifo_ns = elapsed_ns(&start) / (BENCH_ROUNDS * BENCH_WORKING_SET);
+  free(fifo);
+
+  printf(
+      "[SPA] %d page working set over %d MB: %.1f ns/page hot LIFO, "
+      "%.1f ns/page FIFO\n",
+      BENCH_WORKING_SET, REGION_SIZE >> 20, hot_ns, fifo_ns);
+}
+
+int
+main() {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_init_lazy),
+      cmocka_unit_test(test_page_count),
+      cmocka_unit_test(test_alloc_all_and_merge),
+      cmocka_unit_test(test_orders),
+      cmocka_unit_test(test_zero),
+      cmocka_unit_test(test_hot_lifo),
+      cmocka_unit_test(test_caches_give_back),
+      cmocka_unit_test(test_evict_fallback),
+      cmocka_unit_test(test_cache),
+      cmocka_unit_test(test_cache_ctor),
+      cmocka_unit_test(test_alloc_sizes),
+      cmocka_unit_test(test_reuse_cost),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+
+#include "../merk_pool.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "../merk_pool.c"
+#include "mock.h"
+
+void
+sbi_exit_enclave(uintptr_t code) {
+  exit(code);
+}
+
+static size_t pages_out = 0;
+
+uintptr_t
+paging_alloc_backing_page() {
+  void* out = mmap(
+      NULL, RISCV_PAGE_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert_int_not_equal(out, MAP_FAILED);
+  // Dirty it so the pool has to do its own zeroing
+  memset(out, 0xa5, RISCV_PAGE_SIZE);
+  pages_out++;
+  return (uintptr_t)out;
+}
+
+void
+paging_free_backing_page(uintptr_t page) {
+  assert_int_equal(page % RISCV_PAGE_SIZE, 0);
+  assert_int_equal(munmap((void*)page, RISCV_PAGE_SIZE), 0);
+  pages_out--;
+}
+
+typedef struct {
+  uint8_t bytes[64];
+} node64_t;
+
+typedef struct {
+  uint8_t bytes[48];
+} node48_t;
+
+typedef struct {
+  uint8_t bytes[2432];
+} node_big_t;
+
+#define NUM_NODES 1000
+
+static void
+check_zero(const void* node, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    assert_int_equal(((const uint8_t*)node)[i], 0);
+  }
+}
+
+static void
+test_alloc_free(size_t node_size, merk_pool_t* pool) {
+  size_t start = pages_out;
+  uint8_t* nodes[NUM_NODES];
+
+  for (size_t i = 0; i < NUM_NODES; i++) {
+    nodes[i] = (uint8_t*)merk_pool_alloc(pool);
+    assert_non_null(nodes[i]);
+    check_zero(nodes[i], node_size);
+    // Never the header slot, and never straddling a page
+    size_t offs = (uintptr_t)nodes[i] % RISCV_PAGE_SIZE;
+    assert_true(offs >= pool->header_nodes * node_size);
+    assert_true(offs + node_size <= RISCV_PAGE_SIZE);
+    memset(nodes[i], (int)i, node_size);
+  }
+
+  // Nothing was handed out twice
+  for (size_t i = 0; i < NUM_NODES; i++) {
+    for (size_t j = 0; j < node_size; j++) {
+      assert_int_equal(nodes[i][j], (uint8_t)i);
+    }
+  }
+  size_t usable = pool->nodes_per_page - pool->header_nodes;
+  assert_int_equal(pages_out - start, (NUM_NODES + usable - 1) / usable);
+
+  // Every page but the cached one goes back
+  for (size_t i = 0; i < NUM_NODES; i++) merk_pool_free(pool, nodes[i]);
+  assert_int_equal(pages_out - start, 1);
+  assert_null(pool->partial);
+  assert_non_null(pool->spare);
+}
+
+static void
+test_alloc_free_64() {
+  merk_pool_t pool = MERK_POOL_INIT(node64_t);
+  test_alloc_free(sizeof(node64_t), &pool);
+  assert_int_equal(pool.nodes_per_page, 64);
+  assert_int_equal(pool.header_nodes, 1);
+}
+
+static void
+test_alloc_free_48() {
+  merk_pool_t pool = MERK_POOL_INIT(node48_t);
+  test_alloc_free(sizeof(node48_t), &pool);
+  assert_int_equal(pool.nodes_per_page, 85);
+  assert_int_equal(pool.header_nodes, 1);
+}
+
+static void
+test_reuse_freed() {
+  merk_pool_t pool = MERK_POOL_INIT(node64_t);
+  node64_t* nodes[63 * 2];
+  for (size_t i = 0; i < 63 * 2; i++) nodes[i] = merk_pool_alloc(&pool);
+
+  // Both pages are full; a free puts the first back on the list and the
+  // next allocation takes exactly that node
+  size_t pages = pages_out;
+  merk_pool_free(&pool, nodes[17]);
+  node64_t* again = merk_pool_alloc(&pool);
+  assert_int_equal(again, nodes[17]);
+  assert_int_equal(pages_out, pages);
+
+  for (size_t i = 0; i < 63 * 2; i++) merk_pool_free(&pool, nodes[i]);
+}
+
+static void
+test_alloc_near() {
+  merk_pool_t pool = MERK_POOL_INIT(node64_t);
+  node64_t* full[63];
+  for (size_t i = 0; i < 63; i++) full[i] = merk_pool_alloc(&pool);
+  node64_t* other = merk_pool_alloc(&pool);
+  assert_int_not_equal(MERK_POOL_PAGE(other), MERK_POOL_PAGE(full[0]));
+
+  // Freeing puts the first page back at the head of the list, but a hint
+  // into the second page still wins
+  merk_pool_free(&pool, full[5]);
+  node64_t* near_other = merk_pool_alloc_near(&pool, other);
+  assert_int_equal(MERK_POOL_PAGE(near_other), MERK_POOL_PAGE(other));
+
+  node64_t* near_full = merk_pool_alloc_near(&pool, full[0]);
+  assert_int_equal(near_full, full[5]);
+
+  // A full hint page falls back to any page
+  node64_t* fallback = merk_pool_alloc_near(&pool, full[0]);
+  assert_int_equal(MERK_POOL_PAGE(fallback), MERK_POOL_PAGE(other));
+  check_zero(fallback, sizeof(*fallback));
+
+  for (size_t i = 0; i < 63; i++) merk_pool_free(&pool, full[i]);
+  merk_pool_free(&pool, other);
+  merk_pool_free(&pool, near_other);
+  merk_pool_free(&pool, fallback);
+  assert_null(pool.partial);
+}
+
+static void
+test_whole_page() {
+  merk_pool_t pool = MERK_POOL_INIT(node_big_t);
+  size_t start     = pages_out;
+  node_big_t* a    = merk_pool_alloc(&pool);
+  node_big_t* b    = merk_pool_alloc_near(&pool, a);
+
+  assert_int_equal((uintptr_t)a % RISCV_PAGE_SIZE, 0);
+  assert_int_equal((uintptr_t)b % RISCV_PAGE_SIZE, 0);
+  check_zero(a, sizeof(*a));
+  assert_int_equal(pages_out - start, 2);
+
+  merk_pool_free(&pool, a);
+  merk_pool_free(&pool, b);
+  assert_int_equal(pages_out, start);
+}
+
+int
+main() {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_alloc_free_64),
+      cmocka_unit_test(test_alloc_free_48),
+      cmocka_unit_test(test_reuse_freed),
+      cmocka_unit_test(test_alloc_near),
+      cmocka_unit_test(test_whole_page),
+  };
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
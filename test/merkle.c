@@ -7,7 +7,6 @@
 #include <stdint.h>
 #include <sys/mman.h>
 
-#define MERK_SILENT
 #include "../merkle.c"
 #include "mock.h"
 
@@ -19,12 +18,63 @@ sbi_exit_enclave(uintptr_t code) {
   exit(code);
 }
 
+// Tree nodes are allocated from, and compact nodes refer to, one contiguous
+// backing region
+static void* backing_region;
+static size_t backing_region_used;
+#define BACKING_REGION_SIZE (256 * 1024 * 1024)
+
+uintptr_t
+paging_backing_region() {
+  if (!backing_region) {
+    backing_region = mmap(
+        NULL, BACKING_REGION_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert_int_not_equal(backing_region, MAP_FAILED);
+  }
+  return (uintptr_t)backing_region;
+}
+
+uintptr_t
+paging_backing_region_size() {
+  return BACKING_REGION_SIZE;
+}
+
+// Backing pages left to hand out before failing, to run out of memory on
+// purpose
+static size_t backing_pages_left = SIZE_MAX;
+
 uintptr_t
 paging_alloc_backing_page() {
-  void* out = mmap(
-      NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  assert_int_not_equal(out, MAP_FAILED);
-  return (uintptr_t)out;
+  if (!backing_pages_left) return 0;
+  if (backing_pages_left != SIZE_MAX) backing_pages_left--;
+
+  uintptr_t out = paging_backing_region() + backing_region_used;
+  backing_region_used += RISCV_PAGE_SIZE;
+  assert_true(backing_region_used <= BACKING_REGION_SIZE);
+  return out;
+}
+
+void
+paging_free_backing_page(uintptr_t page) {
+  // Keep the region contiguous; just make sure nothing reads it again
+  memset((void*)page, 0xa5, RISCV_PAGE_SIZE);
+  if (backing_pages_left != SIZE_MAX) backing_pages_left++;
+}
+
+// Keys are backing page addresses, as page_swap uses them. Region entries
+// leave a free key after each of theirs.
+#define KEY(n) (paging_backing_region() + (uintptr_t)(n)*RISCV_PAGE_SIZE)
+#define REGION_KEY(idx) KEY(2 * (idx) + 1)
+
+// The last failure passed to the violation hook
+static merk_status_t reported_status;
+static uintptr_t reported_key;
+
+static void
+record_violation(merk_status_t status, uintptr_t key) {
+  reported_status = status;
+  reported_key    = key;
 }
 
 #define RAND_REGION_ENTRIES 1000
@@ -71,7 +121,7 @@ random_region_insert(merkle_node_t* root) {
     sha256_update(&sha, subregion, RAND_ENTRY_SIZE);
     sha256_final(&sha, hash);
 
-    int res = merk_insert(root, (uintptr_t)subregion, hash);
+    int res = merk_insert(root, REGION_KEY(idxs[i]), hash);
     assert_int_equal(res, 0);
   }
 
@@ -98,7 +148,7 @@ count_verify_fails(merkle_node_t* tree) {
     sha256_init(&sha);
     sha256_update(&sha, region, RAND_ENTRY_SIZE);
     sha256_final(&sha, region_hash);
-    total_verify_fails += !merk_verify(tree, (uintptr_t)region, region_hash);
+    total_verify_fails += !merk_verify(tree, REGION_KEY(idxs[ri]), region_hash);
   }
 
   free(idxs);
@@ -113,7 +163,7 @@ struct merk_stats_s {
 
 struct merk_stats_s
 merk_stats(const merkle_node_t* root) {
-  const merkle_node_t *left = root->left, *right = root->right;
+  const merkle_node_t *left = merk_left(root), *right = merk_right(root);
 
   struct merk_stats_s out = {
       .max_depth = 1,
@@ -160,7 +210,9 @@ static void
 test_verify_nonexistant() {
   merkle_node_t root = {};
   uint8_t zeros[32]  = {};
-  assert_false(merk_verify(&root, 1, zeros));
+  reported_status    = MERK_OK;
+  assert_false(merk_verify(&root, KEY(1), zeros));
+  assert_int_equal(reported_status, MERK_NOT_FOUND);
 }
 
 static void
@@ -168,9 +220,9 @@ test_insert_and_verify_1() {
   merkle_node_t root       = {};
   const uint8_t* rand_hash = random_region();
 
-  int res = merk_insert(&root, 1, rand_hash);
+  int res = merk_insert(&root, KEY(1), rand_hash);
   assert_int_equal(res, 0);
-  assert_true(merk_verify(&root, 1, rand_hash));
+  assert_true(merk_verify(&root, KEY(1), rand_hash));
 }
 
 static void
@@ -179,12 +231,12 @@ test_insert_and_verify_2() {
   const uint8_t* rand_hash_1 = random_region();
   const uint8_t* rand_hash_2 = random_region() + 32;
 
-  int res = merk_insert(&root, 1, rand_hash_1);
+  int res = merk_insert(&root, KEY(1), rand_hash_1);
   assert_int_equal(res, 0);
-  res = merk_insert(&root, 2, rand_hash_2);
+  res = merk_insert(&root, KEY(2), rand_hash_2);
   assert_int_equal(res, 0);
-  assert_true(merk_verify(&root, 1, rand_hash_1));
-  assert_true(merk_verify(&root, 2, rand_hash_2));
+  assert_true(merk_verify(&root, KEY(1), rand_hash_1));
+  assert_true(merk_verify(&root, KEY(2), rand_hash_2));
 }
 
 static void
@@ -226,8 +278,11 @@ test_poison_data() {
   // Flip a random bit in the hash to simulate a tampered entry
   hash[rand() & 31] ^= 1 << (rand() & 7);
 
-  bool res = merk_verify(&root, (uintptr_t)poison_ptr, hash);
+  reported_status = MERK_OK;
+  bool res        = merk_verify(&root, REGION_KEY(poison_idx), hash);
   assert_false(res);
+  assert_int_equal(reported_status, MERK_HASH_MISMATCH);
+  assert_int_equal(reported_key, REGION_KEY(poison_idx));
 }
 
 static void
@@ -244,22 +299,24 @@ test_poison_leaf() {
   while (node->left || node->right) {
     merkle_node_t* next[2];
     int num_next   = 0;
-    next[num_next] = node->left;
+    next[num_next] = merk_left(node);
     num_next += !!node->left;
-    next[num_next] = node->right;
+    next[num_next] = merk_right(node);
     num_next += !!node->right;
 
     int taken = rand() % num_next;
     node      = next[taken];
   }
 
-  uintptr_t key = node->ptr;
+  uintptr_t key = merk_node_key(node);
   uint8_t* hash = node->hash;
   // Simulate a tampered entry
   flip_random_bit(hash, 32);
 
-  bool res = merk_verify(&root, key, hash);
+  reported_status = MERK_OK;
+  bool res        = merk_verify(&root, key, hash);
   assert_false(res);
+  assert_int_equal(reported_status, MERK_TAMPERED);
 }
 
 static void
@@ -279,46 +336,46 @@ test_insert_corrupt_insert() {
   // left
   // TODO: not all trees may have this structure
   merkle_node_t* node = &root;
-  assert_non_null(node->right);
-  assert_non_null(node->right->right);
+  assert_non_null(merk_right(node));
+  assert_non_null(merk_right(merk_right(node)));
 
-  while (node->right->right) {
-    node = node->right;
+  while (merk_right(merk_right(node))) {
+    node = merk_right(node);
   }
 
-  merkle_node_t* leaf = node->right;
+  merkle_node_t* leaf = merk_right(node);
   // Find the position of the sibling/nephew leaf
-  merkle_node_t* sibling = node->left;
+  merkle_node_t* sibling = merk_left(node);
 
   assert_non_null(leaf);
   assert_non_null(sibling);
 
-  while (sibling->left) {
-    sibling = sibling->left;
+  while (merk_left(sibling)) {
+    sibling = merk_left(sibling);
   }
 
-  assert_null(leaf->left);
-  assert_null(leaf->right);
-  assert_null(sibling->left);
-  assert_null(sibling->right);
+  assert_null(merk_left(leaf));
+  assert_null(merk_right(leaf));
+  assert_null(merk_left(sibling));
+  assert_null(merk_right(sibling));
 
   // Check to make sure both start off okay
-  bool ok = merk_verify(&root, leaf->ptr, leaf->hash);
-  ok &= merk_verify(&root, sibling->ptr, sibling->hash);
+  bool ok = merk_verify(&root, merk_node_key(leaf), leaf->hash);
+  ok &= merk_verify(&root, merk_node_key(sibling), sibling->hash);
   assert_true(ok);
 
   // When we corrupt the leaf hash, we expect the leaf check to fail
   flip_random_bit(leaf->hash, 32);
 
   merkle_node_t leaf_copy = *leaf, sibling_copy = *sibling;
-  ok = merk_verify(&root, leaf_copy.ptr, leaf_copy.hash);
+  ok = merk_verify(&root, merk_node_key(&leaf_copy), leaf_copy.hash);
   assert_false(ok);
 
   // Test that merk_insert doesn't incorrectly "validate" a hash that isn't the
   // one we inserted
-  int res = merk_insert(&root, sibling_copy.ptr, sibling_copy.hash);
+  int res = merk_insert(&root, merk_node_key(&sibling_copy), sibling_copy.hash);
   assert_int_not_equal(res, 0);
-  ok = merk_verify(&root, leaf_copy.ptr, leaf_copy.hash);
+  ok = merk_verify(&root, merk_node_key(&leaf_copy), leaf_copy.hash);
   assert_false(ok);
 }
 
@@ -327,27 +384,342 @@ test_corrupt_key() {
   merkle_node_t root = {};
   SHA256_CTX sha;
 
-  int res = merk_insert(&root, 1, random_region());
+  int res = merk_insert(&root, KEY(1), random_region());
   assert_int_equal(res, 0);
-  res = merk_insert(&root, 2, random_region() + 32);
+  res = merk_insert(&root, KEY(2), random_region() + 32);
   assert_int_equal(res, 0);
 
-  assert_true(merk_verify(&root, 1, random_region()));
-  assert_true(merk_verify(&root, 2, random_region() + 32));
+  assert_true(merk_verify(&root, KEY(1), random_region()));
+  assert_true(merk_verify(&root, KEY(2), random_region() + 32));
 
   // Swap the keys for entries 1 and 2
-  assert_non_null(root.right);
-  merkle_node_t *first = root.right->left, *second = root.right->right;
+  assert_non_null(merk_right(&root));
+  merkle_node_t *first  = merk_left(merk_right(&root)),
+                *second = merk_right(merk_right(&root));
   assert_non_null(first);
   assert_non_null(second);
 
-  assert_int_equal(first->ptr, 1);
-  first->ptr = 2;
-  assert_int_equal(second->ptr, 2);
-  second->ptr = 1;
+  merk_key_t first_key = first->ptr;
+  assert_int_equal(merk_node_key(first), KEY(1));
+  assert_int_equal(merk_node_key(second), KEY(2));
+  first->ptr  = second->ptr;
+  second->ptr = first_key;
+
+  assert_false(merk_verify(&root, KEY(1), random_region()));
+  assert_false(merk_verify(&root, KEY(2), random_region() + 32));
+}
+
+static void
+sorted_region_keys(uintptr_t** keys, uint8_t (**hashes)[32]) {
+  // Region entries in address order, as a restore would present them
+  *keys   = (uintptr_t*)malloc(sizeof(uintptr_t) * RAND_REGION_ENTRIES);
+  *hashes = (uint8_t(*)[32])malloc(32 * RAND_REGION_ENTRIES);
+  SHA256_CTX sha;
+
+  for (size_t i = 0; i < RAND_REGION_ENTRIES; i++) {
+    const uint8_t* subregion = random_region() + i * RAND_ENTRY_SIZE;
+    (*keys)[i]               = REGION_KEY(i);
+    sha256_init(&sha);
+    sha256_update(&sha, subregion, RAND_ENTRY_SIZE);
+    sha256_final(&sha, (*hashes)[i]);
+  }
+}
+
+static void
+test_bulk_build() {
+  merkle_node_t root = {};
+  uintptr_t* keys;
+  uint8_t(*hashes)[32];
+  sorted_region_keys(&keys, &hashes);
+
+  int res = merk_bulk_build(&root, keys, hashes, RAND_REGION_ENTRIES);
+  assert_int_equal(res, 0);
+  assert_int_equal(count_verify_fails(&root), 0);
+
+  // A bulk-built tree is balanced: a full binary tree under the root
+  struct merk_stats_s stats = merk_stats(&root);
+  assert_int_equal(stats.leaves, RAND_REGION_ENTRIES);
+  assert_int_equal(stats.elems, 2 * RAND_REGION_ENTRIES);
+  assert_true(stats.max_depth <= ceil(log2(RAND_REGION_ENTRIES)) + 1);
+
+  // and accepts inserts afterwards
+  random_region_insert(&root);
+  assert_int_equal(count_verify_fails(&root), 0);
+
+  free(keys);
+  free(hashes);
+}
+
+static void
+test_bulk_build_1() {
+  merkle_node_t root       = {};
+  uintptr_t key            = KEY(1);
+  const uint8_t* rand_hash = random_region();
+
+  int res = merk_bulk_build(&root, &key, (const uint8_t(*)[32])rand_hash, 1);
+  assert_int_equal(res, 0);
+  assert_true(merk_verify(&root, KEY(1), rand_hash));
+}
+
+static void
+test_bulk_build_no_memory() {
+  merkle_node_t root = {};
+  uintptr_t* keys;
+  uint8_t(*hashes)[32];
+  sorted_region_keys(&keys, &hashes);
+
+  backing_pages_left = 4;
+  reported_status    = MERK_OK;
+  int res = merk_bulk_build(&root, keys, hashes, RAND_REGION_ENTRIES);
+  assert_int_equal(res, -1);
+  assert_int_equal(reported_status, MERK_NO_MEMORY);
+  assert_null(root.right);
+
+  // Nothing built before running out was kept: a smaller tree still fits
+  res = merk_bulk_build(&root, keys, hashes, 50);
+  backing_pages_left = SIZE_MAX;
+  assert_int_equal(res, 0);
+  for (size_t i = 0; i < 50; i++) {
+    assert_true(merk_verify(&root, keys[i], hashes[i]));
+  }
+
+  free(keys);
+  free(hashes);
+}
+
+static void
+test_bulk_build_rejects() {
+  merkle_node_t root = {};
+  uintptr_t* keys;
+  uint8_t(*hashes)[32];
+  sorted_region_keys(&keys, &hashes);
+
+  uintptr_t tmp = keys[10];
+  keys[10]      = keys[11];
+  keys[11]      = tmp;
+  int res = merk_bulk_build(&root, keys, hashes, RAND_REGION_ENTRIES);
+  assert_int_not_equal(res, 0);
+  assert_null(root.right);
+
+  keys[11] = keys[10];
+  keys[10] = tmp;
+  res      = merk_insert(&root, KEY(1), random_region());
+  assert_int_equal(res, 0);
+  res = merk_bulk_build(&root, keys, hashes, RAND_REGION_ENTRIES);
+  assert_int_not_equal(res, 0);
+
+  free(keys);
+  free(hashes);
+}
+
+static void
+region_hash(size_t idx, uint8_t hash[32]) {
+  SHA256_CTX sha;
+  sha256_init(&sha);
+  sha256_update(&sha, random_region() + idx * RAND_ENTRY_SIZE, RAND_ENTRY_SIZE);
+  sha256_final(&sha, hash);
+}
+
+static void
+deferred_region_insert(merkle_node_t* root, size_t* idxs, size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    uint8_t hash[32];
+    region_hash(idxs[i], hash);
+    int res = merk_insert_deferred(
+        root, REGION_KEY(idxs[i]), hash);
+    assert_int_equal(res, 0);
+  }
+}
+
+static void
+test_deferred_matches_insert() {
+  merkle_node_t root = {}, deferred_root = {};
+  size_t* idxs       = shuffled_idxs(RAND_REGION_ENTRIES);
+
+  for (size_t i = 0; i < RAND_REGION_ENTRIES; i++) {
+    uint8_t hash[32];
+    region_hash(idxs[i], hash);
+    int res = merk_insert(
+        &root, REGION_KEY(idxs[i]), hash);
+    assert_int_equal(res, 0);
+  }
+
+  // The table fills up and commits several times along the way
+  deferred_region_insert(&deferred_root, idxs, RAND_REGION_ENTRIES);
+  assert_int_equal(count_verify_fails(&deferred_root), 0);
+  merk_commit(&deferred_root);
+  assert_int_equal(count_verify_fails(&deferred_root), 0);
+
+  // Same insert order, same shape, so the same root hash
+  assert_memory_equal(root.hash, deferred_root.hash, 32);
+  free(idxs);
+}
+
+static void
+test_deferred_batch() {
+  merkle_node_t root = random_region_tree();
+  size_t* idxs       = shuffled_idxs(RAND_REGION_ENTRIES);
+
+  // A short burst stays pending, and verify sees through it
+  deferred_region_insert(&root, idxs, 4);
+  assert_int_not_equal(merk_dirty_count, 0);
+  assert_int_equal(count_verify_fails(&root), 0);
+
+  // The stale copies outside the enclave are not trusted meanwhile
+  merkle_node_t* stale = merk_dirty[merk_dirty_count - 1].node;
+  flip_random_bit(stale->hash, 32);
+  assert_int_equal(count_verify_fails(&root), 0);
+
+  // and are overwritten by the commit
+  merk_commit(&root);
+  assert_int_equal(merk_dirty_count, 0);
+  assert_int_equal(count_verify_fails(&root), 0);
+
+  // An immediate insert commits any pending batch first
+  deferred_region_insert(&root, idxs + 4, 4);
+  random_region_insert(&root);
+  assert_int_equal(merk_dirty_count, 0);
+  assert_int_equal(count_verify_fails(&root), 0);
+  free(idxs);
+}
+
+static void
+test_deferred_poison() {
+  merkle_node_t root = random_region_tree();
+  size_t idx         = rand() % RAND_REGION_ENTRIES;
+  uintptr_t key      = REGION_KEY(idx);
+  uint8_t hash[32];
+  region_hash(idx, hash);
+
+  // Make the path to key dirty, then tamper with the clean leaf below it
+  assert_int_equal(merk_insert_deferred(&root, key, hash), 0);
+  int e = 0, side;
+  while (merk_dirty[e].child_entry[side = merk_key(key) >= merk_dirty[e].copy.ptr] >= 0) {
+    e = merk_dirty[e].child_entry[side];
+  }
+  merkle_node_t* leaf = merk_child(&merk_dirty[e].copy, side);
+  assert_int_equal(merk_node_key(leaf), key);
+  flip_random_bit(leaf->hash, 32);
+
+  assert_false(merk_verify(&root, key, leaf->hash));
+  assert_int_not_equal(merk_insert_deferred(&root, key + RISCV_PAGE_SIZE, hash), 0);
+  merk_commit(&root);
+  assert_false(merk_verify(&root, key, leaf->hash));
+}
+
+#define RUN_KEYS 600
+
+// Hashes for the run of keys KEY(0), KEY(1), ...
+static uint8_t (*run_hashes(size_t n, uint8_t gen))[32] {
+  uint8_t(*hashes)[32] = (uint8_t(*)[32])malloc(32 * n);
+  for (size_t i = 0; i < n; i++) {
+    SHA256_CTX sha;
+    sha256_init(&sha);
+    sha256_update(&sha, (const uint8_t*)&i, sizeof(i));
+    sha256_update(&sha, &gen, 1);
+    sha256_final(&sha, hashes[i]);
+  }
+  return hashes;
+}
+
+static void
+run_insert(merkle_node_t* root, size_t n, size_t step, uint8_t gen) {
+  uint8_t(*hashes)[32] = run_hashes(n, gen);
+  size_t* idxs         = shuffled_idxs(n);
+  for (size_t i = 0; i < n; i++) {
+    if (idxs[i] % step) continue;
+    assert_int_equal(merk_insert(root, KEY(idxs[i]), hashes[idxs[i]]), 0);
+  }
+  free(idxs);
+  free(hashes);
+}
+
+static void
+test_verify_range() {
+  merkle_node_t root = {};
+  run_insert(&root, RUN_KEYS, 1, 0);
+  uint8_t(*hashes)[32] = run_hashes(RUN_KEYS + 1, 0);
+
+  // More than one chunk, and a run from the middle
+  assert_true(merk_verify_range(&root, KEY(0), RUN_KEYS, hashes));
+  assert_true(merk_verify_range(&root, KEY(123), 77, hashes + 123));
+  assert_true(merk_verify_range(&root, KEY(5), 1, hashes + 5));
+
+  // A key past the end of the tree, and a wrong expected hash
+  assert_false(merk_verify_range(&root, KEY(1), RUN_KEYS, hashes + 1));
+  flip_random_bit(hashes[300], 32);
+  assert_false(merk_verify_range(&root, KEY(0), RUN_KEYS, hashes));
+  free(hashes);
+}
+
+static void
+test_verify_range_poison() {
+  merkle_node_t root = {};
+  run_insert(&root, RUN_KEYS, 1, 0);
+  uint8_t(*hashes)[32] = run_hashes(RUN_KEYS, 0);
+
+  // Tamper with a leaf in the run and present its new hash as expected
+  merkle_node_t* node = merk_right(&root);
+  while (node->left || node->right) {
+    node = merk_child(node, merk_key(KEY(200)) >= node->ptr);
+  }
+  flip_random_bit(node->hash, 32);
+  memcpy(hashes[200], node->hash, 32);
+  reported_status = MERK_OK;
+  assert_false(merk_verify_range(&root, KEY(150), 100, hashes + 150));
+  assert_int_equal(reported_status, MERK_TAMPERED);
+  free(hashes);
+}
+
+static void
+test_insert_too_deep() {
+  // Increasing keys make a chain, which soon outgrows MERK_MAX_DEPTH. The
+  // insert that would overflow it fails without changing the tree.
+  merkle_node_t root   = {};
+  uint8_t(*hashes)[32] = run_hashes(2 * MERK_MAX_DEPTH, 0);
+  size_t n;
+  reported_status = MERK_OK;
+  for (n = 0; n < 2 * MERK_MAX_DEPTH; n++) {
+    if (merk_insert(&root, KEY(n), hashes[n])) break;
+  }
+  assert_in_range(n, MERK_MAX_DEPTH - 2, MERK_MAX_DEPTH);
+  assert_int_equal(reported_status, MERK_TOO_DEEP);
+  assert_int_equal(reported_key, KEY(n));
+
+  assert_true(merk_verify_range(&root, KEY(0), n, hashes));
+  assert_false(merk_verify(&root, KEY(n), hashes[n]));
+  free(hashes);
+}
+
+static void
+test_update_range() {
+  // Every other key is in the tree; the rest are inserted by the update
+  merkle_node_t root = {};
+  run_insert(&root, RUN_KEYS, 2, 0);
+  uint8_t(*old_hashes)[32] = run_hashes(RUN_KEYS, 0);
+  uint8_t(*new_hashes)[32] = run_hashes(RUN_KEYS, 1);
+
+  assert_int_equal(
+      merk_update_range(&root, KEY(100), RUN_KEYS - 100, new_hashes + 100),
+      0);
+  assert_true(merk_verify_range(&root, KEY(100), RUN_KEYS - 100, new_hashes + 100));
+  for (size_t i = 0; i < RUN_KEYS; i++) {
+    if (i >= 100) {
+      assert_true(merk_verify(&root, KEY(i), new_hashes[i]));
+    } else if (i % 2 == 0) {
+      assert_true(merk_verify(&root, KEY(i), old_hashes[i]));
+    }
+  }
+
+  // Deferred inserts are committed first
+  assert_int_equal(merk_insert_deferred(&root, KEY(1), old_hashes[1]), 0);
+  assert_int_equal(merk_update_range(&root, KEY(0), 4, new_hashes), 0);
+  assert_int_equal(merk_dirty_count, 0);
+  assert_true(merk_verify_range(&root, KEY(0), 4, new_hashes));
+  assert_false(merk_verify_range(&root, KEY(0), 100, new_hashes));
 
-  assert_false(merk_verify(&root, 1, random_region()));
-  assert_false(merk_verify(&root, 2, random_region() + 32));
+  free(old_hashes);
+  free(new_hashes);
 }
 
 int
@@ -363,6 +735,18 @@ main() {
       cmocka_unit_test(test_poison_root),
       cmocka_unit_test(test_insert_corrupt_insert),
       cmocka_unit_test(test_corrupt_key),
+      cmocka_unit_test(test_bulk_build),
+      cmocka_unit_test(test_bulk_build_1),
+      cmocka_unit_test(test_bulk_build_rejects),
+      cmocka_unit_test(test_bulk_build_no_memory),
+      cmocka_unit_test(test_deferred_matches_insert),
+      cmocka_unit_test(test_deferred_batch),
+      cmocka_unit_test(test_deferred_poison),
+      cmocka_unit_test(test_verify_range),
+      cmocka_unit_test(test_verify_range_poison),
+      cmocka_unit_test(test_update_range),
+      cmocka_unit_test(test_insert_too_deep),
   };
+  merk_set_violation_hook(record_violation);
   return cmocka_run_group_tests(tests, NULL, NULL);
 }
\ No newline at end of file
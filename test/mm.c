@@ -0,0 +1,397 @@
+#define _GNU_SOURCE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "../vm_defs.h"
+
+// Freemem and the user pages are a fake region at EYRIE_LOAD_START, which
+// can't be mapped on the host on rv64, where megapages are: move it.
+#undef EYRIE_LOAD_START
+#define EYRIE_LOAD_START 0x500000000000ul
+
+#include "../freemem.c"
+#include "../vma.c"
+#include "../mm.c"
+#include "mock.h"
+
+uintptr_t paging_pa_start;
+
+void
+sbi_exit_enclave(uintptr_t code) {
+  exit(code);
+}
+
+void
+tlb_flush(void) {}
+
+static long user_pages;
+static size_t backing_pages;
+
+void
+paging_inc_user_page(void) {
+  user_pages++;
+}
+
+void
+paging_dec_user_page(void) {
+  user_pages--;
+}
+
+void
+paging_free_backing_page(uintptr_t page) {
+  (void)page;
+  backing_pages--;
+}
+
+int
+paging_swap_in(pte* entry) {
+  (void)entry;
+  return 0;
+}
+
+unsigned int
+paging_remaining_pages(void) {
+  return 0;
+}
+
+// The one user page the fake pager evicts, 0 for none; like the real one,
+// it finds its PTE with pte_of_va, which splits its megapage
+static uintptr_t victim;
+
+uintptr_t
+paging_evict_and_free_one(uintptr_t swap_va) {
+  (void)swap_va;
+  if (!victim) return 0;
+
+  pte* entry = pte_of_va(victim);
+  assert_non_null(entry);
+  assert_true(*entry & PTE_V);
+
+  uintptr_t pa = pte_ppn(*entry) << RISCV_PAGE_BITS;
+  *entry = pte_create_invalid(backing_pages + 1, *entry & PTE_FLAG_MASK);
+  backing_pages++;
+  paging_dec_user_page();
+  victim = 0;
+  return pa;
+}
+
+#define REGION_SIZE (32 * 1024 * 1024)
+#define PAGE RISCV_PAGE_SIZE
+#define MEGAPAGE (PAGE * MEGAPAGE_PAGES)
+#define FLAGS (PTE_R | PTE_W | PTE_U | PTE_A | PTE_D)
+
+static void
+init_region(void) {
+  static void* region;
+  if (!region) {
+    region = mmap(
+        (void*)EYRIE_LOAD_START, REGION_SIZE, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE | MAP_NORESERVE, -1,
+        0);
+    assert_int_equal(region, EYRIE_LOAD_START);
+  }
+  memset(region, 0xa5, REGION_SIZE);
+
+  load_pa_start    = EYRIE_LOAD_START;
+  freemem_va_start = EYRIE_LOAD_START;
+  freemem_size     = REGION_SIZE;
+  spa_init(freemem_va_start, freemem_size);
+
+  memset(root_page_table, 0, sizeof(root_page_table));
+  memset(leaf_cache, 0, sizeof(leaf_cache));
+  megapage_tables = 0;
+  reserved_pages  = 0;
+  user_pages      = 0;
+  backing_pages   = 0;
+  victim          = 0;
+}
+
+// A backed megapage at va, each page filled with its index
+static uintptr_t
+make_megapage(uintptr_t va) {
+  assert_int_equal(reserve_pages(vpn(va), MEGAPAGE_PAGES, FLAGS), MEGAPAGE_PAGES);
+  uintptr_t block = populate_page(va);
+  assert_true(block);
+
+  int level;
+  assert_non_null(__walk_leaf(root_page_table, va, &level));
+  assert_int_equal(level, MEGAPAGE_LEVEL);
+  for (size_t i = 0; i < MEGAPAGE_PAGES; i++) {
+    memset((void*)(block + i * PAGE), (int)i, PAGE);
+  }
+  return block;
+}
+
+static void
+check_page(uintptr_t va, uintptr_t block, size_t i) {
+  assert_int_equal(translate(va + i * PAGE), __pa(block) + i * PAGE);
+  assert_int_equal(*(uint8_t*)(block + i * PAGE), (uint8_t)i);
+}
+
+// Take every free page, so that anything more has to evict
+static uintptr_t*
+take_all(size_t* num) {
+  size_t max       = spa_available();
+  uintptr_t* pages = (uintptr_t*)malloc(sizeof(uintptr_t) * max);
+  size_t n         = 0;
+  uintptr_t page;
+  while ((page = spa_get())) pages[n++] = page;
+  while ((page = spa_get_zero_hot(SPA_HOT_PAGE_TABLE))) pages[n++] = page;
+  assert_int_equal(spa_available(), 0);
+  *num = n;
+  return pages;
+}
+
+static void
+test_split_exhausted() {
+  init_region();
+  size_t total = spa_available();
+
+  uintptr_t va     = EYRIE_ANON_REGION_START;
+  uintptr_t va2    = va + MEGAPAGE;
+  uintptr_t block  = make_megapage(va);
+  uintptr_t block2 = make_megapage(va2);
+  assert_int_equal(user_pages, 2 * MEGAPAGE_PAGES);
+
+  size_t n;
+  uintptr_t* pages = take_all(&n);
+
+  // Evicting splits the megapage with no memory left, from inside the
+  // allocation that is evicting
+  victim         = va + 5 * PAGE;
+  uintptr_t page = spa_get_zero_hot(SPA_HOT_USER_DATA);
+  assert_int_equal(page, block + 5 * PAGE);
+  assert_int_equal(victim, 0);
+  assert_int_equal(spa_available(), 0);
+
+  int level;
+  pte* entry = __walk_leaf(root_page_table, va + 5 * PAGE, &level);
+  assert_int_equal(level, RISCV_PT_LEVELS);
+  assert_false(*entry & PTE_V);
+  assert_true(*entry & PTE_U);
+  for (size_t i = 0; i < MEGAPAGE_PAGES; i++) {
+    if (i != 5) check_page(va, block, i);
+  }
+
+  // Freeing part of a megapage splits it, with no memory left either
+  free_pages(vpn(va2) + 7, 1);
+  assert_int_equal(translate(va2 + 7 * PAGE), 0);
+  assert_int_equal(spa_available(), 1);
+  for (size_t i = 0; i < MEGAPAGE_PAGES; i++) {
+    if (i != 7) check_page(va2, block2, i);
+  }
+
+  // Everything comes back, the tables included
+  free_pages(vpn(va), 2 * MEGAPAGE_PAGES);
+  for (size_t i = 0; i < n; i++) spa_put(pages[i]);
+  spa_put(page);
+  assert_int_equal(spa_available(), total);
+  assert_int_equal(user_pages, 0);
+  assert_int_equal(backing_pages, 0);
+  assert_int_equal(reserved_pages, 0);
+  assert_int_equal(megapage_tables, 0);
+  free(pages);
+}
+
+static void
+test_table_deposit() {
+  init_region();
+  size_t total = spa_available();
+  uintptr_t va = EYRIE_ANON_REGION_START;
+
+  // A megapage holds one table from when it is reserved
+  assert_int_equal(reserve_pages(vpn(va), MEGAPAGE_PAGES, FLAGS), MEGAPAGE_PAGES);
+  assert_true(megapage_tables);
+  size_t reserved = total - spa_available();
+
+  // which moves with it, and is given back with it
+  move_pages(vpn(va), vpn(va) + 2 * MEGAPAGE_PAGES, MEGAPAGE_PAGES);
+  assert_int_equal(total - spa_available(), reserved);
+  release_pages(vpn(va) + 2 * MEGAPAGE_PAGES, MEGAPAGE_PAGES);
+  free_pages(vpn(va) + 2 * MEGAPAGE_PAGES, MEGAPAGE_PAGES);
+  assert_int_equal(megapage_tables, 0);
+  assert_int_equal(spa_available(), total);
+
+  // or becomes the table of its pages when split
+  assert_int_equal(reserve_pages(vpn(va), MEGAPAGE_PAGES, FLAGS), MEGAPAGE_PAGES);
+  size_t before = spa_available();
+  free_pages(vpn(va), 1);
+  assert_int_equal(megapage_tables, 0);
+  assert_int_equal(spa_available(), before);
+  free_pages(vpn(va), MEGAPAGE_PAGES);
+  assert_int_equal(spa_available(), total);
+}
+
+static void
+test_free_partial() {
+  init_region();
+  size_t total = spa_available();
+  uintptr_t va = EYRIE_ANON_REGION_START;
+  uintptr_t block  = make_megapage(va);
+  uintptr_t block2 = make_megapage(va + MEGAPAGE);
+
+  // Across the boundary: the end of one megapage, the start of the next
+  free_pages(vpn(va) + MEGAPAGE_PAGES - 8, 16);
+  assert_int_equal(user_pages, 2 * MEGAPAGE_PAGES - 16);
+  for (size_t i = 0; i < MEGAPAGE_PAGES; i++) {
+    if (i < MEGAPAGE_PAGES - 8)
+      check_page(va, block, i);
+    else
+      assert_int_equal(translate(va + i * PAGE), 0);
+    if (i >= 8)
+      check_page(va + MEGAPAGE, block2, i);
+    else
+      assert_int_equal(translate(va + MEGAPAGE + i * PAGE), 0);
+  }
+
+  free_pages(vpn(va), 2 * MEGAPAGE_PAGES);
+  assert_int_equal(user_pages, 0);
+  assert_int_equal(spa_available(), total);
+}
+
+// Swap out the backed page at va, as the pager would
+static void
+swap_out(uintptr_t va) {
+  victim = va;
+  spa_put(__va(paging_evict_and_free_one(0)));
+}
+
+static uintptr_t
+table_of(uintptr_t va) {
+  pte* entry = __walk(root_page_table, va);
+  assert_non_null(entry);
+  return (uintptr_t)entry & ~MASK(RISCV_PAGE_BITS);
+}
+
+static void
+test_move_mixed() {
+  init_region();
+  size_t total = spa_available();
+
+  // Across two leaf tables: 4 pages at the end of one, 6 at the start of
+  // the next
+  size_t count = 10;
+  uintptr_t va = EYRIE_ANON_REGION_START + MEGAPAGE - 4 * PAGE;
+  uintptr_t to = EYRIE_ANON_REGION_START + 8 * MEGAPAGE + 2 * PAGE;
+  assert_int_equal(reserve_pages(vpn(va), count, FLAGS), count);
+
+  // Backed pages, every other one of them swapped out, demand-zero pages
+  // and, at 8, an unmapped one
+  size_t backed[] = {0, 1, 5, 6};
+  for (size_t k = 0; k < 4; k++) {
+    uintptr_t page = populate_page(va + backed[k] * PAGE);
+    assert_true(page);
+    memset((void*)page, (int)backed[k], PAGE);
+  }
+  swap_out(va + 1 * PAGE);
+  swap_out(va + 6 * PAGE);
+  free_pages(vpn(va) + 8, 1);
+  assert_int_equal(user_pages, 2);
+  assert_int_equal(backing_pages, 2);
+  assert_int_equal(reserved_pages, 5);
+
+  uintptr_t table_a = table_of(va);
+  uintptr_t table_b = table_of(va + 4 * PAGE);
+  assert_int_equal(*spa_page_count(table_a), 4);
+  assert_int_equal(*spa_page_count(table_b), 5);
+
+  pte before[10];
+  for (size_t i = 0; i < count; i++) {
+    before[i] = *__walk(root_page_table, va + i * PAGE);
+  }
+  size_t available = spa_available();
+
+  // Every PTE moves as it was, and the emptied tables go back
+  move_pages(vpn(va), vpn(to), count);
+  for (size_t i = 0; i < count; i++) {
+    assert_int_equal(*__walk(root_page_table, to + i * PAGE), before[i]);
+  }
+  // and the resident pages are still there
+  for (size_t k = 0; k < 4; k += 2) {
+    uintptr_t pa = translate(to + backed[k] * PAGE);
+    assert_true(pa);
+    assert_int_equal(*(uint8_t*)__va(pa), (uint8_t)backed[k]);
+  }
+  assert_int_equal(*spa_page_count(table_of(to)), 9);
+
+  int level;
+  assert_null(__walk_leaf(root_page_table, va, &level));
+  assert_null(__walk_leaf(root_page_table, va + 4 * PAGE, &level));
+  assert_int_equal(spa_available(), available + 1);
+  assert_int_equal(spa_get_zero_hot(SPA_HOT_PAGE_TABLE), table_b);
+  assert_int_equal(spa_get_zero_hot(SPA_HOT_PAGE_TABLE), table_a);
+  spa_put_hot(table_a, SPA_HOT_PAGE_TABLE);
+  spa_put_hot(table_b, SPA_HOT_PAGE_TABLE);
+
+  assert_int_equal(user_pages, 2);
+  assert_int_equal(backing_pages, 2);
+  assert_int_equal(reserved_pages, 5);
+
+  free_pages(vpn(to), count);
+  assert_int_equal(user_pages, 0);
+  assert_int_equal(backing_pages, 0);
+  assert_int_equal(reserved_pages, 0);
+  assert_int_equal(spa_available(), total);
+}
+
+static void
+test_protect() {
+  init_region();
+  size_t total = spa_available();
+
+  // A resident, a swapped out and a demand-zero page, in a leaf table
+  uintptr_t va = EYRIE_ANON_REGION_START + 4 * PAGE;
+  assert_int_equal(reserve_pages(vpn(va), 3, FLAGS), 3);
+  uintptr_t page = populate_page(va);
+  assert_true(page);
+  memset((void*)page, 0x5a, PAGE);
+  assert_true(populate_page(va + PAGE));
+  swap_out(va + PAGE);
+  assert_int_equal(user_pages, 1);
+  pte* ptes      = __walk(root_page_table, va);
+  uintptr_t ppn  = pte_ppn(ptes[0]);
+  uintptr_t slot = pte_ppn(ptes[1]);
+
+  // Resident without permissions: kept, but not a user page the pager may
+  // take
+  protect_pages(vpn(va), 1, PTE_U);
+  assert_int_equal(user_pages, 0);
+  assert_int_equal(ptes[0], pte_create_invalid(ppn, PTE_U | PTE_PROTNONE));
+
+  // and a user page again once it has some
+  protect_pages(vpn(va), 1, PTE_U | PTE_R | PTE_W);
+  assert_int_equal(user_pages, 1);
+  assert_int_equal(ptes[0], pte_create(ppn, PTE_U | PTE_R | PTE_W));
+  assert_int_equal(*(uint8_t*)page, 0x5a);
+
+  // Swapped out: stays in its backing page, to come back read-only
+  protect_pages(vpn(va) + 1, 1, PTE_U | PTE_R);
+  assert_int_equal(user_pages, 1);
+  assert_int_equal(ptes[1], pte_create_invalid(slot, PTE_U | PTE_R));
+
+  // Demand-zero: stays unbacked
+  protect_pages(vpn(va) + 2, 1, PTE_U);
+  assert_int_equal(user_pages, 1);
+  assert_int_equal(reserved_pages, 1);
+  assert_int_equal(ptes[2], PTE_U | PTE_DZ);
+
+  free_pages(vpn(va), 3);
+  assert_int_equal(user_pages, 0);
+  assert_int_equal(backing_pages, 0);
+  assert_int_equal(reserved_pages, 0);
+  assert_int_equal(spa_available(), total);
+}
+
+int
+main() {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_split_exhausted),
+      cmocka_unit_test(test_table_deposit),
+      cmocka_unit_test(test_free_partial),
+      cmocka_unit_test(test_move_mixed),
+      cmocka_unit_test(test_protect),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -58,6 +58,16 @@ paging_backing_region_size() {
   return BACKING_REGION_SIZE;
 }
 
+// Enclave memory for the freed backing page bits
+uintptr_t
+spa_get_zero() {
+  void* out = mmap(
+      NULL, RISCV_PAGE_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert_int_not_equal(out, MAP_FAILED);
+  return (uintptr_t)out;
+}
+
 static uintptr_t
 palloc() {
   void* out = mmap(
@@ -165,11 +175,43 @@ test_swap_out_in() {
   pfree(front_page);
 }
 
+void
+test_backing_pages_reused() {
+  pswap_init();
+  size_t num = paging_remaining_pages();
+  uintptr_t* pages = (uintptr_t*)malloc(sizeof(uintptr_t) * num);
+
+  for (size_t i = 0; i < num; i++) {
+    pages[i] = paging_alloc_backing_page();
+    assert_true(paging_backpage_inbounds(pages[i]));
+  }
+  assert_int_equal(paging_remaining_pages(), 0);
+  assert_int_equal(paging_alloc_backing_page(), 0);
+
+  // Every page freed is counted and handed out again, once
+  for (size_t i = 0; i < num; i++) paging_free_backing_page(pages[num - 1 - i]);
+  assert_int_equal(paging_remaining_pages(), num);
+
+  uint8_t* seen = (uint8_t*)calloc(BACKING_REGION_SIZE / RISCV_PAGE_SIZE, 1);
+  for (size_t i = 0; i < num; i++) {
+    uintptr_t page = paging_alloc_backing_page();
+    assert_true(paging_backpage_inbounds(page));
+    size_t idx = (page - paging_backing_region()) / RISCV_PAGE_SIZE;
+    assert_false(seen[idx]);
+    seen[idx] = 1;
+  }
+  assert_int_equal(paging_remaining_pages(), 0);
+
+  free(seen);
+  free(pages);
+}
+
 int
 main() {
   const struct CMUnitTest tests[] = {
       cmocka_unit_test(test_swapout_randomness),
       cmocka_unit_test(test_swap_out_in),
+      cmocka_unit_test(test_backing_pages_reused),
   };
   return cmocka_run_group_tests(tests, NULL, NULL);
 }
\ No newline at end of file
@@ -0,0 +1,357 @@
+#define _GNU_SOURCE
+
+#include "../smt_merkle.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+
+#include "../smt_merkle.c"
+#include "mock.h"
+
+void
+sbi_exit_enclave(uintptr_t code) {
+  exit(code);
+}
+
+uintptr_t
+paging_alloc_backing_page() {
+  void* out = mmap(
+      NULL, 4096, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  assert_int_not_equal(out, MAP_FAILED);
+  return (uintptr_t)out;
+}
+
+void
+paging_free_backing_page(uintptr_t page) {
+  assert_int_equal(munmap((void*)page, 4096), 0);
+}
+
+#define NUM_SLOTS (1 << 16)
+#define NUM_KEYS 2000
+
+static void
+slot_hash(size_t slot, uint8_t gen, uint8_t hash[32]) {
+  SHA256_CTX sha;
+  sha256_init(&sha);
+  sha256_update(&sha, (const uint8_t*)&slot, sizeof(slot));
+  sha256_update(&sha, &gen, 1);
+  sha256_final(&sha, hash);
+}
+
+static size_t*
+random_slots(size_t num) {
+  size_t* slots = (size_t*)malloc(sizeof(size_t) * num);
+  for (size_t i = 0; i < num; i++) {
+    slots[i] = rand() % NUM_SLOTS;
+  }
+  return slots;
+}
+
+// Follow the path to slot without checking anything
+static smt_merkle_node_t*
+find_leaf(smt_merkle_node_t* root, size_t slot) {
+  smt_merkle_node_t* node = root;
+  for (int h = root->depth; h > 0 && node; h--) {
+    node = node->children[(slot >> (h - 1)) & 1];
+  }
+  return node;
+}
+
+// The last failure passed to the violation hook
+static merk_status_t reported_status;
+static uintptr_t reported_key;
+
+static void
+record_violation(merk_status_t status, uintptr_t key) {
+  reported_status = status;
+  reported_key    = key;
+}
+
+static void
+test_init_depth() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, 1);
+  assert_int_equal(root.depth, 1);
+  smt_merk_init(&root, NUM_SLOTS);
+  assert_int_equal(root.depth, 16);
+  smt_merk_init(&root, NUM_SLOTS + 1);
+  assert_int_equal(root.depth, 17);
+
+  // An empty tree's root is the default for its height
+  assert_memory_equal(root.hash, smt_default_hash[17], 32);
+  assert_null(root.children[0]);
+  assert_null(root.children[1]);
+}
+
+static void
+test_verify_nonexistant() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, NUM_SLOTS);
+
+  uint8_t hash[32] = {0};
+  assert_false(smt_merk_verify(&root, 0, hash));
+  assert_false(smt_merk_verify(&root, NUM_SLOTS - 1, hash));
+
+  slot_hash(5, 0, hash);
+  smt_merk_insert(&root, 5, hash);
+  assert_false(smt_merk_verify(&root, 4, hash));
+  assert_false(smt_merk_verify(&root, 6, hash));
+}
+
+static void
+test_insert_and_verify_1() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, NUM_SLOTS);
+
+  uint8_t hash[32];
+  slot_hash(1234, 0, hash);
+  assert_int_equal(smt_merk_insert(&root, 1234, hash), 0);
+  assert_true(smt_merk_verify(&root, 1234, hash));
+}
+
+static void
+test_edge_slots() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, NUM_SLOTS);
+
+  uint8_t hash_lo[32], hash_hi[32];
+  slot_hash(0, 0, hash_lo);
+  slot_hash(NUM_SLOTS - 1, 0, hash_hi);
+  assert_int_equal(smt_merk_insert(&root, 0, hash_lo), 0);
+  assert_int_equal(smt_merk_insert(&root, NUM_SLOTS - 1, hash_hi), 0);
+  assert_true(smt_merk_verify(&root, 0, hash_lo));
+  assert_true(smt_merk_verify(&root, NUM_SLOTS - 1, hash_hi));
+  assert_false(smt_merk_verify(&root, 0, hash_hi));
+}
+
+static void
+test_overwrite() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, NUM_SLOTS);
+
+  uint8_t old_hash[32], new_hash[32];
+  slot_hash(77, 0, old_hash);
+  slot_hash(77, 1, new_hash);
+  smt_merk_insert(&root, 77, old_hash);
+  smt_merk_insert(&root, 77, new_hash);
+  assert_false(smt_merk_verify(&root, 77, old_hash));
+  assert_true(smt_merk_verify(&root, 77, new_hash));
+}
+
+static void
+test_insert_and_verify_many() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, NUM_SLOTS);
+
+  size_t* slots = random_slots(NUM_KEYS);
+  uint8_t hash[32];
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    slot_hash(slots[i], 0, hash);
+    assert_int_equal(smt_merk_insert(&root, slots[i], hash), 0);
+  }
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    slot_hash(slots[i], 0, hash);
+    assert_true(smt_merk_verify(&root, slots[i], hash));
+  }
+  free(slots);
+}
+
+static void
+test_order_independent() {
+  // The root depends only on the contents, not on the insert order
+  smt_merkle_node_t fwd, rev;
+  smt_merk_init(&fwd, NUM_SLOTS);
+  smt_merk_init(&rev, NUM_SLOTS);
+
+  size_t* slots = random_slots(NUM_KEYS);
+  uint8_t hash[32];
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    slot_hash(slots[i], 0, hash);
+    smt_merk_insert(&fwd, slots[i], hash);
+    slot_hash(slots[NUM_KEYS - 1 - i], 0, hash);
+    smt_merk_insert(&rev, slots[NUM_KEYS - 1 - i], hash);
+  }
+  assert_memory_equal(fwd.hash, rev.hash, 32);
+  free(slots);
+}
+
+static size_t
+count_nodes(smt_merkle_node_t* node) {
+  if (!node) return 0;
+  return 1 + count_nodes(node->children[0]) + count_nodes(node->children[1]);
+}
+
+static void
+test_fixed_cost() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, NUM_SLOTS);
+  uint8_t hash[32];
+
+  // A first insert materializes exactly one node per level below the root,
+  // an insert next to it only its own leaf, and an overwrite nothing
+  slot_hash(9, 0, hash);
+  smt_merk_insert(&root, 9, hash);
+  assert_int_equal(count_nodes(&root), 1 + root.depth);
+
+  slot_hash(8, 0, hash);
+  smt_merk_insert(&root, 8, hash);
+  assert_int_equal(count_nodes(&root), 2 + root.depth);
+
+  slot_hash(9, 1, hash);
+  smt_merk_insert(&root, 9, hash);
+  assert_int_equal(count_nodes(&root), 2 + root.depth);
+}
+
+static void
+test_poison_data() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, NUM_SLOTS);
+
+  size_t* slots = random_slots(NUM_KEYS);
+  uint8_t hash[32];
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    slot_hash(slots[i], 0, hash);
+    smt_merk_insert(&root, slots[i], hash);
+  }
+
+  size_t slot = slots[rand() % NUM_KEYS];
+  slot_hash(slot, 0, hash);
+  hash[rand() & 31] ^= 1 << (rand() & 7);
+  reported_status = MERK_OK;
+  assert_false(smt_merk_verify(&root, slot, hash));
+  assert_int_equal(reported_status, MERK_HASH_MISMATCH);
+  assert_int_equal(reported_key, slot);
+  free(slots);
+}
+
+static void
+test_poison_node() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, NUM_SLOTS);
+
+  size_t* slots = random_slots(NUM_KEYS);
+  uint8_t hash[32];
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    slot_hash(slots[i], 0, hash);
+    smt_merk_insert(&root, slots[i], hash);
+  }
+
+  // Tamper with the stored leaf and then present it as the expected hash;
+  // both verify and insert must notice
+  size_t slot             = slots[rand() % NUM_KEYS];
+  smt_merkle_node_t* leaf = find_leaf(&root, slot);
+  assert_non_null(leaf);
+  leaf->hash[rand() & 31] ^= 1 << (rand() & 7);
+  reported_status = MERK_OK;
+  assert_false(smt_merk_verify(&root, slot, leaf->hash));
+  assert_int_equal(reported_status, MERK_TAMPERED);
+
+  slot_hash(slot, 1, hash);
+  reported_status = MERK_OK;
+  assert_int_equal(smt_merk_insert(&root, slot, hash), -1);
+  assert_int_equal(reported_status, MERK_TAMPERED);
+  free(slots);
+}
+
+// Hashes for the run of slots first, first + 1, ...
+static uint8_t (*run_hashes(size_t first, size_t n, uint8_t gen))[32] {
+  uint8_t(*hashes)[32] = (uint8_t(*)[32])malloc(32 * n);
+  for (size_t i = 0; i < n; i++) slot_hash(first + i, gen, hashes[i]);
+  return hashes;
+}
+
+static void
+test_range() {
+  smt_merkle_node_t root, single;
+  smt_merk_init(&root, NUM_SLOTS);
+  smt_merk_init(&single, NUM_SLOTS);
+  uint8_t(*hashes)[32] = run_hashes(1000, NUM_KEYS, 0);
+
+  // An update over empty slots builds the same tree as inserting them
+  assert_int_equal(smt_merk_update_range(&root, 1000, NUM_KEYS, hashes), 0);
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    smt_merk_insert(&single, 1000 + i, hashes[i]);
+  }
+  assert_memory_equal(root.hash, single.hash, 32);
+
+  assert_true(smt_merk_verify_range(&root, 1000, NUM_KEYS, hashes));
+  assert_true(smt_merk_verify_range(&root, 1500, 10, hashes + 500));
+  assert_false(smt_merk_verify_range(&root, 999, NUM_KEYS, hashes));
+  assert_false(smt_merk_verify_range(&root, 1001, NUM_KEYS, hashes + 1));
+
+  // Then over a run that is partly present
+  uint8_t(*new_hashes)[32] = run_hashes(900, NUM_KEYS, 1);
+  assert_int_equal(smt_merk_update_range(&root, 900, NUM_KEYS, new_hashes), 0);
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    smt_merk_insert(&single, 900 + i, new_hashes[i]);
+  }
+  assert_memory_equal(root.hash, single.hash, 32);
+  assert_true(smt_merk_verify_range(&root, 900, NUM_KEYS, new_hashes));
+  assert_true(smt_merk_verify_range(&root, 900 + NUM_KEYS, 100, hashes + 1900));
+
+  // A tampered leaf is caught by both
+  smt_merkle_node_t* leaf = find_leaf(&root, 1234);
+  leaf->hash[rand() & 31] ^= 1 << (rand() & 7);
+  memcpy(new_hashes[1234 - 900], leaf->hash, 32);
+  assert_false(smt_merk_verify_range(&root, 1200, 100, new_hashes + 300));
+  assert_int_equal(smt_merk_update_range(&root, 1200, 100, new_hashes + 300), -1);
+
+  free(hashes);
+  free(new_hashes);
+}
+
+static void
+test_null_children() {
+  smt_merkle_node_t root;
+  smt_merk_init(&root, NUM_SLOTS);
+  uint8_t(*hashes)[32] = run_hashes(1000, NUM_KEYS, 0);
+  for (size_t i = 0; i < NUM_KEYS; i++) {
+    smt_merk_insert(&root, 1000 + i, hashes[i]);
+  }
+  uint8_t root_hash[32];
+  memcpy(root_hash, root.hash, 32);
+
+  // Make a populated interior node look like an empty subtree
+  smt_merkle_node_t* node = root.children[0];
+  for (int h = root.depth - 1; h > 4; h--) {
+    node = node->children[(1000 >> (h - 1)) & 1];
+  }
+  node->children[0] = node->children[1] = NULL;
+
+  reported_status = MERK_OK;
+  assert_false(smt_merk_verify(&root, 1000, hashes[0]));
+  assert_int_equal(reported_status, MERK_TAMPERED);
+
+  // Neither insert nor a range update may build over it
+  reported_status = MERK_OK;
+  assert_int_equal(smt_merk_insert(&root, 1001, hashes[0]), -1);
+  assert_int_equal(reported_status, MERK_TAMPERED);
+  reported_status = MERK_OK;
+  assert_int_equal(smt_merk_update_range(&root, 1000, 16, hashes), -1);
+  assert_int_equal(reported_status, MERK_TAMPERED);
+  assert_memory_equal(root.hash, root_hash, 32);
+
+  free(hashes);
+}
+
+int
+main() {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_init_depth),
+      cmocka_unit_test(test_verify_nonexistant),
+      cmocka_unit_test(test_insert_and_verify_1),
+      cmocka_unit_test(test_edge_slots),
+      cmocka_unit_test(test_overwrite),
+      cmocka_unit_test(test_insert_and_verify_many),
+      cmocka_unit_test(test_order_independent),
+      cmocka_unit_test(test_fixed_cost),
+      cmocka_unit_test(test_poison_data),
+      cmocka_unit_test(test_poison_node),
+      cmocka_unit_test(test_range),
+      cmocka_unit_test(test_null_children),
+  };
+  merk_set_violation_hook(record_violation);
+
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
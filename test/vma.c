@@ -0,0 +1,303 @@
+#include "../vma.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../vma.c"
+#include "mock.h"
+
+void
+sbi_exit_enclave(uintptr_t code) {
+  exit(code);
+}
+
+static int cached_vmas;
+
+void*
+spa_cache_alloc(struct spa_cache* cache) {
+  cached_vmas++;
+  return calloc(1, cache->size);
+}
+
+void
+spa_cache_free(struct spa_cache* cache, void* obj) {
+  (void)cache;
+  cached_vmas--;
+  free(obj);
+}
+
+#define BASE 0x100000ul
+#define PAGES 2048
+#define PAGE RISCV_PAGE_SIZE
+
+// What the tree should hold, a page at a time: 0 for unmapped, else the
+// prot of the page
+static int model[PAGES];
+
+static uintptr_t
+page_addr(size_t i) {
+  return BASE + i * PAGE;
+}
+
+static void
+reset(void) {
+  vma_remove(0, -PAGE);
+  assert_null(vma_root);
+  assert_int_equal(cached_vmas, 0);
+  memset(model, 0, sizeof(model));
+}
+
+// Check the subtree of v and return how many VMAs it holds
+static size_t
+check_subtree(struct vma* v) {
+  if (!v) return 0;
+
+  size_t n = 1 + check_subtree(v->left) + check_subtree(v->right);
+  if (v->left) assert_true(v->left->priority <= v->priority);
+  if (v->right) assert_true(v->right->priority <= v->priority);
+
+  uintptr_t min_start = v->left ? v->left->min_start : v->start;
+  uintptr_t max_end   = v->right ? v->right->max_end : v->end;
+  assert_int_equal(v->min_start, min_start);
+  assert_int_equal(v->max_end, max_end);
+  return n;
+}
+
+// Compare the tree with the model
+static void
+check(void) {
+  size_t n     = check_subtree(vma_root);
+  size_t runs  = 0;
+  size_t i     = 0;
+  uintptr_t gap = 0;
+  uintptr_t last_end = 0;
+
+  while (i < PAGES) {
+    if (!model[i]) {
+      assert_null(vma_find(page_addr(i)));
+      i++;
+      continue;
+    }
+    size_t j = i;
+    while (j < PAGES && model[j] == model[i]) j++;
+
+    struct vma* v = vma_find(page_addr(i));
+    assert_non_null(v);
+    assert_int_equal(v->start, page_addr(i));
+    assert_int_equal(v->end, page_addr(j));
+    assert_int_equal(v->prot, model[i]);
+    assert_int_equal(vma_find(page_addr(j) - 1), v);
+    assert_int_equal(vma_next(page_addr(i)), v);
+
+    if (runs && v->start - last_end > gap) gap = v->start - last_end;
+    last_end = v->end;
+    runs++;
+    i = j;
+  }
+  assert_int_equal(n, runs);
+  assert_int_equal(cached_vmas, runs);
+  if (vma_root) assert_int_equal(vma_root->max_gap, gap);
+}
+
+// The lowest page from first where len pages are unmapped, the slow way
+static uintptr_t
+model_gap(size_t first, size_t len) {
+  size_t run = 0;
+  for (size_t i = first; i < PAGES; i++) {
+    run = model[i] ? 0 : run + 1;
+    if (run == len) return page_addr(i + 1 - len);
+  }
+  return 0;
+}
+
+static void
+test_insert_merge() {
+  reset();
+
+  assert_int_equal(vma_insert(page_addr(10), page_addr(20), 1, VMA_ANON), 0);
+  for (int i = 10; i < 20; i++) model[i] = 1;
+  check();
+
+  // Adjacent with the same prot: one VMA
+  assert_int_equal(vma_insert(page_addr(20), page_addr(25), 1, VMA_ANON), 0);
+  assert_int_equal(vma_insert(page_addr(5), page_addr(10), 1, VMA_ANON), 0);
+  for (int i = 5; i < 25; i++) model[i] = 1;
+  check();
+  assert_int_equal(cached_vmas, 1);
+
+  // or a different one
+  assert_int_equal(vma_insert(page_addr(25), page_addr(30), 2, VMA_ANON), 0);
+  for (int i = 25; i < 30; i++) model[i] = 2;
+  check();
+
+  // or the same prot but another use
+  assert_int_equal(vma_insert(page_addr(30), page_addr(31), 2, VMA_HEAP), 0);
+  assert_int_equal(cached_vmas, 3);
+  assert_int_equal(vma_find(page_addr(30))->flags, VMA_HEAP);
+
+  // Filling a hole joins both sides
+  vma_remove(page_addr(30), page_addr(31));
+  assert_int_equal(vma_insert(page_addr(31), page_addr(40), 2, VMA_ANON), 0);
+  assert_int_equal(vma_insert(page_addr(30), page_addr(31), 2, VMA_ANON), 0);
+  for (int i = 30; i < 40; i++) model[i] = 2;
+  check();
+  assert_int_equal(cached_vmas, 2);
+}
+
+static void
+test_remove() {
+  reset();
+  vma_insert(page_addr(0), page_addr(100), 1, VMA_ANON);
+  for (int i = 0; i < 100; i++) model[i] = 1;
+
+  // Punch a hole
+  assert_int_equal(vma_remove(page_addr(40), page_addr(60)), 0);
+  for (int i = 40; i < 60; i++) model[i] = 0;
+  check();
+
+  // Trim both ends
+  assert_int_equal(vma_remove(page_addr(0), page_addr(10)), 0);
+  assert_int_equal(vma_remove(page_addr(90), page_addr(200)), 0);
+  for (int i = 0; i < 10; i++) model[i] = 0;
+  for (int i = 90; i < 100; i++) model[i] = 0;
+  check();
+
+  // Across several VMAs
+  assert_int_equal(vma_remove(page_addr(20), page_addr(70)), 0);
+  for (int i = 20; i < 70; i++) model[i] = 0;
+  check();
+  assert_int_equal(cached_vmas, 2);
+
+  // Nothing there
+  assert_int_equal(vma_remove(page_addr(500), page_addr(600)), 0);
+  check();
+}
+
+static void
+test_find_gap() {
+  reset();
+  assert_int_equal(vma_find_gap(page_addr(0), page_addr(PAGES), PAGE), page_addr(0));
+
+  vma_insert(page_addr(0), page_addr(4), 1, VMA_ANON);
+  vma_insert(page_addr(6), page_addr(10), 2, VMA_ANON);
+  vma_insert(page_addr(13), page_addr(20), 1, VMA_ANON);
+  assert_int_equal(vma_find_gap(page_addr(0), page_addr(PAGES), 2 * PAGE), page_addr(4));
+  assert_int_equal(vma_find_gap(page_addr(0), page_addr(PAGES), 3 * PAGE), page_addr(10));
+  assert_int_equal(vma_find_gap(page_addr(0), page_addr(PAGES), 4 * PAGE), page_addr(20));
+  // From the middle of a hole
+  assert_int_equal(vma_find_gap(page_addr(11), page_addr(PAGES), 2 * PAGE), page_addr(11));
+  assert_int_equal(vma_find_gap(page_addr(12), page_addr(PAGES), 2 * PAGE), page_addr(20));
+  // Not before hi
+  assert_int_equal(vma_find_gap(page_addr(0), page_addr(22), 4 * PAGE), 0);
+  assert_int_equal(vma_find_gap(page_addr(0), page_addr(24), 4 * PAGE), page_addr(20));
+  assert_int_equal(vma_find_gap(page_addr(0), page_addr(PAGES), 0), 0);
+}
+
+static void
+test_protect() {
+  reset();
+  vma_insert(page_addr(0), page_addr(10), 1, VMA_ANON);
+  vma_insert(page_addr(10), page_addr(20), 2, VMA_ANON);
+  vma_insert(page_addr(20), page_addr(30), 1, VMA_HEAP);
+  for (int i = 0; i < 10; i++) model[i] = 1;
+  for (int i = 10; i < 20; i++) model[i] = 2;
+  for (int i = 20; i < 30; i++) model[i] = 1;
+
+  assert_true(vma_mapped(page_addr(0), page_addr(30)));
+  assert_false(vma_mapped(page_addr(25), page_addr(31)));
+
+  // The middle of one VMA: it splits in three
+  assert_int_equal(vma_protect(page_addr(3), page_addr(5), 2), 0);
+  model[3] = model[4] = 2;
+  check();
+  assert_int_equal(cached_vmas, 5);
+
+  // Back again: it merges
+  assert_int_equal(vma_protect(page_addr(3), page_addr(5), 1), 0);
+  model[3] = model[4] = 1;
+  check();
+  assert_int_equal(cached_vmas, 3);
+
+  // Across VMAs, joining with the next one but not the heap
+  assert_int_equal(vma_protect(page_addr(5), page_addr(25), 2), 0);
+  assert_int_equal(cached_vmas, 4);
+  assert_int_equal(vma_find(page_addr(5))->start, page_addr(5));
+  assert_int_equal(vma_find(page_addr(5))->end, page_addr(20));
+  assert_int_equal(vma_find(page_addr(22))->flags, VMA_HEAP);
+  assert_int_equal(vma_find(page_addr(22))->prot, 2);
+  assert_int_equal(vma_find(page_addr(22))->end, page_addr(25));
+  assert_int_equal(vma_find(page_addr(25))->prot, 1);
+}
+
+static void
+test_advise() {
+  reset();
+  vma_insert(page_addr(0), page_addr(20), 1, VMA_ANON);
+
+  assert_int_equal(vma_advise(page_addr(5), page_addr(10), VMA_SEQUENTIAL, 0), 0);
+  assert_int_equal(cached_vmas, 3);
+  struct vma* v = vma_find(page_addr(5));
+  assert_int_equal(v->start, page_addr(5));
+  assert_int_equal(v->end, page_addr(10));
+  assert_int_equal(v->flags, VMA_ANON | VMA_SEQUENTIAL);
+  assert_int_equal(v->prot, 1);
+  assert_int_equal(vma_find(page_addr(10))->flags, VMA_ANON);
+
+  // Clearing it again merges all three
+  assert_int_equal(vma_advise(page_addr(0), page_addr(20), 0, VMA_SEQUENTIAL), 0);
+  for (int i = 0; i < 20; i++) model[i] = 1;
+  check();
+  assert_int_equal(cached_vmas, 1);
+}
+
+static void
+test_random() {
+  reset();
+  srand(42);
+
+  for (int round = 0; round < 20000; round++) {
+    size_t len = 1 + rand() % 16;
+    size_t first = rand() % PAGES;
+
+    if (rand() % 4 == 0) {
+      if (first + len > PAGES) len = PAGES - first;
+      int mapped = 1;
+      for (size_t i = first; i < first + len; i++) mapped &= model[i] != 0;
+      assert_int_equal(vma_mapped(page_addr(first), page_addr(first + len)), mapped);
+      if (!mapped) continue;
+
+      int prot = 1 + rand() % 2;
+      assert_int_equal(vma_protect(page_addr(first), page_addr(first + len), prot), 0);
+      for (size_t i = first; i < first + len; i++) model[i] = prot;
+    } else if (rand() % 3) {
+      uintptr_t addr = vma_find_gap(page_addr(first), page_addr(PAGES), len * PAGE);
+      assert_int_equal(addr, model_gap(first, len));
+      if (!addr) continue;
+
+      int prot = 1 + rand() % 2;
+      assert_int_equal(vma_insert(addr, addr + len * PAGE, prot, VMA_ANON), 0);
+      size_t p = (addr - BASE) / PAGE;
+      for (size_t i = p; i < p + len; i++) model[i] = prot;
+    } else {
+      if (first + len > PAGES) len = PAGES - first;
+      assert_int_equal(vma_remove(page_addr(first), page_addr(first + len)), 0);
+      for (size_t i = first; i < first + len; i++) model[i] = 0;
+    }
+
+    if (round % 64 == 0) check();
+  }
+  check();
+}
+
+int
+main() {
+  const struct CMUnitTest tests[] = {
+      cmocka_unit_test(test_insert_merge),
+      cmocka_unit_test(test_remove),
+      cmocka_unit_test(test_find_gap),
+      cmocka_unit_test(test_protect),
+      cmocka_unit_test(test_advise),
+      cmocka_unit_test(test_random),
+  };
+  return cmocka_run_group_tests(tests, NULL, NULL);
+}
@@ -60,6 +60,8 @@
 #define PTE_G 0x020  // Global
 #define PTE_A 0x040  // Accessed
 #define PTE_D 0x080  // Dirty
+#define PTE_DZ 0x100 // Software: demand-zero, backed on first touch
+#define PTE_PROTNONE 0x200 // Software: backed, but not valid (PROT_NONE)
 #define PTE_FLAG_MASK 0x3ff
 #define PTE_PPN_SHIFT 10
 
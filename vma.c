@@ -0,0 +1,369 @@
+#include "common.h"
+#include "freemem.h"
+#include "vm_defs.h"
+#include "vma.h"
+
+#ifdef USE_FREEMEM
+
+/* The VMAs are kept in a treap ordered by start address. Since they never
+ * overlap, that also orders their ends, so a lookup is one descent. Each
+ * node also knows the first start and last end of its subtree, and the
+ * widest hole between two VMAs of the subtree; the gap search skips every
+ * subtree whose holes are too small, so finding room for a mapping is
+ * O(log n) rather than a probe of every page.
+ *
+ * Priorities come from a fixed xorshift sequence; they only need to be
+ * unrelated to the addresses. Records come from their own object cache. */
+
+static struct spa_cache vma_cache = SPA_CACHE_INIT("vma", struct vma, NULL);
+
+static struct vma* vma_root;
+static uint32_t vma_seed = 2463534242u;
+
+static uint32_t
+vma_random(void)
+{
+  vma_seed ^= vma_seed << 13;
+  vma_seed ^= vma_seed >> 17;
+  vma_seed ^= vma_seed << 5;
+  return vma_seed;
+}
+
+static inline uintptr_t
+vma_max(uintptr_t a, uintptr_t b)
+{
+  return a > b ? a : b;
+}
+
+static void
+vma_update(struct vma* v)
+{
+  struct vma* l = v->left;
+  struct vma* r = v->right;
+
+  v->min_start = l ? l->min_start : v->start;
+  v->max_end = r ? r->max_end : v->end;
+  v->max_gap = 0;
+  if (l)
+    v->max_gap = vma_max(l->max_gap, v->start - l->max_end);
+  if (r)
+    v->max_gap = vma_max(v->max_gap,
+                         vma_max(r->max_gap, r->min_start - v->end));
+}
+
+/* split t into the VMAs that start below addr (*l) and the others (*r) */
+static void
+vma_split(struct vma* t, uintptr_t addr, struct vma** l, struct vma** r)
+{
+  if (!t) {
+    *l = *r = NULL;
+    return;
+  }
+
+  if (t->start < addr) {
+    vma_split(t->right, addr, &t->right, r);
+    *l = t;
+  } else {
+    vma_split(t->left, addr, l, &t->left);
+    *r = t;
+  }
+  vma_update(t);
+}
+
+/* join two treaps, where all of a is below all of b */
+static struct vma*
+vma_join(struct vma* a, struct vma* b)
+{
+  if (!a)
+    return b;
+  if (!b)
+    return a;
+
+  if (a->priority > b->priority) {
+    a->right = vma_join(a->right, b);
+    vma_update(a);
+    return a;
+  }
+  b->left = vma_join(a, b->left);
+  vma_update(b);
+  return b;
+}
+
+static void
+vma_link(struct vma* v)
+{
+  struct vma *l, *r;
+
+  v->left = v->right = NULL;
+  v->priority = vma_random();
+  vma_update(v);
+
+  vma_split(vma_root, v->start, &l, &r);
+  vma_root = vma_join(vma_join(l, v), r);
+}
+
+static void
+vma_unlink(struct vma* v)
+{
+  struct vma *l, *m, *r;
+
+  vma_split(vma_root, v->start, &l, &r);
+  vma_split(r, v->start + 1, &m, &r);
+  assert(m == v && !v->left && !v->right);
+  vma_root = vma_join(l, r);
+}
+
+struct vma*
+vma_find(uintptr_t addr)
+{
+  struct vma* t = vma_root;
+
+  while (t) {
+    if (addr < t->start)
+      t = t->left;
+    else if (addr >= t->end)
+      t = t->right;
+    else
+      return t;
+  }
+  return NULL;
+}
+
+struct vma*
+vma_next(uintptr_t addr)
+{
+  struct vma* t = vma_root;
+  struct vma* next = NULL;
+
+  while (t) {
+    if (t->end > addr) {
+      next = t;
+      t = t->left;
+    } else {
+      t = t->right;
+    }
+  }
+  return next;
+}
+
+/* lowest address from lo where len bytes fit before the next VMA of t, or
+ * else the first address after both lo and all of t */
+static uintptr_t
+vma_gap_in(struct vma* t, uintptr_t lo, size_t len)
+{
+  uintptr_t addr;
+
+  if (!t || t->max_end <= lo || lo + len <= t->min_start)
+    return lo;
+
+  /* no hole in here is wide enough */
+  if (t->max_gap < len)
+    return vma_max(lo, t->max_end);
+
+  addr = vma_gap_in(t->left, lo, len);
+  if (addr + len <= t->start)
+    return addr;
+  return vma_gap_in(t->right, vma_max(addr, t->end), len);
+}
+
+uintptr_t
+vma_find_gap(uintptr_t lo, uintptr_t hi, size_t len)
+{
+  uintptr_t addr;
+
+  if (!len || lo + len < lo)
+    return 0;
+
+  addr = vma_gap_in(vma_root, lo, len);
+  if (addr + len < addr || addr + len > hi)
+    return 0;
+  return addr;
+}
+
+int
+vma_insert(uintptr_t start, uintptr_t end, int prot, int flags)
+{
+  struct vma *v = NULL, *prev, *next;
+
+  assert(IS_ALIGNED(start, RISCV_PAGE_BITS) && IS_ALIGNED(end, RISCV_PAGE_BITS));
+  assert(start < end);
+  next = vma_next(start);
+  assert(!next || next->start >= end);
+
+  /* grow a neighbour with the same prot and flags instead */
+  prev = start ? vma_find(start - 1) : NULL;
+  if (prev && (prev->prot != prot || prev->flags != flags))
+    prev = NULL;
+  if (next && (next->start != end || next->prot != prot || next->flags != flags))
+    next = NULL;
+
+  if (prev) {
+    vma_unlink(prev);
+    start = prev->start;
+    v = prev;
+  }
+  if (next) {
+    vma_unlink(next);
+    end = next->end;
+    if (v)
+      spa_cache_free(&vma_cache, next);
+    else
+      v = next;
+  }
+  if (!prev && !next) {
+    v = (struct vma*)spa_cache_alloc(&vma_cache);
+    if (!v)
+      return -1;
+  }
+
+  v->start = start;
+  v->end = end;
+  v->prot = prot;
+  v->flags = flags;
+  vma_link(v);
+  return 0;
+}
+
+int
+vma_remove(uintptr_t start, uintptr_t end)
+{
+  struct vma* v;
+
+  assert(IS_ALIGNED(start, RISCV_PAGE_BITS) && IS_ALIGNED(end, RISCV_PAGE_BITS));
+
+  while ((v = vma_next(start)) && v->start < end) {
+    /* a hole in the middle: both ends stay */
+    if (v->start < start && v->end > end) {
+      struct vma* tail = (struct vma*)spa_cache_alloc(&vma_cache);
+      if (!tail)
+        return -1;
+
+      vma_unlink(v);
+      *tail = *v;
+      tail->start = end;
+      v->end = start;
+      vma_link(v);
+      vma_link(tail);
+      return 0;
+    }
+
+    vma_unlink(v);
+    if (v->start < start) {
+      v->end = start;
+      vma_link(v);
+    } else if (v->end > end) {
+      v->start = end;
+      vma_link(v);
+    } else {
+      spa_cache_free(&vma_cache, v);
+    }
+  }
+  return 0;
+}
+
+int
+vma_mapped(uintptr_t start, uintptr_t end)
+{
+  struct vma* v;
+
+  while (start < end) {
+    v = vma_find(start);
+    if (!v)
+      return 0;
+    start = v->end;
+  }
+  return 1;
+}
+
+/* split the VMA around addr in two there, using spare for the upper part */
+static void
+vma_split_at(uintptr_t addr, struct vma** spare)
+{
+  struct vma* v = vma_find(addr);
+  struct vma* tail;
+
+  if (!v || v->start == addr)
+    return;
+
+  tail = *spare;
+  *spare = NULL;
+  vma_unlink(v);
+  *tail = *v;
+  tail->start = addr;
+  v->end = addr;
+  vma_link(v);
+  vma_link(tail);
+}
+
+/* give all of [start, end) the prot, unless it is negative, and set and
+ * clear its flags */
+static int
+vma_modify(uintptr_t start, uintptr_t end, int prot, int set, int clear)
+{
+  struct vma* spares[2];
+  struct vma *v, *next;
+
+  assert(IS_ALIGNED(start, RISCV_PAGE_BITS) && IS_ALIGNED(end, RISCV_PAGE_BITS));
+  assert(start < end && vma_mapped(start, end));
+
+  /* both ends may split a VMA; take the records first so that running out
+   * changes nothing */
+  spares[0] = (struct vma*)spa_cache_alloc(&vma_cache);
+  spares[1] = (struct vma*)spa_cache_alloc(&vma_cache);
+  if (!spares[0] || !spares[1]) {
+    if (spares[0])
+      spa_cache_free(&vma_cache, spares[0]);
+    if (spares[1])
+      spa_cache_free(&vma_cache, spares[1]);
+    return -1;
+  }
+
+  vma_split_at(start, &spares[0]);
+  vma_split_at(end, &spares[1]);
+  for (v = vma_find(start); v && v->start < end; v = vma_next(v->end)) {
+    if (prot >= 0)
+      v->prot = prot;
+    v->flags = (v->flags & ~clear) | set;
+  }
+
+  /* merge what now has the same prot and flags, from the VMA before the
+   * range to the one after it */
+  v = start ? vma_find(start - 1) : NULL;
+  if (!v)
+    v = vma_find(start);
+  while (v && v->start <= end) {
+    next = vma_next(v->end);
+    if (!next || next->start > end)
+      break;
+    if (next->start != v->end || next->prot != v->prot ||
+        next->flags != v->flags) {
+      v = next;
+      continue;
+    }
+    vma_unlink(v);
+    vma_unlink(next);
+    v->end = next->end;
+    spa_cache_free(&vma_cache, next);
+    vma_link(v);
+  }
+
+  if (spares[0])
+    spa_cache_free(&vma_cache, spares[0]);
+  if (spares[1])
+    spa_cache_free(&vma_cache, spares[1]);
+  return 0;
+}
+
+int
+vma_protect(uintptr_t start, uintptr_t end, int prot)
+{
+  return vma_modify(start, end, prot, 0, 0);
+}
+
+int
+vma_advise(uintptr_t start, uintptr_t end, int set, int clear)
+{
+  return vma_modify(start, end, -1, set, clear);
+}
+
+#endif /* USE_FREEMEM */
@@ -0,0 +1,55 @@
+#ifndef _VMA_H_
+#define _VMA_H_
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef USE_FREEMEM
+
+/* what a VMA is for */
+#define VMA_ANON 0x1 // anonymous mmap
+#define VMA_HEAP 0x2 // brk
+/* and how it is used (madvise) */
+#define VMA_SEQUENTIAL 0x4 // back pages ahead of faults
+
+/* A mapped range [start, end) of user VA, both page aligned. Adjacent
+ * ranges with the same prot and flags are always one VMA. */
+struct vma
+{
+  uintptr_t start;
+  uintptr_t end;
+  int prot;  // PTE flags of its pages
+  int flags; // VMA_*
+
+  /* treap, private to vma.c */
+  struct vma* left;
+  struct vma* right;
+  uint32_t priority;
+  /* of the subtree: first start, last end and widest hole between VMAs */
+  uintptr_t min_start;
+  uintptr_t max_end;
+  uintptr_t max_gap;
+};
+
+/* the VMA containing addr, or NULL */
+struct vma* vma_find(uintptr_t addr);
+/* the first VMA that ends above addr, or NULL */
+struct vma* vma_next(uintptr_t addr);
+/* lowest address in [lo, hi) where len bytes are unmapped, or 0 */
+uintptr_t vma_find_gap(uintptr_t lo, uintptr_t hi, size_t len);
+/* map [start, end), which must be unmapped; returns -1 if out of memory */
+int vma_insert(uintptr_t start, uintptr_t end, int prot, int flags);
+/* unmap whatever is in [start, end); returns -1 if out of memory, when
+ * nothing has changed */
+int vma_remove(uintptr_t start, uintptr_t end);
+/* whether all of [start, end) is mapped */
+int vma_mapped(uintptr_t start, uintptr_t end);
+/* give all of [start, end), which must be mapped, the given prot; returns
+ * -1 if out of memory, when nothing has changed */
+int vma_protect(uintptr_t start, uintptr_t end, int prot);
+/* set and clear flags of all of [start, end), which must be mapped;
+ * returns -1 if out of memory, when nothing has changed */
+int vma_advise(uintptr_t start, uintptr_t end, int set, int clear);
+
+#endif /* USE_FREEMEM */
+
+#endif /* _VMA_H_ */